@@ -0,0 +1,315 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include "benchmark.h"
+#include "copy_engine.h"
+#include "file_utils.h"
+#include "parser.h"
+#include "xml_scan.h"
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  warm_source
+    Description:  Reads a file once so both copy methods start with the same
+                 (hot) page cache instead of the first one paying for the disk
+   =====================================================================================
+*/
+static void warm_source(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if(fd < 0) {
+    return;
+  }
+
+  char *buffer = malloc(COPY_BUFFER_SIZE);
+
+  if(buffer) {
+    while(read(fd, buffer, COPY_BUFFER_SIZE) > 0) {
+    }
+
+    free(buffer);
+  }
+
+  close(fd);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  print_rate
+    Description:  Prints one benchmark row in bytes per second
+   =====================================================================================
+*/
+static void print_rate(const char *label, unsigned long long bytes, double seconds) {
+  double rate = seconds > 0 ? (double)bytes / seconds : 0.0;
+  printf("  %-20s %14llu bytes %10.3f s %16.0f bytes/s (%.1f MiB/s)\n", label, bytes, seconds, rate, rate / (1024.0 * 1024.0));
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  run_copy_benchmark
+    Description:  Copies every resource of the project twice into 'scratch_dir',
+                 once with the old 4 KiB fread/fwrite loop and once with the copy
+                 engine, and prints the byte/second figures of both. The scratch
+                 directory is created if needed and the copies are removed again;
+                 nothing is collected.
+                 Returns 1 on success, 0 if nothing could be measured.
+   =====================================================================================
+*/
+int run_copy_benchmark(char **resources, size_t resource_count, const char *project_root, const char *scratch_dir) {
+  // The output directory may not exist yet; one error beats a failed copy per file
+  if(!create_directory(scratch_dir)) {
+    fprintf(stderr, "Error: Cannot create benchmark directory %s: %s\n", scratch_dir, strerror(errno));
+    return 0;
+  }
+
+  char *scratch_file = concat_paths(scratch_dir, ".copy_benchmark.tmp");
+
+  if(!scratch_file) {
+    perror("Failed to allocate memory for benchmark scratch path");
+    return 0;
+  }
+
+  unsigned long long bytes = 0;
+  double stdio_seconds = 0.0;
+  double engine_seconds = 0.0;
+  size_t measured = 0;
+  CopyStats saved_stats = copy_stats;
+
+  for(size_t i = 0; i < resource_count; ++i) {
+    char full_source_path[4096] = {0};
+    struct stat st;
+
+    if(!resolve_source_path(resources[i], project_root, full_source_path, sizeof(full_source_path)) ||
+       stat(full_source_path, &st) != 0 || !S_ISREG(st.st_mode)) {
+      continue; // Missing or special files say nothing about throughput
+    }
+
+    warm_source(full_source_path);
+    double started = monotonic_seconds();
+
+    if(!copy_file_contents_stdio(full_source_path, scratch_file)) {
+      continue;
+    }
+
+    stdio_seconds += monotonic_seconds() - started;
+    unlink(scratch_file);
+    started = monotonic_seconds();
+
+    if(!copy_file_contents(full_source_path, scratch_file)) {
+      continue;
+    }
+
+    engine_seconds += monotonic_seconds() - started;
+    unlink(scratch_file);
+    bytes += (unsigned long long)st.st_size;
+    measured++;
+  }
+
+  unlink(scratch_file);
+  free(scratch_file);
+
+  if(measured == 0) {
+    fprintf(stderr, "Error: No readable resources to benchmark.\n");
+    copy_stats = saved_stats;
+    return 0;
+  }
+
+  printf("Copy benchmark over %zu file(s):\n", measured);
+  print_rate(copy_method_name(COPY_METHOD_STDIO), bytes, stdio_seconds);
+  print_rate("copy engine", bytes, engine_seconds);
+
+  for(int i = 0; i < COPY_METHOD_COUNT; i++) {
+    if(copy_stats.files[i] > saved_stats.files[i]) {
+      printf("    engine used %s for %llu file(s)\n", copy_method_name((CopyMethod)i), copy_stats.files[i] - saved_stats.files[i]);
+    }
+  }
+
+  if(engine_seconds > 0) {
+    printf("  Speed-up: %.2fx\n", stdio_seconds / engine_seconds);
+  }
+
+  copy_stats = saved_stats;
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  line_scan_resources
+    Description:  The line-based scan parse_project() used before
+                 xml_scan_properties(): fgets() into a 4 KiB line and strstr() for
+                 each tag. Returns the number of resources it finds.
+   =====================================================================================
+*/
+static size_t line_scan_resources(FILE *file) {
+  char line[4096];
+  int inside_chain_or_producer = 0;
+  int inside_transition = 0;
+  size_t found = 0;
+
+  while(fgets(line, sizeof(line), file)) {
+    if(strstr(line, "<chain id=") || strstr(line, "<producer id=")) {
+      inside_chain_or_producer = 1;
+    }
+
+    else if(inside_chain_or_producer && (strstr(line, "</chain>") || strstr(line, "</producer>"))) {
+      inside_chain_or_producer = 0;
+    }
+
+    if(inside_chain_or_producer && strstr(line, "<property name=\"resource\">")) {
+      found++;
+    }
+
+    else if(strstr(line, "<transition")) {
+      inside_transition = 1;
+    }
+
+    else if(inside_transition && strstr(line, "</transition>")) {
+      inside_transition = 0;
+    }
+
+    else if(inside_transition && strstr(line, "<property name=\"resource\">")) {
+      found++;
+    }
+  }
+
+  return found;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  count_resource
+    Description:  xml_scan_properties() handler of the parser benchmark: counts the
+                 resources parse_project() keeps
+   =====================================================================================
+*/
+static int count_resource(const XmlProperty *property, void *context) {
+  if(property->kind == XML_PROPERTY_RESOURCE && (property->in_producer || property->in_transition)) {
+    (*(size_t *)context)++;
+  }
+
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  build_synthetic_project
+    Description:  Returns a project made of the header of 'data', everything inside
+                 its <mlt> element repeated 'scale' times, and its closing tag,
+                 storing its length in '*size'. Returns NULL on failure.
+   =====================================================================================
+*/
+static char *build_synthetic_project(const char *data, size_t length, size_t scale, size_t *size) {
+  const char *mlt = memmem(data, length, "<mlt", 4);
+  const char *body = mlt ? memchr(mlt, '>', data + length - mlt) : NULL;
+  const char *footer = NULL;
+
+  for(const char *p = body; p && (p = memmem(p, data + length - p, "</mlt>", 6)) != NULL; p++) {
+    footer = p;
+  }
+
+  if(!body || !footer || ++body > footer) {
+    fprintf(stderr, "Error: The project has no <mlt> element to repeat.\n");
+    return NULL;
+  }
+
+  size_t header_length = body - data;
+  size_t body_length = footer - body;
+  size_t footer_length = data + length - footer;
+
+  if(body_length && scale > (SIZE_MAX - header_length - footer_length - 1) / body_length) {
+    fprintf(stderr, "Error: The synthetic project would be too large.\n");
+    return NULL;
+  }
+
+  *size = header_length + body_length * scale + footer_length;
+  char *synthetic = malloc(*size + 1);
+
+  if(!synthetic) {
+    perror("Failed to allocate memory for the synthetic project");
+    return NULL;
+  }
+
+  char *p = synthetic;
+  memcpy(p, data, header_length);
+  p += header_length;
+
+  for(size_t i = 0; i < scale; i++) {
+    memcpy(p, body, body_length);
+    p += body_length;
+  }
+
+  memcpy(p, footer, footer_length);
+  synthetic[*size] = '\0';
+  return synthetic;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  run_parser_benchmark
+    Description:  Repeats the body of 'project_file' 'scale' times in memory and
+                 finds its resources with the old line-based strstr() scan, then
+                 with xml_scan_properties() using each search level the CPU
+                 supports, printing the throughput of each. Nothing is collected.
+                 Returns 1 on success, 0 on failure.
+   =====================================================================================
+*/
+int run_parser_benchmark(const char *project_file, size_t scale) {
+  ProjectFile project;
+
+  if(!map_project_file(project_file, &project)) {
+    return 0;
+  }
+
+  size_t size = 0;
+  char *synthetic = build_synthetic_project(project.data, project.size, scale, &size);
+  unmap_project_file(&project);
+
+  if(!synthetic) {
+    return 0;
+  }
+
+  FILE *file = fmemopen(synthetic, size, "r");
+
+  if(!file) {
+    perror("Failed to open the synthetic project");
+    free(synthetic);
+    return 0;
+  }
+
+  double started = monotonic_seconds();
+  size_t line_found = line_scan_resources(file);
+  double line_seconds = monotonic_seconds() - started;
+  fclose(file);
+  printf("Parser benchmark over %s repeated %zu time(s):\n", project_file, scale);
+  print_rate("strstr lines", size, line_seconds);
+  printf("    found %zu resource(s)\n", line_found);
+  XmlScanLevel best = xml_scan_best_level();
+
+  // The tokenizer once with every search this CPU has, the one collections use last
+  for(int level = XML_SCAN_SCALAR; level <= (int)best; level++) {
+    char label[32];
+    size_t scan_found = 0;
+    xml_scan_use_level((XmlScanLevel)level);
+    started = monotonic_seconds();
+    xml_scan_properties(synthetic, size, count_resource, &scan_found);
+    double scan_seconds = monotonic_seconds() - started;
+    snprintf(label, sizeof(label), "xml_scan %s", xml_scan_level_name((XmlScanLevel)level));
+    print_rate(label, size, scan_seconds);
+    printf("    found %zu resource(s)", scan_found);
+
+    if(scan_seconds > 0) {
+      printf(", %.2fx as fast as the strstr lines", line_seconds / scan_seconds);
+    }
+
+    printf("\n");
+  }
+
+  free(synthetic);
+  return 1;
+}
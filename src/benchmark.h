@@ -0,0 +1,9 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <stdio.h>
+
+int run_copy_benchmark(char **resources, size_t resource_count, const char *project_root, const char *scratch_dir);
+int run_parser_benchmark(const char *project_file, size_t scale);
+
+#endif // BENCHMARK_H
@@ -0,0 +1,456 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "checksums.h"
+#include "file_utils.h"
+#include "copy_engine.h"
+#include "publish.h"
+
+/*
+   One file of the bundle and its checksum, keyed by the path relative to the
+   output directory
+*/
+typedef struct {
+  char *path;
+  char hex[CHECKSUM_HEX_MAX];
+  size_t order;        // Recording order; the last record of a path wins
+} ChecksumEntry;
+
+typedef struct {
+  char *output_dir;
+  size_t output_dir_len;
+  ChecksumAlgorithm algorithm;
+  ChecksumEntry *entries;
+  size_t count;
+  size_t capacity;
+  pthread_mutex_t lock;
+} ChecksumList;
+
+static ChecksumList checksums = { NULL, 0, CHECKSUM_NONE, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+/*
+   One line of a .checksums file being verified, and the outcome
+*/
+typedef struct {
+  ChecksumAlgorithm algorithm;
+  char *path;
+  char expected[CHECKSUM_HEX_MAX];
+  int status;          // 1 OK, 0 mismatch, -1 unreadable
+  off_t size;
+} VerifyItem;
+
+typedef struct {
+  VerifyItem *items;
+  size_t count;
+  size_t next;
+  pthread_mutex_t lock;
+} VerifyQueue;
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  checksums_begin
+    Description:  Starts collecting checksums for the bundle in 'output_dir'.
+                 Returns 1 on success, 0 when out of memory.
+   =====================================================================================
+*/
+int checksums_begin(const char *output_dir, ChecksumAlgorithm algorithm) {
+  checksums.output_dir = strdup(output_dir);
+
+  if(!checksums.output_dir) {
+    perror("Failed to allocate memory for checksums");
+    return 0;
+  }
+
+  checksums.output_dir_len = strlen(output_dir);
+  checksums.algorithm = algorithm;
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  checksums_record
+    Description:  Stores the checksum of a file just put into the bundle. Called by
+                 the copy engine from any thread; if a file is recorded twice the
+                 later record is the one written.
+   =====================================================================================
+*/
+void checksums_record(const char *destination, const char *hex) {
+  if(!checksums.output_dir) {
+    return;
+  }
+
+  const char *path = destination;
+
+  if(strncmp(destination, checksums.output_dir, checksums.output_dir_len) == 0 &&
+     destination[checksums.output_dir_len] == '/') {
+    path += checksums.output_dir_len + 1;
+  }
+
+  pthread_mutex_lock(&checksums.lock);
+
+  if(checksums.count == checksums.capacity) {
+    size_t capacity = checksums.capacity ? checksums.capacity * 2 : 64;
+    ChecksumEntry *entries = realloc(checksums.entries, capacity * sizeof(ChecksumEntry));
+
+    if(!entries) {
+      pthread_mutex_unlock(&checksums.lock);
+      return;
+    }
+
+    checksums.entries = entries;
+    checksums.capacity = capacity;
+  }
+
+  ChecksumEntry *entry = &checksums.entries[checksums.count];
+
+  if(!(entry->path = strdup(path))) {
+    pthread_mutex_unlock(&checksums.lock);
+    return;
+  }
+
+  entry->order = checksums.count++;
+  snprintf(entry->hex, sizeof(entry->hex), "%s", hex);
+  pthread_mutex_unlock(&checksums.lock);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  checksums_record_file
+    Description:  Reads a bundle file that was not copied in this run (an unchanged
+                 asset, the project file) and records its checksum.
+                 Returns 1 on success, 0 if it could not be read.
+   =====================================================================================
+*/
+int checksums_record_file(const char *path) {
+  char hex[CHECKSUM_HEX_MAX];
+
+  if(!checksums.output_dir) {
+    return 1;
+  }
+
+  if(!checksum_file(path, checksums.algorithm, hex)) {
+    return 0;
+  }
+
+  checksums_record(path, hex);
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  compare_entries
+    Description:  qsort() comparator for checksums_print(): orders entries by path,
+                 and records of the same path in the order they were made
+   =====================================================================================
+*/
+static int compare_entries(const void *a, const void *b) {
+  const ChecksumEntry *x = a;
+  const ChecksumEntry *y = b;
+  int order = strcmp(x->path, y->path);
+  return order != 0 ? order : (x->order < y->order ? -1 : (x->order > y->order));
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  checksums_print
+    Description:  Writes the recorded checksums to 'stream', sorted by path so the
+                 file does not depend on the copy order, and ends the collection.
+                 The BSD layout ("SHA256 (path) = digest") keeps SHA-256 files
+                 checkable with "sha256sum -c". Returns the number of lines.
+   =====================================================================================
+*/
+size_t checksums_print(FILE *stream) {
+  size_t written = 0;
+  qsort(checksums.entries, checksums.count, sizeof(ChecksumEntry), compare_entries);
+
+  for(size_t i = 0; i < checksums.count; i++) {
+    if(i + 1 < checksums.count && strcmp(checksums.entries[i].path, checksums.entries[i + 1].path) == 0) {
+      continue; // Superseded by a later record of the same file
+    }
+
+    fprintf(stream, "%s (%s) = %s\n", checksum_name(checksums.algorithm), checksums.entries[i].path, checksums.entries[i].hex);
+    written++;
+  }
+
+  for(size_t i = 0; i < checksums.count; i++) {
+    free(checksums.entries[i].path);
+  }
+
+  free(checksums.entries);
+  free(checksums.output_dir);
+  checksums.entries = NULL;
+  checksums.output_dir = NULL;
+  checksums.count = checksums.capacity = 0;
+  return written;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  checksums_write
+    Description:  Adds the rewritten project itself, read from 'contents' (the
+                 temporary file it is written to before it is published), and
+                 writes all checksums to '<project_file>.checksums'.
+                 Returns 1 on success, 0 on failure.
+   =====================================================================================
+*/
+int checksums_write(const char *project_file, const char *contents) {
+  char hex[CHECKSUM_HEX_MAX];
+
+  if(!checksums.output_dir) {
+    return 1;
+  }
+
+  if(!checksum_file(contents, checksums.algorithm, hex)) {
+    fprintf(stderr, "Error: Cannot read %s for its checksum.\n", contents);
+    return 0;
+  }
+
+  checksums_record(project_file, hex);
+
+  size_t len = strlen(project_file);
+  char *path = malloc(len + sizeof(CHECKSUMS_SUFFIX));
+
+  if(!path) {
+    perror("Failed to allocate memory for checksums path");
+    return 0;
+  }
+
+  snprintf(path, len + sizeof(CHECKSUMS_SUFFIX), "%s%s", project_file, CHECKSUMS_SUFFIX);
+  char *temporary = temporary_path(path);
+  FILE *file = temporary ? fopen(temporary, "w") : NULL;
+
+  if(!file) {
+    perror("Failed to write checksums");
+    free(temporary);
+    free(path);
+    return 0;
+  }
+
+  ChecksumAlgorithm algorithm = checksums.algorithm;
+  size_t written = checksums_print(file);
+  int ok = !ferror(file);
+  ok = fclose(file) == 0 && ok;
+
+  if(!ok) {
+    perror("Failed to write checksums");
+    unlink(temporary);
+  }
+
+  else if(publish_file(temporary, path)) {
+    printf("Wrote %zu %s checksum(s) to %s\n", written, checksum_name(algorithm), path);
+  }
+
+  else {
+    ok = 0;
+  }
+
+  free(temporary);
+  free(path);
+  return ok;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  parse_verify_line
+    Description:  Parses "ALGORITHM (path) = digest" into 'item', resolving the path
+                 against 'base_dir'. Returns 1 on success, 0 for a malformed line.
+   =====================================================================================
+*/
+static int parse_verify_line(char *line, const char *base_dir, VerifyItem *item) {
+  char *open_paren = strstr(line, " (");
+  char *close_paren = strstr(line, ") = ");
+
+  // A path may itself contain ") = ", so use the last occurrence
+  for(char *next = close_paren; next; next = strstr(next + 1, ") = ")) {
+    close_paren = next;
+  }
+
+  if(!open_paren || !close_paren || close_paren < open_paren) {
+    return 0;
+  }
+
+  *open_paren = '\0';
+  *close_paren = '\0';
+
+  if(strcmp(line, "XXH64") == 0) {
+    item->algorithm = CHECKSUM_XXH64;
+  }
+
+  else if(strcmp(line, "SHA256") == 0) {
+    item->algorithm = CHECKSUM_SHA256;
+  }
+
+  else {
+    return 0;
+  }
+
+  snprintf(item->expected, sizeof(item->expected), "%s", close_paren + 4);
+  const char *relative = open_paren + 2;
+  item->path = relative[0] == '/' ? strdup(relative) : concat_paths(base_dir, relative);
+  item->status = -1;
+  item->size = 0;
+  return item->path != NULL;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  verify_worker
+    Description:  Thread body of verify_bundle(): checksums files until none are left
+   =====================================================================================
+*/
+static void *verify_worker(void *arg) {
+  VerifyQueue *queue = arg;
+
+  for(;;) {
+    pthread_mutex_lock(&queue->lock);
+    size_t i = queue->next++;
+    pthread_mutex_unlock(&queue->lock);
+
+    if(i >= queue->count) {
+      break;
+    }
+
+    VerifyItem *item = &queue->items[i];
+    char hex[CHECKSUM_HEX_MAX];
+    struct stat st;
+
+    if(stat(item->path, &st) == 0 && checksum_file(item->path, item->algorithm, hex)) {
+      item->size = st.st_size;
+      item->status = strcmp(hex, item->expected) == 0;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  verify_bundle
+    Description:  Re-reads every file listed in a .checksums file with 'jobs'
+                 threads and compares the checksums. Paths are relative to the
+                 directory of the .checksums file. Prints every failure and a
+                 summary. Returns 1 if all files matched, 0 otherwise.
+   =====================================================================================
+*/
+int verify_bundle(const char *checksums_file, int jobs) {
+  FILE *file = fopen(checksums_file, "r");
+
+  if(!file) {
+    perror("Failed to open checksums file");
+    return 0;
+  }
+
+  char *base_dir = strdup(checksums_file);
+  char *last_slash = base_dir ? strrchr(base_dir, '/') : NULL;
+
+  if(!base_dir) {
+    perror("Failed to allocate memory for verification");
+    fclose(file);
+    return 0;
+  }
+
+  if(last_slash) {
+    *last_slash = '\0';
+  }
+
+  else {
+    strcpy(base_dir, ".");
+  }
+
+  VerifyQueue queue = { NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+  size_t capacity = 0;
+  size_t malformed = 0;
+  char line[BUFFER * 3];
+
+  while(fgets(line, sizeof(line), file)) {
+    line[strcspn(line, "\n")] = '\0';
+
+    if(line[0] == '\0') {
+      continue;
+    }
+
+    if(queue.count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      VerifyItem *items = realloc(queue.items, capacity * sizeof(VerifyItem));
+
+      if(!items) {
+        perror("Failed to allocate memory for verification");
+        break;
+      }
+
+      queue.items = items;
+    }
+
+    if(parse_verify_line(line, base_dir, &queue.items[queue.count])) {
+      queue.count++;
+    }
+
+    else {
+      malformed++;
+    }
+  }
+
+  fclose(file);
+  free(base_dir);
+  double started = monotonic_seconds();
+  pthread_t threads[MAX_VERIFY_JOBS];
+  int started_threads = 0;
+
+  for(int i = 0; i < jobs && i < MAX_VERIFY_JOBS && (size_t)i < queue.count; i++) {
+    if(pthread_create(&threads[i], NULL, verify_worker, &queue) != 0) {
+      break;
+    }
+
+    started_threads++;
+  }
+
+  if(started_threads == 0) {
+    verify_worker(&queue);
+  }
+
+  for(int i = 0; i < started_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  double seconds = monotonic_seconds() - started;
+  size_t ok = 0;
+  size_t failed = 0;
+  size_t missing = 0;
+  unsigned long long bytes = 0;
+
+  for(size_t i = 0; i < queue.count; i++) {
+    VerifyItem *item = &queue.items[i];
+    bytes += (unsigned long long)item->size;
+
+    if(item->status == 1) {
+      ok++;
+    }
+
+    else if(item->status == 0) {
+      printf("FAILED: %s\n", item->path);
+      failed++;
+    }
+
+    else {
+      printf("MISSING: %s\n", item->path);
+      missing++;
+    }
+
+    free(item->path);
+  }
+
+  free(queue.items);
+  double mib = (double)bytes / (1024.0 * 1024.0);
+  printf("Verified %zu file(s), %.1f MiB in %.2f s with %d thread(s): %zu OK, %zu failed, %zu missing",
+         queue.count, mib, seconds, started_threads ? started_threads : 1, ok, failed, missing);
+
+  if(malformed > 0) {
+    printf(", %zu malformed line(s)", malformed);
+  }
+
+  printf("\n");
+  return failed == 0 && missing == 0 && malformed == 0 && queue.count > 0;
+}
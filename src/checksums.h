@@ -0,0 +1,19 @@
+#ifndef CHECKSUMS_H
+#define CHECKSUMS_H
+
+#include <stdio.h>
+#include "hash.h"
+
+// Suffix of the checksum file written next to the rewritten project
+#define  CHECKSUMS_SUFFIX  ".checksums"
+// Upper bound for the threads of --verify
+#define  MAX_VERIFY_JOBS  256
+
+int checksums_begin(const char *output_dir, ChecksumAlgorithm algorithm);
+void checksums_record(const char *destination, const char *hex);
+int checksums_record_file(const char *path);
+size_t checksums_print(FILE *stream);
+int checksums_write(const char *project_file, const char *contents);
+int verify_bundle(const char *checksums_file, int jobs);
+
+#endif // CHECKSUMS_H
@@ -0,0 +1,1772 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/ioprio.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "copy_engine.h"
+#include "uring_copy.h"
+#include "manifest.h"
+#include "journal.h"
+#include "checksums.h"
+#include "publish.h"
+#include "progress.h"
+#include "logging.h"
+
+// Largest request handed to copy_file_range()/sendfile() in one call
+#define  KERNEL_COPY_CHUNK  (1024L * 1024L * 1024L)
+// Seconds of --max-bandwidth a copy may save up while it is idle
+#define  THROTTLE_BURST  0.25
+
+CopyStats copy_stats; // Global copy statistics
+CopyOptions copy_options = { REFLINK_AUTO, LINK_COPY, COPY_BACKEND_SYNC, DEFAULT_CHUNK_THRESHOLD, 1, CHECKSUM_NONE, 1, 0, 0, OUTPUT_DIRECTORY }; // Global copy options
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER; // Guards copy_stats
+
+// A kernel-side copy strategy: copy_with_copy_file_range() or copy_with_sendfile()
+typedef int (*KernelCopy)(int in, int out, off_t size, off_t *copied);
+
+/*
+   How far a sequential copy has got. Bytes below 'reported' are counted in the
+   progress display. With 'drop_cache', writeback of the destination has been
+   started below 'started', and below 'released' both files have been dropped
+   from the page cache.
+*/
+typedef struct {
+  int in;
+  int out;
+  int drop_cache;
+  off_t reported;
+  off_t started;
+  off_t released;
+} CopyWindow;
+
+/*
+   One file being copied by several chunk streams. Each stream takes the next
+   CHUNK_SIZE range from 'next' until the whole file is claimed.
+*/
+typedef struct {
+  int in;
+  int out;
+  off_t size;
+  off_t next;
+  unsigned long long copied;
+  int failed;
+  int saved_errno;
+  int kernel_copy;
+  pthread_mutex_t lock;
+} ChunkedCopy;
+
+/*
+   Small files waiting for the io_uring backend. Each thread batches its own
+   files, so worker threads never share a batch.
+*/
+typedef struct {
+  UringCopy items[URING_BATCH];
+  size_t count;
+  unsigned long long bytes;
+} PendingBatch;
+
+static __thread PendingBatch pending;
+
+/*
+   The --max-bandwidth token bucket, shared by every thread that copies.
+   'tokens' may go negative: a copy takes what it is about to move at once and
+   then sleeps off the debt, so parallel jobs and chunk streams queue up
+   behind each other and their total stays at the limit.
+*/
+typedef struct {
+  double tokens;
+  double updated;
+  pthread_mutex_t lock;
+} TokenBucket;
+
+static TokenBucket bucket = { 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  monotonic_seconds
+    Description:  Returns a monotonic timestamp in seconds for throughput measurements
+   =====================================================================================
+*/
+double monotonic_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  copy_method_name
+    Description:  Returns a printable name for a copy method
+   =====================================================================================
+*/
+const char *copy_method_name(CopyMethod method) {
+  switch(method) {
+    case COPY_METHOD_HARDLINK:
+      return "hard link";
+
+    case COPY_METHOD_SYMLINK:
+      return "symlink";
+
+    case COPY_METHOD_REFLINK:
+      return "reflink";
+
+    case COPY_METHOD_IO_URING:
+      return "io_uring";
+
+    case COPY_METHOD_SPARSE:
+      return "sparse";
+
+    case COPY_METHOD_CHUNKED:
+      return "chunked";
+
+    case COPY_METHOD_DIRECT_IO:
+      return "O_DIRECT";
+
+    case COPY_METHOD_COPY_FILE_RANGE:
+      return "copy_file_range";
+
+    case COPY_METHOD_SENDFILE:
+      return "sendfile";
+
+    case COPY_METHOD_READ_WRITE:
+      return "read/write";
+
+    case COPY_METHOD_STDIO:
+      return "stdio 4 KiB";
+
+    default:
+      return "unknown";
+  }
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  record_copy
+    Description:  Adds one finished file to copy_stats. 'started' is the time the
+                 copy began; it is used to track the wall-clock span of all copies.
+   =====================================================================================
+*/
+void record_copy(CopyMethod method, unsigned long long bytes, double started) {
+  double finished = monotonic_seconds();
+  pthread_mutex_lock(&stats_lock);
+  copy_stats.files[method]++;
+  copy_stats.bytes[method] += bytes;
+
+  if(method != COPY_METHOD_HARDLINK && method != COPY_METHOD_SYMLINK) {
+    if(copy_stats.first_started == 0 || started < copy_stats.first_started) {
+      copy_stats.first_started = started;
+    }
+
+    if(finished > copy_stats.last_finished) {
+      copy_stats.last_finished = finished;
+    }
+  }
+
+  pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  record_skip
+    Description:  Counts an asset that an earlier collection already copied and
+                 that has not changed since
+   =====================================================================================
+*/
+void record_skip(unsigned long long bytes) {
+  pthread_mutex_lock(&stats_lock);
+  copy_stats.skipped_files++;
+  copy_stats.skipped_bytes += bytes;
+  pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  record_resume
+    Description:  Counts an interrupted copy continued with --resume and the bytes
+                 that did not have to be copied again
+   =====================================================================================
+*/
+void record_resume(unsigned long long bytes) {
+  pthread_mutex_lock(&stats_lock);
+  copy_stats.resumed_files++;
+  copy_stats.resumed_bytes += bytes;
+  pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  record_failure
+    Description:  Counts an asset that could not be put in the bundle. A source
+                 that does not exist is not counted: the preflight has already
+                 reported it as missing, and such a file is never collected.
+   =====================================================================================
+*/
+void record_failure(const char *source) {
+  struct stat st;
+
+  if(stat(source, &st) != 0 && errno == ENOENT) {
+    return;
+  }
+
+  pthread_mutex_lock(&stats_lock);
+  copy_stats.failed_files++;
+  pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  parse_reflink_mode
+    Description:  Parses the value of --reflink (auto, always or never).
+                 Returns 1 on success, 0 for an unknown value.
+   =====================================================================================
+*/
+int parse_reflink_mode(const char *value, ReflinkMode *mode) {
+  if(strcmp(value, "auto") == 0) {
+    *mode = REFLINK_AUTO;
+  }
+
+  else if(strcmp(value, "always") == 0) {
+    *mode = REFLINK_ALWAYS;
+  }
+
+  else if(strcmp(value, "never") == 0) {
+    *mode = REFLINK_NEVER;
+  }
+
+  else {
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  parse_link_mode
+    Description:  Parses the value of --link (hard, sym or copy).
+                 Returns 1 on success, 0 for an unknown value.
+   =====================================================================================
+*/
+int parse_link_mode(const char *value, LinkMode *mode) {
+  if(strcmp(value, "copy") == 0) {
+    *mode = LINK_COPY;
+  }
+
+  else if(strcmp(value, "hard") == 0) {
+    *mode = LINK_HARD;
+  }
+
+  else if(strcmp(value, "sym") == 0) {
+    *mode = LINK_SYM;
+  }
+
+  else {
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  parse_copy_backend
+    Description:  Parses the value of --backend (sync or io_uring). Selecting io_uring
+                 on a kernel without support prints a note and keeps sync.
+                 Returns 1 on success, 0 for an unknown value.
+   =====================================================================================
+*/
+int parse_copy_backend(const char *value, CopyBackend *backend) {
+  if(strcmp(value, "sync") == 0) {
+    *backend = COPY_BACKEND_SYNC;
+  }
+
+  else if(strcmp(value, "io_uring") == 0) {
+    if(uring_copy_supported()) {
+      *backend = COPY_BACKEND_IO_URING;
+    }
+
+    else {
+      fprintf(stderr, "Note: io_uring is not available on this system; using the sync backend.\n");
+      *backend = COPY_BACKEND_SYNC;
+    }
+  }
+
+  else {
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  parse_output_format
+    Description:  Parses an --output-format value: "dir", "tar" or "zstd".
+                 Returns 1 on success, 0 for an unknown value.
+   =====================================================================================
+*/
+int parse_output_format(const char *value, OutputFormat *format) {
+  if(strcmp(value, "dir") == 0) {
+    *format = OUTPUT_DIRECTORY;
+  }
+
+  else if(strcmp(value, "tar") == 0) {
+    *format = OUTPUT_TAR;
+  }
+
+  else if(strcmp(value, "zstd") == 0) {
+    *format = OUTPUT_ZSTD;
+  }
+
+  else {
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  parse_byte_size
+    Description:  Parses a byte count with an optional K, M or G suffix (powers of
+                 1024), as used by --chunk-threshold.
+                 Returns 1 on success, 0 for a malformed or zero value.
+   =====================================================================================
+*/
+int parse_byte_size(const char *value, unsigned long long *bytes) {
+  char *end = NULL;
+  errno = 0;
+  unsigned long long number = strtoull(value, &end, 10);
+
+  if(errno != 0 || end == value || number == 0 || value[0] == '-') {
+    return 0;
+  }
+
+  unsigned long long unit = 1;
+
+  switch(*end) {
+    case 'K':
+    case 'k':
+      unit = 1024ULL;
+      end++;
+      break;
+
+    case 'M':
+    case 'm':
+      unit = 1024ULL * 1024ULL;
+      end++;
+      break;
+
+    case 'G':
+    case 'g':
+      unit = 1024ULL * 1024ULL * 1024ULL;
+      end++;
+      break;
+
+    default:
+      break;
+  }
+
+  if(*end != '\0' || number > ~0ULL / unit) {
+    return 0;
+  }
+
+  *bytes = number * unit;
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  parse_bandwidth
+    Description:  Parses the MB/s of --max-bandwidth (1 MB = 1 MiB, as in the status
+                 line); fractions such as 2.5 are allowed.
+                 Returns 1 on success, 0 for a malformed or non-positive value.
+   =====================================================================================
+*/
+int parse_bandwidth(const char *value, unsigned long long *bytes_per_second) {
+  char *end = NULL;
+  errno = 0;
+  double megabytes = strtod(value, &end);
+
+  if(errno != 0 || end == value || *end != '\0' || !(megabytes > 0) || megabytes > 1e9) {
+    return 0;
+  }
+
+  *bytes_per_second = (unsigned long long)(megabytes * 1024.0 * 1024.0);
+  return *bytes_per_second > 0;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  parse_io_priority
+    Description:  Parses an --ioprio value: "idle", or "be:N" for the best-effort
+                 class at level N (0 highest to 7 lowest).
+                 Returns 1 on success, 0 for an unknown value.
+   =====================================================================================
+*/
+int parse_io_priority(const char *value, int *ioprio) {
+  if(strcmp(value, "idle") == 0) {
+    *ioprio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+    return 1;
+  }
+
+  if(strncmp(value, "be:", 3) == 0 && value[3] >= '0' && value[3] < '0' + IOPRIO_BE_NR && value[4] == '\0') {
+    *ioprio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, value[3] - '0');
+    return 1;
+  }
+
+  return 0;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  set_io_priority
+    Description:  Applies an I/O priority from parse_io_priority() to the calling
+                 thread with ioprio_set(). Threads created afterwards inherit it,
+                 so main() calls this before any copy thread starts.
+                 Returns 1 on success, 0 on failure with errno set.
+   =====================================================================================
+*/
+int set_io_priority(int ioprio) {
+  return syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) == 0;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  kernel_copy_unsupported
+    Description:  Tells whether an errno from copy_file_range()/sendfile() means the
+                 call is not usable for this pair of files, so the next strategy
+                 should be tried instead of failing the copy.
+   =====================================================================================
+*/
+static int kernel_copy_unsupported(int err) {
+  return err == EXDEV || err == EINVAL || err == ENOSYS || err == EOPNOTSUPP ||
+         err == ENOTSUP || err == EPERM || err == ETXTBSY;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  throttle_io
+    Description:  Called before every read or copy call of the engine with the bytes
+                 it wants to move. Without --max-bandwidth returns 'want' at once.
+                 Otherwise returns at most THROTTLE_QUANTUM bytes, after sleeping
+                 until the token bucket has paid for them.
+   =====================================================================================
+*/
+size_t throttle_io(size_t want) {
+  if(copy_options.max_bandwidth == 0) {
+    return want;
+  }
+
+  if(want > THROTTLE_QUANTUM) {
+    want = THROTTLE_QUANTUM;
+  }
+
+  double rate = (double)copy_options.max_bandwidth;
+  double burst = rate * THROTTLE_BURST > THROTTLE_QUANTUM ? rate * THROTTLE_BURST : THROTTLE_QUANTUM;
+  pthread_mutex_lock(&bucket.lock);
+  double now = monotonic_seconds();
+  bucket.tokens = bucket.updated == 0 ? burst : bucket.tokens + (now - bucket.updated) * rate;
+  bucket.tokens = bucket.tokens > burst ? burst : bucket.tokens;
+  bucket.updated = now;
+  bucket.tokens -= (double)want;
+  double wait = bucket.tokens < 0 ? -bucket.tokens / rate : 0;
+  pthread_mutex_unlock(&bucket.lock);
+
+  if(wait > 0) {
+    struct timespec delay = { (time_t)wait, (long)((wait - (double)(time_t)wait) * 1e9) };
+
+    while(nanosleep(&delay, &delay) != 0 && errno == EINTR) {
+    }
+  }
+
+  return want;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  release_range
+    Description:  Waits until [offset, offset + length) of 'out' is written back and
+                 drops that range of both files from the page cache. Dirty pages
+                 cannot be dropped, hence the writeback first.
+   =====================================================================================
+*/
+static void release_range(int in, int out, off_t offset, off_t length) {
+  sync_file_range(out, offset, length, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+  posix_fadvise(in, offset, length, POSIX_FADV_DONTNEED);
+  posix_fadvise(out, offset, length, POSIX_FADV_DONTNEED);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  copy_window_advance
+    Description:  Called as a sequential copy reaches 'copied': reports the new
+                 bytes to the progress display, and once a window's worth of new
+                 data is written, starts its writeback and releases the window
+                 before it, which had that long to reach the disk. At most two
+                 windows per copy stay in the page cache.
+   =====================================================================================
+*/
+static void copy_window_advance(CopyWindow *window, off_t copied) {
+  if(!window) {
+    return;
+  }
+
+  progress_advance((unsigned long long)(copied - window->reported));
+  window->reported = copied;
+
+  if(!window->drop_cache || copied - window->started < CACHE_WINDOW) {
+    return;
+  }
+
+  sync_file_range(window->out, window->started, copied - window->started, SYNC_FILE_RANGE_WRITE);
+
+  if(window->started > window->released) {
+    release_range(window->in, window->out, window->released, window->started - window->released);
+    window->released = window->started;
+  }
+
+  window->started = copied;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  copy_window_finish
+    Description:  Ends a copy's cache window: the whole source is dropped, and the
+                 unwritten tail of the destination is only handed to writeback, so
+                 the copy does not wait for the disk (durability comes from the
+                 single syncfs() when the bundle is published).
+   =====================================================================================
+*/
+static void copy_window_finish(CopyWindow *window) {
+  if(!window || !window->drop_cache) {
+    return;
+  }
+
+  sync_file_range(window->out, window->released, 0, SYNC_FILE_RANGE_WRITE);
+  posix_fadvise(window->out, 0, window->released, POSIX_FADV_DONTNEED);
+  posix_fadvise(window->in, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  copy_with_copy_file_range
+    Description:  Copies from the current offset of 'in' until '*copied' reaches
+                 'size' without the data crossing into user space. Returns 1 when
+                 it did, 0 when the caller should fall back to the next strategy
+                 and -1 on a hard error. Offsets of both descriptors are advanced,
+                 so a fallback continues where this left off.
+   =====================================================================================
+*/
+static int copy_with_copy_file_range(int in, int out, off_t size, off_t *copied) {
+  while(*copied < size) {
+    size_t want = throttle_io(size - *copied < KERNEL_COPY_CHUNK ? (size_t)(size - *copied) : KERNEL_COPY_CHUNK);
+    ssize_t n = copy_file_range(in, NULL, out, NULL, want, 0);
+
+    if(n < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+
+      return kernel_copy_unsupported(errno) ? 0 : -1;
+    }
+
+    if(n == 0) {
+      // Some filesystems report EOF early (e.g. generated files); finish elsewhere
+      return 0;
+    }
+
+    *copied += n;
+  }
+
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  copy_with_sendfile
+    Description:  Same contract as copy_with_copy_file_range(), using sendfile(), which
+                 still avoids user space but works across more filesystem pairs on
+                 older kernels.
+   =====================================================================================
+*/
+static int copy_with_sendfile(int in, int out, off_t size, off_t *copied) {
+  while(*copied < size) {
+    size_t want = throttle_io(size - *copied < KERNEL_COPY_CHUNK ? (size_t)(size - *copied) : KERNEL_COPY_CHUNK);
+    ssize_t n = sendfile(out, in, NULL, want);
+
+    if(n < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+
+      return kernel_copy_unsupported(errno) ? 0 : -1;
+    }
+
+    if(n == 0) {
+      return 0;
+    }
+
+    *copied += n;
+  }
+
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  copy_with_read_write
+    Description:  Loop through a large heap buffer: the last resort, and the path
+                 for --checksum because the data passes through user space anyway
+                 and is hashed while still in cache. Runs until EOF rather than
+                 until a size so files that grew or lie about their size are still
+                 copied completely. A journaled 'destination' is checkpointed every
+                 JOURNAL_CHECKPOINT bytes. With O_DIRECT set on the descriptors
+                 (--direct-io) the buffer is aligned and larger, and the unaligned
+                 tail of the file is written through the cache.
+                 Returns 1 on success and -1 on error.
+   =====================================================================================
+*/
+static int copy_with_read_write(int in, int out, off_t *copied, ChecksumState *sum, const char *destination, CopyWindow *window) {
+  int direct = (fcntl(out, F_GETFL) & O_DIRECT) != 0;
+  size_t buffer_size = direct ? DIRECT_IO_BUFFER : COPY_BUFFER_SIZE;
+  char *buffer = NULL;
+  off_t next_checkpoint = (*copied / JOURNAL_CHECKPOINT + 1) * JOURNAL_CHECKPOINT;
+
+  if(posix_memalign((void **)&buffer, DIRECT_IO_ALIGN, buffer_size) != 0) {
+    console_error("Error: Failed to allocate memory for copy buffer\n");
+    return -1;
+  }
+
+  for(;;) {
+    ssize_t bytes_read = read(in, buffer, throttle_io(buffer_size));
+
+    if(bytes_read < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+
+      free(buffer);
+      return -1;
+    }
+
+    if(bytes_read == 0) {
+      break;
+    }
+
+    if(sum) {
+      checksum_update(sum, buffer, (size_t)bytes_read);
+    }
+
+    ssize_t written = 0;
+
+    while(written < bytes_read) {
+      ssize_t n = write(out, buffer + written, bytes_read - written);
+
+      if(n < 0) {
+        if(errno == EINTR) {
+          continue;
+        }
+
+        // O_DIRECT only writes whole blocks; the last partial one goes through the cache
+        if(errno == EINVAL && direct && fcntl(out, F_SETFL, fcntl(out, F_GETFL) & ~O_DIRECT) == 0) {
+          direct = 0;
+          continue;
+        }
+
+        free(buffer);
+        return -1;
+      }
+
+      written += n;
+    }
+
+    *copied += bytes_read;
+    copy_window_advance(window, *copied);
+
+    if(destination && *copied >= next_checkpoint) {
+      if(!journal_checkpoint(out, destination, *copied)) {
+        free(buffer);
+        return -1;
+      }
+
+      next_checkpoint += JOURNAL_CHECKPOINT;
+    }
+  }
+
+  free(buffer);
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  checksum_range
+    Description:  Feeds the first 'length' bytes of 'fd' into a checksum with
+                 pread(), leaving the file offset alone. Used for data the copy
+                 itself did not read: a reflinked file or a resumed prefix.
+                 Returns 1 on success, 0 on a read error.
+   =====================================================================================
+*/
+static int checksum_range(int fd, off_t length, ChecksumState *sum) {
+  char *buffer = malloc(COPY_BUFFER_SIZE);
+
+  if(!buffer) {
+    return 0;
+  }
+
+  for(off_t done = 0; done < length;) {
+    size_t want = length - done < COPY_BUFFER_SIZE ? (size_t)(length - done) : COPY_BUFFER_SIZE;
+    ssize_t n = pread(fd, buffer, want, done);
+
+    if(n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if(n <= 0) {
+      free(buffer);
+      return 0;
+    }
+
+    checksum_update(sum, buffer, (size_t)n);
+    done += n;
+  }
+
+  free(buffer);
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  copy_range
+    Description:  Copies [offset, offset + length) from 'in' to the same offset of
+                 'out' with copy_file_range() at explicit offsets, or with
+                 pread()/pwrite() once the kernel copy is unsupported (tracked in
+                 '*kernel_copy', shared by all streams of the file). Neither file
+                 offset is used, so any number of threads can copy ranges at once.
+                 Data read with pread() is also fed into 'sum' unless it is NULL.
+                 Returns the bytes copied, or -1 with errno set on error.
+   =====================================================================================
+*/
+static off_t copy_range(int in, int out, off_t offset, off_t length, int *kernel_copy, char **buffer, ChecksumState *sum) {
+  off_t done = 0;
+
+  while(done < length) {
+    ssize_t n;
+
+    if(*kernel_copy) {
+      loff_t in_offset = offset + done;
+      loff_t out_offset = offset + done;
+      n = copy_file_range(in, &in_offset, out, &out_offset, throttle_io((size_t)(length - done)), 0);
+
+      if(n < 0 && errno != EINTR && kernel_copy_unsupported(errno)) {
+        *kernel_copy = 0; // A benign race: every stream ends up on pread/pwrite
+        continue;
+      }
+    }
+
+    else {
+      if(!*buffer && !(*buffer = malloc(COPY_BUFFER_SIZE))) {
+        return -1;
+      }
+
+      size_t want = throttle_io(length - done < COPY_BUFFER_SIZE ? (size_t)(length - done) : COPY_BUFFER_SIZE);
+      n = pread(in, *buffer, want, offset + done);
+
+      if(n > 0 && sum) {
+        checksum_update(sum, *buffer, (size_t)n);
+      }
+
+      for(ssize_t written = 0; n > 0 && written < n;) {
+        ssize_t w = pwrite(out, *buffer + written, (size_t)(n - written), offset + done + written);
+
+        if(w < 0) {
+          if(errno == EINTR) {
+            continue;
+          }
+
+          return -1;
+        }
+
+        written += w;
+      }
+    }
+
+    if(n < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+
+      return -1;
+    }
+
+    if(n == 0) {
+      break; // The source shrank while we were copying
+    }
+
+    done += n;
+  }
+
+  return done;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  is_sparse
+    Description:  Tells whether a regular file contains holes. Fewer blocks than its
+                 size needs only says it may: compressed (btrfs, ZFS) and inline
+                 or tail-packed files look the same, so the open file 'in' is
+                 asked for its first hole. With 'in' at -1 only the block count
+                 is checked. The file offset of 'in' is left at 0.
+   =====================================================================================
+*/
+static int is_sparse(int in, const struct stat *st) {
+  if(!S_ISREG(st->st_mode) || st->st_size == 0 || (off_t)st->st_blocks * 512 >= st->st_size) {
+    return 0;
+  }
+
+  if(in < 0) {
+    return 1;
+  }
+
+  off_t hole = lseek(in, 0, SEEK_HOLE);
+  lseek(in, 0, SEEK_SET);
+  return hole >= 0 && hole < st->st_size;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  checksum_hole
+    Description:  Feeds 'length' zero bytes, the contents of a hole, into a checksum
+   =====================================================================================
+*/
+static void checksum_hole(ChecksumState *sum, off_t length) {
+  static const char zeros[64 * 1024];
+
+  while(length > 0) {
+    size_t n = length < (off_t)sizeof(zeros) ? (size_t)length : sizeof(zeros);
+    checksum_update(sum, zeros, n);
+    length -= (off_t)n;
+  }
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  copy_sparse
+    Description:  Copies only the data extents of a sparse file, found with
+                 SEEK_DATA/SEEK_HOLE, to the same offsets of 'out'; the holes are
+                 skipped and stay holes in the copy. The kernel copies the extents
+                 unless the data has to pass through 'sum'. '*data_bytes' receives
+                 the bytes actually copied. Returns 1 on success, 0 if the caller
+                 should copy the file another way (nothing written yet) and -1 on
+                 error.
+   =====================================================================================
+*/
+static int copy_sparse(int in, int out, off_t size, off_t *copied, ChecksumState *sum, CopyWindow *window, off_t *data_bytes) {
+  char *buffer = NULL;
+  int kernel_copy = sum == NULL;
+  off_t position = 0;
+  *data_bytes = 0;
+
+  while(position < size) {
+    off_t data = lseek(in, position, SEEK_DATA);
+
+    if(data < 0 && errno == ENXIO) {
+      data = size; // Nothing but a hole up to EOF
+    }
+
+    off_t hole = data < 0 || data >= size ? data : lseek(in, data, SEEK_HOLE);
+
+    if(data < 0 || hole < 0) {
+      free(buffer);
+      return position == 0 ? 0 : -1;
+    }
+
+    data = data < size ? data : size;
+    hole = hole < size ? hole : size;
+
+    if(sum) {
+      checksum_hole(sum, data - position);
+    }
+
+    if(hole > data) {
+      off_t done = copy_range(in, out, data, hole - data, &kernel_copy, &buffer, sum);
+
+      if(done != hole - data) {
+        free(buffer);
+
+        if(done >= 0) {
+          errno = EIO; // The source shrank while we were copying
+        }
+
+        return -1;
+      }
+
+      *data_bytes += done;
+    }
+
+    position = hole;
+    copy_window_advance(window, position);
+  }
+
+  free(buffer);
+
+  // A trailing hole is only a size
+  if(ftruncate(out, size) != 0) {
+    return -1;
+  }
+
+  *copied = size;
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  chunk_stream
+    Description:  Thread body of copy_in_chunks(): claims CHUNK_SIZE ranges of the
+                 file until none are left or another stream failed
+   =====================================================================================
+*/
+static void *chunk_stream(void *arg) {
+  ChunkedCopy *copy = arg;
+  char *buffer = NULL;
+
+  for(;;) {
+    pthread_mutex_lock(&copy->lock);
+
+    if(copy->failed || copy->next >= copy->size) {
+      pthread_mutex_unlock(&copy->lock);
+      break;
+    }
+
+    off_t offset = copy->next;
+    off_t length = copy->size - offset < CHUNK_SIZE ? copy->size - offset : CHUNK_SIZE;
+    copy->next += length;
+    int kernel_copy = copy->kernel_copy;
+    pthread_mutex_unlock(&copy->lock);
+
+    off_t done = copy_range(copy->in, copy->out, offset, length, &kernel_copy, &buffer, NULL);
+    int err = errno;
+
+    if(done > 0) {
+      progress_advance((unsigned long long)done);
+
+      if(copy_options.drop_cache) {
+        release_range(copy->in, copy->out, offset, done);
+      }
+    }
+    pthread_mutex_lock(&copy->lock);
+
+    if(!kernel_copy) {
+      copy->kernel_copy = 0;
+    }
+
+    if(done < 0) {
+      copy->failed = 1;
+      copy->saved_errno = err;
+    }
+
+    else {
+      copy->copied += (unsigned long long)done;
+    }
+
+    pthread_mutex_unlock(&copy->lock);
+  }
+
+  free(buffer);
+  return NULL;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  copy_in_chunks
+    Description:  Copies a large regular file with --chunk-streams threads, each
+                 copying CHUNK_SIZE ranges at explicit offsets. The destination is
+                 preallocated with fallocate() first so the concurrent writes do not
+                 fragment it. Returns 1 when the whole file was copied, 0 if the
+                 caller should copy it sequentially and -1 on a hard error.
+   =====================================================================================
+*/
+static int copy_in_chunks(int in, int out, off_t size, off_t *copied) {
+  // Not every filesystem can preallocate (e.g. some network mounts); the copy still works
+  if(fallocate(out, 0, 0, size) != 0 && errno != EOPNOTSUPP && errno != ENOSYS) {
+    return errno == ENOSPC ? -1 : 0;
+  }
+
+  ChunkedCopy copy = { in, out, size, 0, 0, 0, 0, 1, PTHREAD_MUTEX_INITIALIZER };
+  long wanted = (long)((size + CHUNK_SIZE - 1) / CHUNK_SIZE);
+  int streams = copy_options.chunk_streams < wanted ? copy_options.chunk_streams : (int)wanted;
+  pthread_t threads[MAX_CHUNK_STREAMS];
+  int started = 0;
+
+  for(int i = 0; i < streams; i++) {
+    if(pthread_create(&threads[i], NULL, chunk_stream, &copy) != 0) {
+      break;
+    }
+
+    started++;
+  }
+
+  if(started == 0) {
+    chunk_stream(&copy); // No threads available; copy the ranges on this one
+  }
+
+  for(int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  pthread_mutex_destroy(&copy.lock);
+
+  if(copy.failed) {
+    errno = copy.saved_errno;
+    return -1;
+  }
+
+  *copied = (off_t)copy.copied;
+
+  if(*copied != size) {
+    // The source changed size under us; let the sequential path copy it to EOF
+    if(ftruncate(out, 0) != 0 || lseek(out, 0, SEEK_SET) != 0) {
+      return -1;
+    }
+
+    *copied = 0;
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  copy_with_checkpoints
+    Description:  Runs a kernel-side copy strategy up to 'size'. For a journaled
+                 'destination' the copy stops every JOURNAL_CHECKPOINT bytes to
+                 flush the data and record the offset, and with a 'window' every
+                 CACHE_WINDOW bytes to report progress and release the page cache
+                 behind it; with neither it copies in one go.
+                 Same return values as the strategy.
+   =====================================================================================
+*/
+static int copy_with_checkpoints(KernelCopy strategy, int in, int out, off_t size, off_t *copied, const char *destination, CopyWindow *window) {
+  off_t next_checkpoint = (*copied / JOURNAL_CHECKPOINT + 1) * JOURNAL_CHECKPOINT;
+
+  while(*copied < size) {
+    off_t limit = destination && next_checkpoint < size ? next_checkpoint : size;
+
+    if(window && limit - *copied > CACHE_WINDOW) {
+      limit = *copied + CACHE_WINDOW;
+    }
+
+    int status = strategy(in, out, limit, copied);
+
+    if(status != 1) {
+      return status;
+    }
+
+    copy_window_advance(window, *copied);
+
+    if(destination && *copied >= next_checkpoint && *copied < size) {
+      if(!journal_checkpoint(out, destination, *copied)) {
+        return -1;
+      }
+
+      next_checkpoint += JOURNAL_CHECKPOINT;
+    }
+  }
+
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  enable_direct_io
+    Description:  Switches both descriptors to O_DIRECT for a --direct-io copy. Needs
+                 an aligned starting offset and a filesystem that supports it.
+                 Returns 1 on success, 0 (with neither switched) otherwise.
+   =====================================================================================
+*/
+static int enable_direct_io(int in, int out, off_t offset) {
+  int in_flags = fcntl(in, F_GETFL);
+  int out_flags = fcntl(out, F_GETFL);
+
+  if(offset % DIRECT_IO_ALIGN != 0 || in_flags < 0 || out_flags < 0 ||
+     fcntl(in, F_SETFL, in_flags | O_DIRECT) != 0) {
+    return 0;
+  }
+
+  if(fcntl(out, F_SETFL, out_flags | O_DIRECT) != 0) {
+    fcntl(in, F_SETFL, in_flags);
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  resume_copy
+    Description:  Prepares an interrupted copy for continuing at 'offset': the
+                 destination must still hold that many bytes, is cut back to them
+                 and both files are positioned there. Returns 1 on success, 0 if
+                 the copy has to start again from zero.
+   =====================================================================================
+*/
+static int resume_copy(int in, int out, off_t offset, off_t *copied) {
+  struct stat st;
+
+  if(fstat(out, &st) != 0 || st.st_size < offset || ftruncate(out, offset) != 0 ||
+     lseek(in, offset, SEEK_SET) != offset || lseek(out, offset, SEEK_SET) != offset) {
+    return 0;
+  }
+
+  *copied = offset;
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  copy_file_contents
+    Description:  Copies 'source' to 'destination' through a temporary file that is
+                 renamed into place when complete (created or truncated, or continued
+                 from the journal's last checkpoint with --resume). Clones the
+                 extents with FICLONE unless --reflink=never; otherwise copies only
+                 the data extents of a sparse file, copies files above --direct-io
+                 with O_DIRECT, splits files above --chunk-threshold across
+                 --chunk-streams threads, or tries copy_file_range(), then
+                 sendfile(), then a 1 MiB read/write loop. The page cache behind
+                 the copy is released as it goes unless --keep-cache.
+                 With --checksum only the strategies that read the data in user
+                 space are used and the checksum is recorded for the bundle's
+                 .checksums file.
+                 Updates copy_stats with the method that finished the copy.
+                 Returns 1 on success, 0 on failure; a failed temporary file is removed
+                 unless it holds a checkpointed prefix that --resume can continue.
+   =====================================================================================
+*/
+int copy_file_contents(const char *source, const char *destination) {
+  double started = monotonic_seconds();
+  int in = open(source, O_RDONLY | O_CLOEXEC);
+
+  if(in < 0) {
+    console_printf("\nSource File: %s\n\n", source);
+    console_perror("Failed to open source file");
+    return 0;
+  }
+
+  struct stat st;
+
+  if(fstat(in, &st) != 0) {
+    console_perror("Failed to stat source file");
+    close(in);
+    return 0;
+  }
+
+  // Large copies are journaled so an interrupted run can continue them with --resume
+  int journaled = journal_active() && S_ISREG(st.st_mode) && st.st_size > JOURNAL_CHECKPOINT;
+  off_t resume_from = journaled ? journal_resume_offset(destination, &st) : 0;
+  // The copy is written under a temporary name and only renamed to 'destination' once complete
+  char *temporary = temporary_path(destination);
+  int out = temporary ? open(temporary, O_WRONLY | O_CREAT | O_CLOEXEC | (resume_from > 0 ? 0 : O_TRUNC), 0666) : -1;
+
+  if(out < 0) {
+    console_perror("Failed to open destination file");
+    close(in);
+    free(temporary);
+    return 0;
+  }
+
+  off_t copied = 0;
+  int status = 0;
+  CopyMethod method = COPY_METHOD_REFLINK;
+  // With --checksum the data is hashed on its way through copy_with_read_write()
+  int checksummed = copy_options.checksum != CHECKSUM_NONE && S_ISREG(st.st_mode);
+  ChecksumState sum;
+
+  if(checksummed) {
+    checksum_init(&sum, copy_options.checksum);
+  }
+
+  if(resume_from > 0 && (!resume_copy(in, out, resume_from, &copied) ||
+                         (checksummed && !checksum_range(in, resume_from, &sum)))) {
+    log_message("Cannot resume %s at %lld; copying it again\n", destination, (long long)resume_from);
+    resume_from = 0;
+
+    if(ftruncate(out, 0) != 0 || lseek(in, 0, SEEK_SET) != 0 || lseek(out, 0, SEEK_SET) != 0) {
+      console_perror("Failed to truncate destination file");
+      close(in);
+      close(out);
+      free(temporary);
+      return 0;
+    }
+
+    copied = 0;
+
+    if(checksummed) {
+      checksum_init(&sum, copy_options.checksum);
+    }
+  }
+
+  if(journaled) {
+    journal_begin(destination, &st, resume_from);
+  }
+
+  // Data is streamed once, so it is dropped from the page cache behind the copy unless --keep-cache
+  CopyWindow window = { in, out, copy_options.drop_cache && S_ISREG(st.st_mode), copied, copied, copied };
+
+  if(window.drop_cache) {
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(out, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+
+  /*
+     Share the source extents when the filesystem supports it (btrfs, XFS).
+     st_dev is not compared first: btrfs subvolumes report different devices
+     but still clone, and a cross-filesystem attempt just fails with EXDEV.
+  */
+  if(copy_options.reflink != REFLINK_NEVER && S_ISREG(st.st_mode) && resume_from == 0) {
+    if(ioctl(out, FICLONE, in) == 0) {
+      copied = st.st_size;
+      status = checksummed && !checksum_range(in, st.st_size, &sum) ? -1 : 1;
+    }
+
+    else if(copy_options.reflink == REFLINK_ALWAYS) {
+      console_error("Error: Cannot reflink %s to %s: %s\n", source, destination, strerror(errno));
+      close(in);
+      close(out);
+      unlink(temporary);
+      free(temporary);
+      return 0;
+    }
+  }
+
+  // Holes stay holes when only the data extents are copied; every other strategy would fill them with zeros
+  if(status == 0 && resume_from == 0 && is_sparse(in, &st)) {
+    off_t data_bytes = 0;
+    method = COPY_METHOD_SPARSE;
+    status = copy_sparse(in, out, st.st_size, &copied, checksummed ? &sum : NULL, &window, &data_bytes);
+
+    if(status > 0) {
+      log_message("Sparse source, copied %lld of %lld bytes as data: %s\n", (long long)data_bytes, (long long)st.st_size, source);
+    }
+  }
+
+  // With --direct-io huge media bypasses the page cache altogether
+  if(status == 0 && S_ISREG(st.st_mode) && copy_options.direct_io_threshold > 0 &&
+     (unsigned long long)st.st_size >= copy_options.direct_io_threshold && enable_direct_io(in, out, copied)) {
+    method = COPY_METHOD_DIRECT_IO;
+    window.drop_cache = 0;
+    status = copy_with_read_write(in, out, &copied, checksummed ? &sum : NULL, journaled ? destination : NULL, &window);
+  }
+
+  // Chunk streams write out of order, so they can neither continue a checkpointed prefix nor feed a checksum
+  if(status == 0 && S_ISREG(st.st_mode) && copy_options.chunk_streams > 1 && resume_from == 0 && !checksummed &&
+     (unsigned long long)st.st_size >= copy_options.chunk_threshold) {
+    method = COPY_METHOD_CHUNKED;
+    status = copy_in_chunks(in, out, st.st_size, &copied);
+    window.reported = copied; // The streams report their ranges themselves
+  }
+
+  // Kernel-side copies need a trustworthy size; anything else goes straight to read/write
+  if(status == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && !checksummed) {
+    method = COPY_METHOD_COPY_FILE_RANGE;
+    status = copy_with_checkpoints(copy_with_copy_file_range, in, out, st.st_size, &copied, journaled ? destination : NULL, &window);
+
+    if(status == 0) {
+      method = COPY_METHOD_SENDFILE;
+      status = copy_with_checkpoints(copy_with_sendfile, in, out, st.st_size, &copied, journaled ? destination : NULL, &window);
+    }
+  }
+
+  if(status == 0) {
+    method = COPY_METHOD_READ_WRITE;
+    status = copy_with_read_write(in, out, &copied, checksummed ? &sum : NULL, journaled ? destination : NULL, &window);
+  }
+
+  if(status < 0) {
+    console_error("Error: %s failed while copying %s: %s\n", copy_method_name(method), source, strerror(errno));
+  }
+
+  copy_window_finish(&window);
+  close(in);
+
+  if(close(out) != 0 && status > 0) {
+    console_perror("Failed to close destination file");
+    status = -1;
+  }
+
+  if(status < 0) {
+    // A checkpointed prefix is kept for --resume; the manifest has no entry, so it is never used as is
+    if(!journaled || copied < JOURNAL_CHECKPOINT) {
+      unlink(temporary);
+    }
+
+    else {
+      journal_keep_partial();
+    }
+
+    free(temporary);
+    return 0;
+  }
+
+  int published = publish_file(temporary, destination);
+  free(temporary);
+
+  if(!published) {
+    return 0;
+  }
+
+  if(resume_from > 0) {
+    record_resume((unsigned long long)resume_from);
+    log_message("Resumed %s at %lld bytes\n", destination, (long long)resume_from);
+  }
+
+  if(checksummed) {
+    char hex[CHECKSUM_HEX_MAX];
+    checksum_final(&sum, hex);
+    checksums_record(destination, hex);
+  }
+
+  record_copy(method, (unsigned long long)(copied - resume_from), started);
+  progress_file_done(destination, (unsigned long long)copied, (unsigned long long)(window.reported - resume_from), copy_method_name(method));
+  log_message("Copied %lld bytes with %s: %s -> %s\n", (long long)(copied - resume_from), copy_method_name(method), source, destination);
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  copy_bounded
+    Description:  read()/write() loop that copies from the current offset of 'in'
+                 until '*copied' reaches 'size', hashing into 'sum' unless NULL.
+                 Returns 1 when it did, 0 if 'in' ended first and -1 on error.
+   =====================================================================================
+*/
+static int copy_bounded(int in, int out, off_t size, off_t *copied, ChecksumState *sum) {
+  char *buffer = malloc(COPY_BUFFER_SIZE);
+
+  if(!buffer) {
+    return -1;
+  }
+
+  while(*copied < size) {
+    size_t want = throttle_io(size - *copied < COPY_BUFFER_SIZE ? (size_t)(size - *copied) : COPY_BUFFER_SIZE);
+    ssize_t n = read(in, buffer, want);
+
+    if(n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if(n <= 0) {
+      free(buffer);
+      return n == 0 ? 0 : -1;
+    }
+
+    if(sum) {
+      checksum_update(sum, buffer, (size_t)n);
+    }
+
+    for(ssize_t written = 0; written < n;) {
+      ssize_t w = write(out, buffer + written, (size_t)(n - written));
+
+      if(w < 0 && errno != EINTR) {
+        free(buffer);
+        return -1;
+      }
+
+      written += w < 0 ? 0 : w;
+    }
+
+    *copied += n;
+  }
+
+  free(buffer);
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  copy_to_stream
+    Description:  Appends 'size' bytes of 'in' to 'out' at its current offset, for
+                 archive output. A regular archive file is filled with
+                 copy_file_range(); sendfile() splices into pipes and sockets;
+                 --checksum, an O_APPEND 'out' and anything else use read()/write(). Reports progress
+                 and drops the source from the page cache as it goes, and counts
+                 the file in copy_stats. Returns 1 on success, 0 if 'in' ended
+                 before 'size' (with '*copied' the bytes written) and -1 on error.
+   =====================================================================================
+*/
+int copy_to_stream(int in, int out, off_t size, ChecksumState *sum, off_t *copied) {
+  struct stat st;
+  int regular = fstat(out, &st) == 0 && S_ISREG(st.st_mode);
+  // copy_file_range() rejects an O_APPEND output (e.g. stdout redirected with >>) with EBADF
+  int flags = fcntl(out, F_GETFL);
+  int append = flags >= 0 && (flags & O_APPEND);
+  KernelCopy strategy = sum || append ? NULL : (regular ? copy_with_copy_file_range : copy_with_sendfile);
+  double started = monotonic_seconds();
+  int status = 1;
+  *copied = 0;
+  posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  while(status == 1 && *copied < size) {
+    off_t before = *copied;
+    off_t limit = size - *copied > CACHE_WINDOW ? *copied + CACHE_WINDOW : size;
+    status = strategy ? strategy(in, out, limit, copied) : copy_bounded(in, out, limit, copied, sum);
+
+    // Unsupported, or the source ended early: the next strategy finds out which
+    if(status == 0 && strategy) {
+      strategy = strategy == copy_with_copy_file_range ? copy_with_sendfile : NULL;
+      status = 1;
+    }
+
+    progress_advance((unsigned long long)(*copied - before));
+
+    if(copy_options.drop_cache) {
+      posix_fadvise(in, 0, *copied, POSIX_FADV_DONTNEED);
+    }
+  }
+
+  if(status >= 0) {
+    CopyMethod method = strategy == copy_with_copy_file_range ? COPY_METHOD_COPY_FILE_RANGE :
+                        (strategy == copy_with_sendfile ? COPY_METHOD_SENDFILE : COPY_METHOD_READ_WRITE);
+    record_copy(method, (unsigned long long)*copied, started);
+  }
+
+  return status;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  link_file
+    Description:  Creates 'destination' as a hard link or symlink to 'source'.
+                 Symlinks point at the canonical absolute source path so they keep
+                 working however the project root was spelt on the command line.
+                 Returns 1 on success, 0 if the link could not be made.
+   =====================================================================================
+*/
+static int link_file(const char *source, const char *destination, LinkMode mode) {
+  if(mode == LINK_HARD) {
+    return link(source, destination) == 0;
+  }
+
+  char *target = realpath(source, NULL);
+
+  if(!target) {
+    return 0;
+  }
+
+  int ok = symlink(target, destination) == 0;
+  free(target);
+  return ok;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  record_link_checksum
+    Description:  Records the checksum of a linked asset. No data was copied, so the
+                 source has to be read once.
+   =====================================================================================
+*/
+static void record_link_checksum(const char *source, const char *destination) {
+  char hex[CHECKSUM_HEX_MAX];
+
+  if(copy_options.checksum != CHECKSUM_NONE && checksum_file(source, copy_options.checksum, hex)) {
+    checksums_record(destination, hex);
+  }
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  queue_small_copy
+    Description:  Adds a file to the calling thread's io_uring batch if it is small
+                 enough, flushing the batch first when it is full. A destination
+                 that is already queued is not queued twice.
+                 Returns 1 if the file was queued, 0 if it must be copied now.
+   =====================================================================================
+*/
+static int queue_small_copy(const char *source, const char *destination) {
+  struct stat st;
+
+  // Files that may be sparse are left to copy_file_contents(), which keeps their holes
+  if(stat(source, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > URING_SMALL_FILE || is_sparse(-1, &st)) {
+    return 0;
+  }
+
+  for(size_t i = 0; i < pending.count; ++i) {
+    if(strcmp(pending.items[i].destination, destination) == 0) {
+      return 1;
+    }
+  }
+
+  if(pending.count == URING_BATCH || pending.bytes + (unsigned long long)st.st_size > URING_BATCH_BYTES) {
+    copy_engine_flush();
+  }
+
+  UringCopy *item = &pending.items[pending.count];
+  item->source = strdup(source);
+  item->destination = strdup(destination);
+  item->temporary = temporary_path(destination);
+  item->size = st.st_size;
+  item->checksum = copy_options.checksum;
+
+  if(!item->source || !item->destination || !item->temporary) {
+    free(item->source);
+    free(item->destination);
+    free(item->temporary);
+    return 0;
+  }
+
+  pending.count++;
+  pending.bytes += (unsigned long long)st.st_size;
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  copy_engine_flush
+    Description:  Copies the calling thread's queued small files as one io_uring
+                 batch, renames them into place and prints their "Copied file"
+                 lines. Files the batch could not copy are redone with
+                 copy_file_contents() and counted as failed if that fails too.
+                 Must be called
+                 before anything relies on queued destinations being complete.
+   =====================================================================================
+*/
+void copy_engine_flush(void) {
+  if(pending.count == 0) {
+    return;
+  }
+
+  // The batch reads every file in one go, so it pays for all of them first
+  for(unsigned long long left = pending.bytes; left > 0;) {
+    left -= throttle_io(left < THROTTLE_QUANTUM ? (size_t)left : THROTTLE_QUANTUM);
+  }
+
+  double started = monotonic_seconds();
+  uring_copy_batch(pending.items, pending.count);
+
+  for(size_t i = 0; i < pending.count; ++i) {
+    UringCopy *item = &pending.items[i];
+
+    if(!item->status) {
+      unlink(item->temporary);
+    }
+
+    if(item->status && publish_file(item->temporary, item->destination)) {
+      if(item->checksum != CHECKSUM_NONE) {
+        checksums_record(item->destination, item->hex);
+      }
+
+      record_copy(COPY_METHOD_IO_URING, (unsigned long long)item->copied, started);
+      progress_file_done(item->destination, (unsigned long long)item->copied, 0, copy_method_name(COPY_METHOD_IO_URING));
+      log_message("Copied %lld bytes with %s: %s -> %s\n", (long long)item->copied, copy_method_name(COPY_METHOD_IO_URING), item->source, item->destination);
+      manifest_record(item->source, item->destination);
+      console_printf("Copied file from %s to %s\n", item->source, item->destination);
+    }
+
+    else if(copy_file_contents(item->source, item->destination)) {
+      manifest_record(item->source, item->destination);
+      console_printf("Copied file from %s to %s\n", item->source, item->destination);
+    }
+
+    else {
+      record_failure(item->source);
+    }
+
+    free(item->source);
+    free(item->destination);
+    free(item->temporary);
+  }
+
+  pending.count = 0;
+  pending.bytes = 0;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  prefetch_file
+    Description:  Asks the kernel to read ahead the first PREFETCH_SIZE bytes of the
+                 next file to be copied, so its copy does not start cold. Returns
+                 at once; links and --direct-io copies would not use the cache.
+   =====================================================================================
+*/
+void prefetch_file(const char *source) {
+  if(copy_options.link != LINK_COPY) {
+    return;
+  }
+
+  int fd = open(source, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+
+  if(fd < 0) {
+    return;
+  }
+
+  if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+     (copy_options.direct_io_threshold == 0 || (unsigned long long)st.st_size < copy_options.direct_io_threshold)) {
+    posix_fadvise(fd, 0, PREFETCH_SIZE, POSIX_FADV_WILLNEED);
+  }
+
+  close(fd);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  transfer_file
+    Description:  Puts 'source' into the bundle at 'destination' according to --link:
+                 a hard link or symlink when requested and possible, otherwise a
+                 copy through copy_file_contents(). A failed link (EXDEV across
+                 filesystems, EPERM, EMLINK, ...) is logged and the file copied.
+                 With --backend=io_uring small files are only queued; the caller
+                 must not report them as copied (copy_engine_flush() does).
+                 Every file put in place is recorded in the manifest, and every
+                 file that could not be counted in copy_stats.
+                 Returns TRANSFER_DONE, TRANSFER_QUEUED or TRANSFER_FAILED.
+   =====================================================================================
+*/
+TransferResult transfer_file(const char *source, const char *destination) {
+  if(copy_options.link != LINK_COPY) {
+    struct stat st;
+
+    // Links only make sense for regular files that actually exist
+    if(stat(source, &st) == 0 && S_ISREG(st.st_mode)) {
+      // Links are published like copies: made under the temporary name, then renamed over 'destination'
+      char *temporary = temporary_path(destination);
+
+      if(temporary) {
+        unlink(temporary); // Left over from an interrupted run
+      }
+
+      int linked = temporary && link_file(source, temporary, copy_options.link);
+      int saved_errno = errno;
+      linked = linked && publish_file(temporary, destination);
+      free(temporary);
+
+      if(linked) {
+        CopyMethod method = copy_options.link == LINK_HARD ? COPY_METHOD_HARDLINK : COPY_METHOD_SYMLINK;
+        record_copy(method, (unsigned long long)st.st_size, 0);
+        progress_file_done(destination, (unsigned long long)st.st_size, 0, copy_method_name(method));
+        log_message("Linked (%s) %s -> %s\n", copy_method_name(method), source, destination);
+        record_link_checksum(source, destination);
+        manifest_record(source, destination);
+        return TRANSFER_DONE;
+      }
+
+      log_message("Could not link %s to %s (%s); copying instead\n", source, destination, strerror(saved_errno));
+    }
+  }
+
+  // Queued files skip the reflink attempt; --reflink=always needs the synchronous path
+  if(copy_options.backend == COPY_BACKEND_IO_URING && copy_options.reflink != REFLINK_ALWAYS &&
+     queue_small_copy(source, destination)) {
+    return TRANSFER_QUEUED;
+  }
+
+  if(!copy_file_contents(source, destination)) {
+    record_failure(source);
+    return TRANSFER_FAILED;
+  }
+
+  manifest_record(source, destination);
+  return TRANSFER_DONE;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  copy_file_contents_stdio
+    Description:  The original 4 KiB fread/fwrite copy loop. Not used for collecting;
+                 kept as the baseline the benchmark measures the engine against.
+                 Returns 1 on success, 0 on failure.
+   =====================================================================================
+*/
+int copy_file_contents_stdio(const char *source, const char *destination) {
+  FILE *src = fopen(source, "rb");
+
+  if(!src) {
+    console_perror("Failed to open source file");
+    return 0;
+  }
+
+  FILE *dst = fopen(destination, "wb");
+
+  if(!dst) {
+    console_perror("Failed to open destination file");
+    fclose(src);
+    return 0;
+  }
+
+  const int buf_size = 4096;
+  char buffer[buf_size];
+  size_t bytes_read;
+
+  while((bytes_read = fread(buffer, 1, buf_size, src)) > 0) {
+    fwrite(buffer, 1, bytes_read, dst);
+  }
+
+  fclose(src);
+  return fclose(dst) == 0;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  print_copy_stats
+    Description:  Prints how many unchanged files were skipped, how many files and
+                 bytes each copy method handled and the overall throughput
+   =====================================================================================
+*/
+void print_copy_stats(void) {
+  unsigned long long total_files = 0;
+  unsigned long long total_bytes = 0;
+  unsigned long long copied_bytes = 0;
+
+  for(int i = 0; i < COPY_METHOD_COUNT; i++) {
+    total_files += copy_stats.files[i];
+    total_bytes += copy_stats.bytes[i];
+
+    if(i != COPY_METHOD_HARDLINK && i != COPY_METHOD_SYMLINK) {
+      copied_bytes += copy_stats.bytes[i];
+    }
+  }
+
+  if(copy_stats.skipped_files > 0) {
+    printf("Skipped %llu unchanged file(s), %.1f MiB (%llu bytes)\n", copy_stats.skipped_files,
+           (double)copy_stats.skipped_bytes / (1024.0 * 1024.0), copy_stats.skipped_bytes);
+  }
+
+  if(copy_stats.resumed_files > 0) {
+    printf("Resumed %llu interrupted file(s); %.1f MiB were already copied\n", copy_stats.resumed_files,
+           (double)copy_stats.resumed_bytes / (1024.0 * 1024.0));
+  }
+
+  if(total_files == 0) {
+    return;
+  }
+
+  double mib = (double)total_bytes / (1024.0 * 1024.0);
+  printf("Collected %llu file(s), %.1f MiB", total_files, mib);
+
+  // Links move no data, so only copied bytes count towards the throughput
+  double seconds = copy_stats.last_finished - copy_stats.first_started;
+
+  if(copied_bytes > 0 && seconds > 0) {
+    double copied_mib = (double)copied_bytes / (1024.0 * 1024.0);
+    printf(", copied %.1f MiB in %.2f s (%.1f MiB/s)", copied_mib, seconds, copied_mib / seconds);
+  }
+
+  printf("\n");
+
+  for(int i = 0; i < COPY_METHOD_COUNT; i++) {
+    if(copy_stats.files[i] > 0) {
+      printf("  %-16s %llu file(s), %llu bytes\n", copy_method_name((CopyMethod)i), copy_stats.files[i], copy_stats.bytes[i]);
+    }
+  }
+}
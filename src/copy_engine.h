@@ -0,0 +1,173 @@
+#ifndef COPY_ENGINE_H
+#define COPY_ENGINE_H
+
+#if !defined(__linux__)
+  #error "These functions declared in copy_engine.h will work only on Linux"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include "hash.h"
+
+// Size of the heap buffer used by the read/write fallback loop
+#define  COPY_BUFFER_SIZE  (1024 * 1024)
+// Files of at least this size are split into ranges when --chunk-streams > 1
+#define  DEFAULT_CHUNK_THRESHOLD  (1024ULL * 1024ULL * 1024ULL)
+// Size of one range handed to a chunk stream, and the most streams per file
+#define  CHUNK_SIZE  (64L * 1024L * 1024L)
+#define  MAX_CHUNK_STREAMS  64
+// Bytes of a stream left in the page cache before they are written back and dropped
+#define  CACHE_WINDOW  (32L * 1024L * 1024L)
+// Start of the next queued file read ahead while the current one copies
+#define  PREFETCH_SIZE  CACHE_WINDOW
+// Buffer size and alignment of --direct-io copies
+#define  DIRECT_IO_BUFFER  (8 * 1024 * 1024)
+#define  DIRECT_IO_ALIGN   4096
+// Most data one read or copy call moves while --max-bandwidth is set
+#define  THROTTLE_QUANTUM  (1024 * 1024)
+
+/*
+   How a file ended up in the bundle. The links come from transfer_file()
+   with --link; the rest are the copy strategies tried by copy_file_contents(),
+   in order of preference. COPY_METHOD_STDIO is the old 4 KiB fread/fwrite loop, kept only
+   so the benchmark can compare against it.
+*/
+typedef enum {
+  COPY_METHOD_HARDLINK = 0,
+  COPY_METHOD_SYMLINK,
+  COPY_METHOD_REFLINK,
+  COPY_METHOD_IO_URING,
+  COPY_METHOD_SPARSE,
+  COPY_METHOD_CHUNKED,
+  COPY_METHOD_DIRECT_IO,
+  COPY_METHOD_COPY_FILE_RANGE,
+  COPY_METHOD_SENDFILE,
+  COPY_METHOD_READ_WRITE,
+  COPY_METHOD_STDIO,
+  COPY_METHOD_COUNT
+} CopyMethod;
+
+/*
+   Whether to clone extents with ioctl(FICLONE) instead of copying data.
+   AUTO tries a clone and silently copies when it is not possible, ALWAYS
+   fails the file instead of copying, NEVER skips the clone attempt.
+*/
+typedef enum {
+  REFLINK_AUTO = 0,
+  REFLINK_ALWAYS,
+  REFLINK_NEVER
+} ReflinkMode;
+
+/*
+   Whether transfer_file() links the source into the bundle instead of copying
+   it. A link that cannot be made (EXDEV, EPERM, ...) falls back to a copy.
+*/
+typedef enum {
+  LINK_COPY = 0,
+  LINK_HARD,
+  LINK_SYM
+} LinkMode;
+
+/*
+   Which backend copies the data. IO_URING batches small files through
+   io_uring (see uring_copy.c) and falls back to SYNC when the kernel does not
+   support it; large files always use the synchronous kernel-side copy.
+*/
+typedef enum {
+  COPY_BACKEND_SYNC = 0,
+  COPY_BACKEND_IO_URING
+} CopyBackend;
+
+/*
+   What the collection produces: the bundle as a directory tree (the default),
+   streamed into one POSIX tar archive (--output-format tar), or that archive
+   compressed into a seekable zstd bundle (--output-format zstd).
+*/
+typedef enum {
+  OUTPUT_DIRECTORY = 0,
+  OUTPUT_TAR,
+  OUTPUT_ZSTD
+} OutputFormat;
+
+/*
+   What transfer_file() did with a file. QUEUED files are copied, and their
+   "Copied file" line printed, by the next copy_engine_flush().
+*/
+typedef enum {
+  TRANSFER_FAILED = 0,
+  TRANSFER_DONE,
+  TRANSFER_QUEUED
+} TransferResult;
+
+/*
+   Options that change how the engine copies, set once from the command line.
+   Files of at least 'chunk_threshold' bytes are copied by 'chunk_streams'
+   threads at once; one stream (the default) copies every file sequentially.
+   'checksum' selects the checksum computed while copying (--checksum).
+   'drop_cache' writes copied data back and drops it from the page cache as
+   the copy goes (cleared by --keep-cache); files of at least
+   'direct_io_threshold' bytes bypass the cache with O_DIRECT (0 = never).
+   'max_bandwidth' caps the bytes per second of all copies together
+   (--max-bandwidth, 0 = unlimited). With any 'output_format' but DIRECTORY
+   copy_file_to_directory() adds files to the archive instead of copying them.
+*/
+typedef struct {
+  ReflinkMode reflink;
+  LinkMode link;
+  CopyBackend backend;
+  unsigned long long chunk_threshold;
+  int chunk_streams;
+  ChecksumAlgorithm checksum;
+  int drop_cache;
+  unsigned long long direct_io_threshold;
+  unsigned long long max_bandwidth;
+  OutputFormat output_format;
+} CopyOptions;
+
+/*
+   Running totals for every file the engine has copied. The timestamps span
+   all data copies, so the throughput is wall-clock even with parallel jobs.
+   Skipped files are assets the manifest showed to be unchanged; resumed bytes
+   were already copied by an interrupted run and are not in bytes[]. Failed
+   files could not be collected although their source exists.
+*/
+typedef struct {
+  unsigned long long files[COPY_METHOD_COUNT];
+  unsigned long long bytes[COPY_METHOD_COUNT];
+  double first_started;
+  double last_finished;
+  unsigned long long skipped_files;
+  unsigned long long skipped_bytes;
+  unsigned long long resumed_files;
+  unsigned long long resumed_bytes;
+  unsigned long long failed_files;
+} CopyStats;
+
+extern CopyStats copy_stats;
+extern CopyOptions copy_options;
+
+double monotonic_seconds(void);
+const char *copy_method_name(CopyMethod method);
+void record_copy(CopyMethod method, unsigned long long bytes, double started);
+void record_skip(unsigned long long bytes);
+void record_resume(unsigned long long bytes);
+void record_failure(const char *source);
+int parse_reflink_mode(const char *value, ReflinkMode *mode);
+int parse_link_mode(const char *value, LinkMode *mode);
+int parse_copy_backend(const char *value, CopyBackend *backend);
+int parse_byte_size(const char *value, unsigned long long *bytes);
+int parse_output_format(const char *value, OutputFormat *format);
+int parse_bandwidth(const char *value, unsigned long long *bytes_per_second);
+int parse_io_priority(const char *value, int *ioprio);
+int set_io_priority(int ioprio);
+size_t throttle_io(size_t want);
+int copy_file_contents(const char *source, const char *destination);
+int copy_to_stream(int in, int out, off_t size, ChecksumState *sum, off_t *copied);
+TransferResult transfer_file(const char *source, const char *destination);
+void copy_engine_flush(void);
+void prefetch_file(const char *source);
+int copy_file_contents_stdio(const char *source, const char *destination);
+void print_copy_stats(void);
+
+#endif // COPY_ENGINE_H
@@ -0,0 +1,523 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+#include <pthread.h>
+#include "copy_pool.h"
+#include "copy_engine.h"
+#include "file_utils.h"
+#include "manifest.h"
+#include "logging.h"
+
+/*
+   What kind of storage a source device is; decides how many copies may read
+   from it at the same time
+*/
+typedef enum {
+  DEVICE_ROTATIONAL = 0,
+  DEVICE_SOLID_STATE,
+  DEVICE_OTHER // No block device (network or virtual filesystem) or missing source
+} DeviceKind;
+
+/*
+   One file of Step 6, a resource or an extra file, and the console output
+   its copy produced
+*/
+typedef struct {
+  const char *resource;
+  AssetKind kind;
+  off_t size;
+  size_t device;
+  double wait;
+  ConsoleCapture capture;
+  int done;
+} CopyJob;
+
+/*
+   The resources that live on one source device, largest first
+*/
+typedef struct {
+  dev_t dev;
+  DeviceKind kind;
+  int limit;
+  int active;
+  size_t *order;
+  size_t count;
+  size_t next;
+  unsigned long long bytes;
+  unsigned long long remaining;
+  double wait_total;
+  double wait_max;
+} DeviceQueue;
+
+/*
+   Work queue shared by the worker threads. Jobs are handed out per device;
+   the main thread prints their output in resource order.
+*/
+typedef struct {
+  CopyJob *jobs;
+  size_t count;
+  size_t dispatched;
+  DeviceQueue *devices;
+  size_t device_count;
+  double scheduled;
+  const char *assets_dir;
+  const char *project_root;
+  const char *input_file;
+  int prefetch;
+  pthread_mutex_t lock;
+  pthread_cond_t job_done;
+  pthread_cond_t slot_free;
+} CopyScheduler;
+
+// Sort context for qsort(), which has no user argument
+static const CopyJob *sort_jobs = NULL;
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  device_kind_name
+    Description:  Returns a printable name for a device kind
+   =====================================================================================
+*/
+static const char *device_kind_name(DeviceKind kind) {
+  switch(kind) {
+    case DEVICE_ROTATIONAL:
+      return "rotational";
+
+    case DEVICE_SOLID_STATE:
+      return "solid-state";
+
+    default:
+      return "non-block";
+  }
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  detect_device_kind
+    Description:  Reads queue/rotational of the block device behind 'dev' from sysfs.
+                 A partition has no queue of its own, so its parent disk is tried
+                 next. Devices without a sysfs entry (NFS, SMB, tmpfs, ...) are
+                 reported as DEVICE_OTHER.
+   =====================================================================================
+*/
+static DeviceKind detect_device_kind(dev_t dev) {
+  char path[128];
+  snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/rotational", major(dev), minor(dev));
+  FILE *file = fopen(path, "r");
+
+  if(!file) {
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/rotational", major(dev), minor(dev));
+    file = fopen(path, "r");
+  }
+
+  if(!file) {
+    return DEVICE_OTHER;
+  }
+
+  int c = fgetc(file);
+  fclose(file);
+  return c == '1' ? DEVICE_ROTATIONAL : DEVICE_SOLID_STATE;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  compare_job_size
+    Description:  qsort() comparator putting the largest job first; ties keep
+                 resource order so the plan is deterministic
+   =====================================================================================
+*/
+static int compare_job_size(const void *a, const void *b) {
+  size_t ia = *(const size_t *)a;
+  size_t ib = *(const size_t *)b;
+
+  if(sort_jobs[ia].size != sort_jobs[ib].size) {
+    return sort_jobs[ia].size < sort_jobs[ib].size ? 1 : -1;
+  }
+
+  return ia < ib ? -1 : (ia > ib);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  build_schedule
+    Description:  Stats every resource, groups the jobs by the st_dev of their source
+                 and orders each group largest-first. Rotational devices get one
+                 copy at a time, everything else up to 'jobs'.
+                 Returns 1 on success, 0 if memory could not be allocated.
+   =====================================================================================
+*/
+static int build_schedule(CopyScheduler *sched, int jobs) {
+  sched->devices = calloc(sched->count, sizeof(DeviceQueue));
+
+  if(!sched->devices) {
+    return 0;
+  }
+
+  for(size_t i = 0; i < sched->count; ++i) {
+    CopyJob *job = &sched->jobs[i];
+    char full_source_path[4096] = {0};
+    struct stat st;
+    dev_t dev = 0;
+
+    if(resolve_source_path(job->resource, sched->project_root, full_source_path, sizeof(full_source_path)) &&
+       stat(full_source_path, &st) == 0) {
+      dev = st.st_dev;
+      // Duplicates found by --dedup are not copied, so they add nothing to the queue
+      job->size = S_ISREG(st.st_mode) && !(job->kind == ASSET_RESOURCE && is_duplicate_resource(job->resource)) ?
+                  st.st_size : 0;
+    }
+
+    size_t d = 0;
+
+    while(d < sched->device_count && sched->devices[d].dev != dev) {
+      d++;
+    }
+
+    if(d == sched->device_count) {
+      DeviceQueue *queue = &sched->devices[sched->device_count++];
+      queue->dev = dev;
+      queue->kind = dev == 0 ? DEVICE_OTHER : detect_device_kind(dev);
+      queue->limit = queue->kind == DEVICE_ROTATIONAL ? 1 : jobs;
+    }
+
+    job->device = d;
+    sched->devices[d].count++;
+    sched->devices[d].bytes += (unsigned long long)job->size;
+  }
+
+  for(size_t d = 0; d < sched->device_count; ++d) {
+    DeviceQueue *queue = &sched->devices[d];
+    queue->order = malloc(queue->count * sizeof(size_t));
+
+    if(!queue->order) {
+      return 0;
+    }
+
+    queue->remaining = queue->bytes;
+    queue->count = 0;
+  }
+
+  for(size_t i = 0; i < sched->count; ++i) {
+    DeviceQueue *queue = &sched->devices[sched->jobs[i].device];
+    queue->order[queue->count++] = i;
+  }
+
+  sort_jobs = sched->jobs;
+
+  for(size_t d = 0; d < sched->device_count; ++d) {
+    qsort(sched->devices[d].order, sched->devices[d].count, sizeof(size_t), compare_job_size);
+  }
+
+  sort_jobs = NULL;
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  pick_next_job
+    Description:  Chooses the next job to start: from the devices that still have
+                 work and a free slot, the one with the most bytes left, so the
+                 longest queue starts first. Returns the job index, or SIZE_MAX if
+                 every device with work is at its limit. Caller holds the lock.
+   =====================================================================================
+*/
+static size_t pick_next_job(CopyScheduler *sched) {
+  DeviceQueue *best = NULL;
+
+  for(size_t d = 0; d < sched->device_count; ++d) {
+    DeviceQueue *queue = &sched->devices[d];
+
+    if(queue->next == queue->count || queue->active >= queue->limit) {
+      continue;
+    }
+
+    if(!best || queue->remaining > best->remaining) {
+      best = queue;
+    }
+  }
+
+  if(!best) {
+    return SIZE_MAX;
+  }
+
+  size_t index = best->order[best->next++];
+  best->active++;
+  best->remaining -= (unsigned long long)sched->jobs[index].size;
+  return index;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  prefetch_resource
+    Description:  Starts readahead of a file that is copied next, while the
+                 current one is still copying
+   =====================================================================================
+*/
+static void prefetch_resource(const char *resource, AssetKind kind, const char *project_root) {
+  char full_source_path[4096] = {0};
+
+  if(!(kind == ASSET_RESOURCE && is_duplicate_resource(resource)) &&
+     resolve_source_path(resource, project_root, full_source_path, sizeof(full_source_path))) {
+    prefetch_file(full_source_path);
+  }
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  asset_at
+    Description:  Returns the source of file 'i' of Step 6 - the resources first,
+                 then the extra files of the project - and stores its kind in
+                 '*kind'
+   =====================================================================================
+*/
+static const char *asset_at(const ParsedProject *project, size_t i, AssetKind *kind) {
+  if(i < project->resource_count) {
+    *kind = ASSET_RESOURCE;
+    return project->resources[i];
+  }
+
+  *kind = project->extras[i - project->resource_count].kind;
+  return project->extras[i - project->resource_count].path;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  collect_asset
+    Description:  Copies one file of Step 6 with collect_resource() or collect_extra()
+   =====================================================================================
+*/
+static void collect_asset(const char *source, AssetKind kind, const char *assets_dir, const char *project_root,
+                          const char *input_file) {
+  if(kind == ASSET_RESOURCE) {
+    collect_resource(source, assets_dir, project_root, input_file);
+  }
+
+  else {
+    collect_extra(source, kind, assets_dir, project_root);
+  }
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  copy_worker
+    Description:  Thread body: takes the next job the scheduler allows, collects it
+                 with its console output captured, and marks it done
+   =====================================================================================
+*/
+static void *copy_worker(void *arg) {
+  CopyScheduler *sched = arg;
+
+  for(;;) {
+    pthread_mutex_lock(&sched->lock);
+    size_t index = SIZE_MAX;
+
+    while(sched->dispatched < sched->count && (index = pick_next_job(sched)) == SIZE_MAX) {
+      pthread_cond_wait(&sched->slot_free, &sched->lock);
+    }
+
+    if(index == SIZE_MAX) {
+      pthread_mutex_unlock(&sched->lock);
+      return NULL;
+    }
+
+    CopyJob *job = &sched->jobs[index];
+    DeviceQueue *queue = &sched->devices[job->device];
+    // The job after this one on the same device is read ahead while this one copies
+    const CopyJob *next = queue->next < queue->count ? &sched->jobs[queue->order[queue->next]] : NULL;
+    sched->dispatched++;
+    job->wait = monotonic_seconds() - sched->scheduled;
+    queue->wait_total += job->wait;
+
+    if(job->wait > queue->wait_max) {
+      queue->wait_max = job->wait;
+    }
+
+    pthread_mutex_unlock(&sched->lock);
+
+    if(next && sched->prefetch) {
+      prefetch_resource(next->resource, next->kind, sched->project_root);
+    }
+
+    int captured = console_capture_begin(&job->capture);
+    collect_asset(job->resource, job->kind, sched->assets_dir, sched->project_root, sched->input_file);
+    copy_engine_flush(); // Keep any io_uring output inside this job's capture
+
+    if(captured) {
+      console_capture_end(&job->capture);
+    }
+
+    pthread_mutex_lock(&sched->lock);
+    queue->active--;
+    job->done = 1;
+    pthread_cond_broadcast(&sched->job_done);
+    pthread_cond_broadcast(&sched->slot_free);
+    pthread_mutex_unlock(&sched->lock);
+  }
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  print_schedule
+    Description:  Prints the copy plan per device and how long its jobs waited in
+                 the queue before a worker started them
+   =====================================================================================
+*/
+static void print_schedule(const CopyScheduler *sched, int jobs) {
+  printf("Copy plan (%d worker(s), %zu device queue(s)):\n", jobs, sched->device_count);
+
+  for(size_t d = 0; d < sched->device_count; ++d) {
+    const DeviceQueue *queue = &sched->devices[d];
+
+    if(queue->dev == 0) {
+      printf("  Missing sources: %zu file(s)\n", queue->count);
+    }
+
+    else {
+      printf("  Device %u:%u (%s, up to %d at once): %zu file(s), %.1f MiB, queue wait %.2f s total, %.2f s max\n",
+             major(queue->dev), minor(queue->dev), device_kind_name(queue->kind), queue->limit, queue->count,
+             (double)queue->bytes / (1024.0 * 1024.0), queue->wait_total, queue->wait_max);
+    }
+
+    for(size_t k = 0; k < queue->count; ++k) {
+      const CopyJob *job = &sched->jobs[queue->order[k]];
+      printf("    %4zu. %10.1f MiB  waited %6.2f s  %s\n", k + 1, (double)job->size / (1024.0 * 1024.0), job->wait, job->resource);
+    }
+  }
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  free_schedule
+    Description:  Releases the device queues of a scheduler
+   =====================================================================================
+*/
+static void free_schedule(CopyScheduler *sched) {
+  if(!sched->devices) {
+    return;
+  }
+
+  for(size_t d = 0; d < sched->device_count; ++d) {
+    free(sched->devices[d].order);
+  }
+
+  free(sched->devices);
+  sched->devices = NULL;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  run_copy_jobs
+    Description:  Step 6: copies every resource into the directory it maps to with
+                 copy_file_to_directory_with_context(), and every LUT, stabiliser
+                 and alpha-transition file of the project into its subdirectory,
+                 all from one queue.
+                 With jobs > 1 the files are grouped by source device: each
+                 device is read largest file first, rotational disks one file at a
+                 time and other devices by up to 'jobs' workers, so an HDD is not
+                 made to seek between parallel streams. The console output of each
+                 file is held back and printed in order, resources first, so the
+                 output is the same as a serial run; the plan and queue waits
+                 follow it. On a first collection each job reads ahead the start
+                 of the next file in its queue.
+   =====================================================================================
+*/
+void run_copy_jobs(const ParsedProject *project, const char *assets_dir, const char *project_root, const char *input_file, int jobs) {
+  size_t count = project->resource_count + project->extra_count;
+
+  if(jobs > (int)count) {
+    jobs = (int)count;
+  }
+
+  // A re-collection skips most files, and reading them ahead would only cost I/O
+  int prefetch = manifest_entry_count() == 0;
+
+  if(jobs <= 1) {
+    for(size_t i = 0; i < count; ++i) {
+      AssetKind kind;
+      const char *source = asset_at(project, i, &kind);
+
+      if(prefetch && i + 1 < count) {
+        AssetKind next_kind;
+        const char *next = asset_at(project, i + 1, &next_kind);
+        prefetch_resource(next, next_kind, project_root);
+      }
+
+      collect_asset(source, kind, assets_dir, project_root, input_file);
+    }
+
+    copy_engine_flush();
+    return;
+  }
+
+  CopyScheduler sched;
+  memset(&sched, 0, sizeof(sched));
+  sched.jobs = calloc(count, sizeof(CopyJob));
+  sched.count = count;
+  sched.assets_dir = assets_dir;
+  sched.project_root = project_root;
+  sched.input_file = input_file;
+  sched.prefetch = prefetch;
+  pthread_t *threads = malloc(jobs * sizeof(pthread_t));
+
+  if(sched.jobs) {
+    for(size_t i = 0; i < count; ++i) {
+      sched.jobs[i].resource = asset_at(project, i, &sched.jobs[i].kind);
+    }
+  }
+
+  if(!sched.jobs || !threads || !build_schedule(&sched, jobs)) {
+    perror("Failed to allocate memory for copy jobs; copying serially");
+    free_schedule(&sched);
+    free(sched.jobs);
+    free(threads);
+    run_copy_jobs(project, assets_dir, project_root, input_file, 1);
+    return;
+  }
+
+  pthread_mutex_init(&sched.lock, NULL);
+  pthread_cond_init(&sched.job_done, NULL);
+  pthread_cond_init(&sched.slot_free, NULL);
+  sched.scheduled = monotonic_seconds();
+  int started = 0;
+
+  for(int i = 0; i < jobs; ++i) {
+    if(pthread_create(&threads[i], NULL, copy_worker, &sched) != 0) {
+      break;
+    }
+
+    started++;
+  }
+
+  if(started == 0) {
+    // No worker could be started; do the work on this thread instead
+    copy_worker(&sched);
+  }
+
+  // Print each job's output in order as soon as it and its predecessors are done
+  for(size_t i = 0; i < count; ++i) {
+    pthread_mutex_lock(&sched.lock);
+
+    while(!sched.jobs[i].done) {
+      pthread_cond_wait(&sched.job_done, &sched.lock);
+    }
+
+    pthread_mutex_unlock(&sched.lock);
+    console_capture_flush(&sched.jobs[i].capture);
+  }
+
+  for(int i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+
+  print_schedule(&sched, jobs);
+  pthread_cond_destroy(&sched.slot_free);
+  pthread_cond_destroy(&sched.job_done);
+  pthread_mutex_destroy(&sched.lock);
+  free_schedule(&sched);
+  free(threads);
+  free(sched.jobs);
+}
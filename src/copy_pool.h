@@ -0,0 +1,12 @@
+#ifndef COPY_POOL_H
+#define COPY_POOL_H
+
+#include <stdio.h>
+#include "parser.h"
+
+// Upper bound for --jobs
+#define  MAX_COPY_JOBS  256
+
+void run_copy_jobs(const ParsedProject *project, const char *assets_dir, const char *project_root, const char *input_file, int jobs);
+
+#endif // COPY_POOL_H
@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include "dedup.h"
+#include "file_utils.h"
+#include "copy_engine.h"
+#include "hash.h"
+
+/*
+   A resource considered for deduplication. Only regular files that exist are
+   candidates; 'hashed' is set once 'hash' holds the XXH64 of the content.
+*/
+typedef struct {
+  size_t mapping;
+  char path[4096];
+  off_t size;
+  dev_t dev;
+  ino_t ino;
+  uint64_t hash;
+  int hashed;
+} DedupCandidate;
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  compare_candidates
+    Description:  qsort() comparator: by size, then by mapping order so the first
+                 resource of the project becomes the copy that is kept
+   =====================================================================================
+*/
+static int compare_candidates(const void *a, const void *b) {
+  const DedupCandidate *x = a;
+  const DedupCandidate *y = b;
+
+  if(x->size != y->size) {
+    return x->size < y->size ? -1 : 1;
+  }
+
+  return x->mapping < y->mapping ? -1 : (x->mapping > y->mapping);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  read_full
+    Description:  Reads up to 'size' bytes, retrying short reads.
+                 Returns the bytes read, or -1 on error.
+   =====================================================================================
+*/
+static ssize_t read_full(int fd, char *buffer, size_t size) {
+  size_t done = 0;
+
+  while(done < size) {
+    ssize_t n = read(fd, buffer + done, size - done);
+
+    if(n < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+
+      return -1;
+    }
+
+    if(n == 0) {
+      break;
+    }
+
+    done += (size_t)n;
+  }
+
+  return (ssize_t)done;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  files_identical
+    Description:  Compares two files byte for byte, so a hash collision can never
+                 make the project point at the wrong media.
+                 Returns 1 if the contents are identical, 0 otherwise.
+   =====================================================================================
+*/
+static int files_identical(const char *a, const char *b) {
+  int fa = open(a, O_RDONLY | O_CLOEXEC);
+  int fb = open(b, O_RDONLY | O_CLOEXEC);
+  char *buffer_a = malloc(COPY_BUFFER_SIZE);
+  char *buffer_b = malloc(COPY_BUFFER_SIZE);
+  int identical = fa >= 0 && fb >= 0 && buffer_a && buffer_b;
+
+  while(identical) {
+    ssize_t na = read_full(fa, buffer_a, COPY_BUFFER_SIZE);
+    ssize_t nb = read_full(fb, buffer_b, COPY_BUFFER_SIZE);
+
+    if(na < 0 || na != nb || memcmp(buffer_a, buffer_b, (size_t)na) != 0) {
+      identical = 0;
+    }
+
+    if(na <= 0) {
+      break;
+    }
+  }
+
+  free(buffer_a);
+  free(buffer_b);
+
+  if(fa >= 0) {
+    close(fa);
+  }
+
+  if(fb >= 0) {
+    close(fb);
+  }
+
+  return identical;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  same_content
+    Description:  Tells whether two candidates of the same size hold the same data:
+                 the same inode trivially does, otherwise the hashes must match and
+                 a byte comparison confirms it. Hashes are computed on first use.
+   =====================================================================================
+*/
+static int same_content(DedupCandidate *a, DedupCandidate *b) {
+  if(a->dev == b->dev && a->ino == b->ino) {
+    return 1;
+  }
+
+  if(!a->hashed && !(a->hashed = hash_file_xxh64(a->path, &a->hash))) {
+    return 0;
+  }
+
+  if(!b->hashed && !(b->hashed = hash_file_xxh64(b->path, &b->hash))) {
+    return 0;
+  }
+
+  return a->hash == b->hash && files_identical(a->path, b->path);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  dedup_file_mappings
+    Description:  Finds resources with identical content under different paths and
+                 points each duplicate at the first resource with that content
+                 (FileMapping.duplicate_of), so the asset is stored once and the
+                 rewritten project refers to it everywhere. Files are grouped by
+                 size first and only sizes shared by several files are hashed.
+                 Prints how many files and bytes were saved.
+   =====================================================================================
+*/
+void dedup_file_mappings(const char *project_root) {
+  DedupCandidate *candidates = malloc(file_mapping_count * sizeof(DedupCandidate));
+
+  if(!candidates) {
+    perror("Failed to allocate memory for deduplication");
+    return;
+  }
+
+  size_t count = 0;
+
+  for(size_t i = 0; i < file_mapping_count; i++) {
+    DedupCandidate *candidate = &candidates[count];
+    struct stat st;
+
+    if(!resolve_source_path(file_mappings[i].original_path, project_root, candidate->path, sizeof(candidate->path)) ||
+       stat(candidate->path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+      continue;
+    }
+
+    candidate->mapping = i;
+    candidate->size = st.st_size;
+    candidate->dev = st.st_dev;
+    candidate->ino = st.st_ino;
+    candidate->hashed = 0;
+    count++;
+  }
+
+  qsort(candidates, count, sizeof(DedupCandidate), compare_candidates);
+  size_t duplicates = 0;
+  unsigned long long saved = 0;
+  size_t hashed = 0;
+
+  for(size_t start = 0; start < count;) {
+    size_t end = start + 1;
+
+    while(end < count && candidates[end].size == candidates[start].size) {
+      end++;
+    }
+
+    // Within a size bucket, match each file against the earlier originals
+    for(size_t i = start + 1; i < end; i++) {
+      for(size_t j = start; j < i; j++) {
+        if(file_mappings[candidates[j].mapping].duplicate_of < 0 && same_content(&candidates[j], &candidates[i])) {
+          file_mappings[candidates[i].mapping].duplicate_of = (long)candidates[j].mapping;
+          duplicates++;
+          saved += (unsigned long long)candidates[i].size;
+          break;
+        }
+      }
+    }
+
+    for(size_t i = start; i < end; i++) {
+      hashed += candidates[i].hashed;
+    }
+
+    start = end;
+  }
+
+  free(candidates);
+  printf("Deduplication: hashed %zu of %zu file(s); %zu duplicate(s), saved %.1f MiB (%llu bytes)\n",
+         hashed, count, duplicates, (double)saved / (1024.0 * 1024.0), saved);
+
+  for(size_t i = 0; i < file_mapping_count; i++) {
+    if(file_mappings[i].duplicate_of >= 0) {
+      printf("  %s -> %s\n", file_mappings[i].original_path, file_mappings[file_mappings[i].duplicate_of].original_path);
+    }
+  }
+}
@@ -0,0 +1,8 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdio.h>
+
+void dedup_file_mappings(const char *project_root);
+
+#endif // DEDUP_H
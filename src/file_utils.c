@@ -2,13 +2,26 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdbool.h>
 #include "file_utils.h"
 #include "logging.h"
 #include "parser.h"
+#include "copy_engine.h"
+#include "manifest.h"
+#include "checksums.h"
+#include "publish.h"
+#include "tar_output.h"
+
+// writev() takes at most IOV_MAX buffers per call
+#ifndef IOV_MAX
+  #define IOV_MAX 1024
+#endif
 
 // ---- Suggested by Claude 3.7 Sonnet
 FileMapping *file_mappings = NULL; // Global array of file mappings
@@ -45,6 +58,7 @@ void build_file_mappings(char **resources, size_t resource_count, const char *pr
     file_mappings[i].original_path = strdup(resources[i]);
     file_mappings[i].relative_path = NULL;
     file_mappings[i].is_cousin = 0;
+    file_mappings[i].duplicate_of = -1;
   }
 
   // Second pass: identify cousins
@@ -135,42 +149,116 @@ void build_file_mappings(char **resources, size_t resource_count, const char *pr
 
 /*
    ===  FUNCTION  ======================================================================
-           Name:  get_destination_path
-    Description:  Returns the destination path for a given source file.
-                 If the file is a cousin, it uses the relative path.
+           Name:  write_destination_path
+    Description:  Writes the destination path for a given source file to 'result'.
+                 If the file is a cousin, it uses the relative path. A duplicate
+                 found by --dedup gets the path of the resource it duplicates.
                  Otherwise, it puts the file in the assets directory.
+                 Nothing is allocated, so Step 7 calls it for every resource
+                 property. Returns 1 if the path fits in 'result_size', 0 if not.
                  Written by Qwen 2.5 Turbo (https://chat.qwen.ai/)
    =====================================================================================
 */
-const char *get_destination_path(const char *source, const char *assets_dir) {
-  static char result[4096];
+int write_destination_path(const char *source, const char *assets_dir, char *result, size_t result_size) {
+  int length;
 
   // Find the matching entry in the file_mappings
   for(size_t i = 0; i < file_mapping_count; i++) {
     if(strcmp(source, file_mappings[i].original_path) == 0) {
-      if(file_mappings[i].is_cousin && file_mappings[i].relative_path) {
+      // Duplicate content shares the asset of the first resource that has it
+      const FileMapping *mapping = file_mappings[i].duplicate_of >= 0 ? &file_mappings[file_mappings[i].duplicate_of] : &file_mappings[i];
+
+      if(mapping->is_cousin && mapping->relative_path) {
         // This is a cousin file - use the relative path
-        snprintf(result, sizeof(result), "%s/%s/%s",
-                 assets_dir, file_mappings[i].relative_path, file_mappings[i].filename);
+        length = snprintf(result, result_size, "%s/%s/%s",
+                          assets_dir, mapping->relative_path, mapping->filename);
       }
 
       else {
         // Regular file - just put in assets directory
-        snprintf(result, sizeof(result), "%s/%s",
-                 assets_dir, file_mappings[i].filename);
+        length = snprintf(result, result_size, "%s/%s",
+                          assets_dir, mapping->filename);
       }
 
-      return result;
+      return length >= 0 && (size_t)length < result_size;
     }
   }
 
   // Not found in mappings - just use the filename
   const char *filename = strrchr(source, '/');
   filename = filename ? filename + 1 : source;
-  snprintf(result, sizeof(result), "%s/%s", assets_dir, filename);
+  length = snprintf(result, result_size, "%s/%s", assets_dir, filename);
+  return length >= 0 && (size_t)length < result_size;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  get_destination_path
+    Description:  Returns the destination path for a given source file, worked out
+                 by write_destination_path(). The result is allocated and must be
+                 freed by the caller, which keeps the function safe to call from
+                 the copy worker threads.
+                 Returns NULL if memory could not be allocated or the path does
+                 not fit in PATH_MAX bytes.
+   =====================================================================================
+*/
+char *get_destination_path(const char *source, const char *assets_dir) {
+  char *result = malloc(PATH_MAX);
+
+  if(!result) {
+    console_perror("Failed to allocate memory for destination path");
+    return NULL;
+  }
+
+  // A truncated destination would collect the file under the wrong name
+  if(!write_destination_path(source, assets_dir, result, PATH_MAX)) {
+    console_error("Error: Destination path too long for: %s\n", source);
+    free(result);
+    return NULL;
+  }
+
   return result;
 }
 
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  is_duplicate_resource
+    Description:  Tells whether --dedup found the resource to have the same content
+                 as an earlier one, so it does not need to be copied
+   =====================================================================================
+*/
+int is_duplicate_resource(const char *source) {
+  for(size_t i = 0; i < file_mapping_count; i++) {
+    if(strcmp(source, file_mappings[i].original_path) == 0) {
+      return file_mappings[i].duplicate_of >= 0;
+    }
+  }
+
+  return 0;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  resolve_source_path
+    Description:  Writes the absolute path of a resource to 'out': absolute paths are
+                 used as-is, relative ones are joined to the project root.
+                 Returns 1 on success, 0 if a relative path has no project root.
+   =====================================================================================
+*/
+int resolve_source_path(const char *source, const char *project_root, char *out, size_t out_size) {
+  if(source[0] == '/') {
+    snprintf(out, out_size, "%s", source);
+    return 1;
+  }
+
+  if(!project_root || strlen(project_root) == 0) {
+    return 0;
+  }
+
+  snprintf(out, out_size, "%s/%s", project_root, source);
+  return 1;
+}
+
 /*
    ===  FUNCTION  ======================================================================
            Name:  concat_paths
@@ -332,7 +420,8 @@ void copy_file_to_directory(const char *source, const char *destination_dir, con
   else {
     // Relative path: Concatenate with project_root
     if(!project_root || strlen(project_root) == 0) {
-      fprintf(stderr, "Error: Project root directory not provided for relative path: %s\n", source);
+      console_error("Error: Project root directory not provided for relative path: %s\n", source);
+      record_failure(source);
       return;
     }
 
@@ -357,43 +446,30 @@ void copy_file_to_directory(const char *source, const char *destination_dir, con
   /* Debugging statement */
   /*printf("DEBUG: Destination path: %s\n", destination);*/
 
-  // Check if the destination file already exists
-  if(access(destination, F_OK) == 0) {
-    /*printf("DEBUG: Destination file already exists: %s. Skipping copy.\n", destination);*/
-    return; // File already exists, skip copying
-  }
+  // --output-format tar and zstd append the file to the archive under its bundle path
+  if(copy_options.output_format != OUTPUT_DIRECTORY) {
+    if(tar_add_file(full_source_path, destination)) {
+      console_printf("Copied file from %s to %s\n", full_source_path, destination);
+    }
 
-  // Open the source file
-  FILE *src = fopen(full_source_path, "rb");
+    else {
+      record_failure(full_source_path);
+    }
 
-  if(!src) {
-    printf("\nSource File: %s\n\n", full_source_path);
-    perror("Failed to open source file");
     return;
   }
 
-  // Open the destination file
-  FILE *dst = fopen(destination, "wb");
-
-  if(!dst) {
-    perror("Failed to open destination file");
-    fclose(src);
+  // Skip files an earlier run (or resource) already collected and that have not changed
+  if(manifest_is_current(full_source_path, destination)) {
     return;
   }
 
-  // Copy the file contents
-  const int buf_size = 4096;
-  char buffer[buf_size];
-  size_t bytes_read;
-
-  while((bytes_read = fread(buffer, 1, buf_size, src)) > 0) {
-    fwrite(buffer, 1, bytes_read, dst);
+  // Link or copy the file through the copy engine; queued files are reported when flushed
+  if(transfer_file(full_source_path, destination) != TRANSFER_DONE) {
+    return;
   }
 
-  // Close files
-  fclose(src);
-  fclose(dst);
-  printf("Copied file from %s to %s\n", full_source_path, destination);
+  console_printf("Copied file from %s to %s\n", full_source_path, destination);
 }
 
 /*
@@ -421,7 +497,8 @@ void copy_file_to_directory_with_context(const char *source, const char *destina
   else {
     // Relative path: Concatenate with project_root
     if(!project_root || strlen(project_root) == 0) {
-      fprintf(stderr, "Error: Project root directory not provided for relative path: %s\n", source);
+      console_error("Error: Project root directory not provided for relative path: %s\n", source);
+      record_failure(source);
       return;
     }
 
@@ -429,373 +506,333 @@ void copy_file_to_directory_with_context(const char *source, const char *destina
   }
 
   // Construct the destination path
-  const char *destination = get_destination_path(source, destination_dir);
+  char *destination = get_destination_path(source, destination_dir);
 
+  // get_destination_path() has reported why there is none
   if(!destination) {
-    fprintf(stderr, "Error: Failed to determine destination path for source: %s\n", source);
+    record_failure(full_source_path);
     return;
   }
 
-  // Check if the destination file already exists
-  if(access(destination, F_OK) == 0) {
-    return; // File already exists, skip copying
-  }
+  // --output-format tar and zstd append the file to the archive under its bundle path
+  if(copy_options.output_format != OUTPUT_DIRECTORY) {
+    if(tar_add_file(full_source_path, destination)) {
+      console_printf("Copied file from %s to %s\n", full_source_path, destination);
+    }
 
-  // Open the source file
-  FILE *src = fopen(full_source_path, "rb");
+    else {
+      record_failure(full_source_path);
+    }
 
-  if(!src) {
-    printf("\nSource File: %s\n\n", full_source_path);
-    perror("Failed to open source file");
+    free(destination);
     return;
   }
 
-  // Open the destination file
-  FILE *dst = fopen(destination, "wb");
-
-  if(!dst) {
-    perror("Failed to open destination file");
-    fclose(src);
+  // Skip files an earlier run (or resource) already collected and that have not changed
+  if(manifest_is_current(full_source_path, destination)) {
+    free(destination);
     return;
   }
 
-  // Copy the file contents
-  const int buf_size = 4096;
-  char buffer[buf_size];
-  size_t bytes_read;
-
-  while((bytes_read = fread(buffer, 1, buf_size, src)) > 0) {
-    fwrite(buffer, 1, bytes_read, dst);
+  // Link or copy the file through the copy engine; queued files are reported when flushed
+  if(transfer_file(full_source_path, destination) == TRANSFER_DONE) {
+    console_printf("Copied file from %s to %s\n", full_source_path, destination);
   }
 
-  // Close files
-  fclose(src);
-  fclose(dst);
-  printf("Copied file from %s to %s\n", full_source_path, destination);
+  free(destination);
 }
 
 /*
    ===  FUNCTION  ======================================================================
-           Name:  str_replace
-    Description:  Replaces all occurrences of 'search' with 'replace' in 'src'
-    Written by Qwen 2.5 Turbo (https://chat.qwen.ai/)
+           Name:  collect_resource
+    Description:  Step 6 of main() for one resource: creates the directory the
+                 resource maps to under 'assets_dir' and copies it there. Only uses
+                 thread-safe helpers, so the copy worker pool calls it concurrently.
    =====================================================================================
 */
-char *str_replace(const char *src, const char *search, const char *replace) {
-  if(!src || !search || !replace) {
-    return NULL;
-  }
-
-  // Calculate lengths of input strings
-  size_t search_len = strlen(search);
-
-  if(search_len == 0) {
-    return strdup(src);  // Avoid infinite loops when searching for empty string
+void collect_resource(const char *resource, const char *assets_dir, const char *project_root, const char *input_file) {
+  if(is_duplicate_resource(resource)) {
+    return; // The resource with the same content puts the asset in place
   }
 
-  size_t replace_len = strlen(replace);
-  size_t src_len = strlen(src);
-  // Count the number of replacements needed
-  size_t count = 0;
-  const char *temp = src;
+  char *destination = get_destination_path(resource, assets_dir);
 
-  while((temp = strstr(temp, search)) != NULL) {
-    count++;
-    temp += search_len;
+  if(!destination) {
+    return; // Skip invalid paths
   }
 
-  // Allocate memory for the result
-  size_t result_len = src_len + count * (replace_len - search_len) + 1;
-  char *result = malloc(result_len);
-
-  if(!result) {
-    return NULL;
-  }
+  // Create the directory if it doesn't exist
+  char *last_slash = strrchr(destination, '/');
 
-  // Perform the replacement
-  char *ptr = result;
-  temp = src;
+  if(last_slash) {
+    *last_slash = '\0'; // Null-terminate before the filename
 
-  while(count--) {
-    const char *pos = strstr(temp, search);
-    size_t prefix_len = pos - temp;
-    memcpy(ptr, temp, prefix_len);
-    ptr += prefix_len;
-    memcpy(ptr, replace, replace_len);
-    ptr += replace_len;
-    temp = pos + search_len;
+    if(!create_directory(destination)) {
+      console_error("Error: Failed to create destination directory: %s\n", destination);
+    }
   }
 
-  strcpy(ptr, temp); // Copy the remaining part of the string
-  return result;
+  free(destination);
+  // Copy the file
+  copy_file_to_directory_with_context(resource, assets_dir, project_root, input_file);
 }
 
 /*
    ===  FUNCTION  ======================================================================
-           Name:  str_replace_in_place
-    Description:  Replaces all occurrences of 'search' with 'replace' in 'line'
+           Name:  process_resource_path
+    Description:  Works out where a resource goes in the bundle and writes its path
+    relative to the project, "assets/..." or "assets/<cousin dirs>/...", to 'new_path'.
+    Resources are video, audio, and image files; "0" (e.g. of a color producer) is
+    not a file. Returns 1 if the path is to be replaced, 0 to keep it.
     Written by Qwen 2.5 Turbo (https://chat.qwen.ai/)
    =====================================================================================
 */
-void str_replace_in_place(char *line, const char *search, const char *replace) {
-  char buffer[4 * BUFFER];
-  strncpy(buffer, line, sizeof(buffer));
-  buffer[sizeof(buffer) - 1] = '\0';
-  size_t search_len = strlen(search);
-  size_t replace_len = strlen(replace);
-  size_t src_len = strlen(buffer);
-  size_t count = 0;
-  const char *temp = buffer;
-
-  while((temp = strstr(temp, search)) != NULL) {
-    count++;
-    temp += search_len;
+static int process_resource_path(const char *original_path, const char *assets_dir, char *new_path, size_t new_path_size) {
+  if(strcmp(original_path, "0") == 0) {
+    return 0;
   }
 
-  size_t result_len = src_len + count * (replace_len - search_len) + 1;
+  // Get the destination path using write_destination_path
+  char destination[PATH_MAX];
 
-  if(result_len > sizeof(buffer)) {
-    perror("Buffer overflow in str_replace_in_place");
-    return;
+  if(!write_destination_path(original_path, assets_dir, destination, sizeof(destination))) {
+    fprintf(stderr, "Error: Failed to determine destination path for source: %s\n", original_path);
+    return 0;
   }
 
-  char *ptr = line;
-  temp = buffer;
+  // The path below the assets directory, which write_destination_path() puts first
+  size_t assets_dir_length = strlen(assets_dir);
 
-  while(count--) {
-    const char *pos = strstr(temp, search);
-    size_t prefix_len = pos - temp;
-    memcpy(ptr, temp, prefix_len);
-    ptr += prefix_len;
-    memcpy(ptr, replace, replace_len);
-    ptr += replace_len;
-    temp = pos + search_len;
+  if(strncmp(destination, assets_dir, assets_dir_length) != 0 || destination[assets_dir_length] != '/') {
+    fprintf(stderr, "Error: Incorrect destination path format: %s\n", destination);
+    return 0;
   }
 
-  strcpy(ptr, temp); // Copy the remaining part of the string
+  snprintf(new_path, new_path_size, "assets/%s", destination + assets_dir_length + 1);
+  return 1;
 }
 
 /*
    ===  FUNCTION  ======================================================================
-           Name:  process_resource_line
-    Description:  Processes a resource line by extracting the original path and validating it.
-    Resource lines are XML tags that contain video, audio, and image file paths.
-    Written by Qwen 2.5 Turbo (https://chat.qwen.ai/)
+           Name:  asset_subdir
+    Description:  Returns the subdirectory of the assets directory a LUT, stabiliser
+                 or alpha-transition file goes to
    =====================================================================================
 */
-void process_resource_line(char *line, const char *assets_dir, FILE *out) {
-  char *start = strchr(line, '>') + 1;
-  char *end = strrchr(line, '<');
-
-  if(start && end && start < end) {
-    size_t len = end - start;
-    char original_path[4096] = {0};
-    strncpy(original_path, start, len);
-    original_path[len] = '\0';
-    /* Debugging statement */
-    /*printf("DEBUG: Original path: %s\n", original_path);*/
-
-    // Validate original_path
-    if(len == 0 || original_path[0] == '\0' || strcmp(original_path, "0") == 0) {
-      if(strcmp(line, "<property name=\"resource\">0</property>") == 0) {
-        fprintf(stderr, "Error: Invalid resource path in line: %s\n", line);
-        return;
-      }
+const char *asset_subdir(AssetKind kind) {
+  switch(kind) {
+    case ASSET_LUT:
+      return "LUT";
 
-      else {
-        fputs(line, out); // Write the line as-is
-        return;
-      }
-    }
+    case ASSET_STABILIZER:
+      return "stabilization_data";
 
-    // Get the destination path using get_destination_path
-    const char *destination = get_destination_path(original_path, assets_dir);
+    default:
+      return "alpha_transition";
+  }
+}
 
-    if(!destination) {
-      fprintf(stderr, "Error: Failed to determine destination path for source: %s\n", original_path);
-      fputs(line, out); // Write the line as-is
-      return;
-    }
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  collect_extra
+    Description:  Step 6 for a LUT, stabiliser or alpha-transition file: copies
+                 'source' into its subdirectory of 'assets_dir'. Only uses
+                 thread-safe helpers, like collect_resource().
+   =====================================================================================
+*/
+void collect_extra(const char *source, AssetKind kind, const char *assets_dir, const char *project_root) {
+  char destination_dir[4096];
+  snprintf(destination_dir, sizeof(destination_dir), "%s/%s", assets_dir, asset_subdir(kind));
+  copy_file_to_directory(source, destination_dir, project_root);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  plan_project_rewrites
+    Description:  Sets the replacement of every span of 'project': the path of a
+                 resource, LUT, stabiliser or alpha-transition file in the bundle,
+                 relative to the project. A resource inside a <transition> is an
+                 alpha transition's matte. Needs the file mappings of Step 3,
+                 copies nothing and can run before Step 6.
+                 Returns 1 on success, 0 if out of memory.
+   =====================================================================================
+*/
+int plan_project_rewrites(ParsedProject *project) {
+  char original_path[4096];
+  char new_path[4096];
 
-    // Extract the relative path from the destination path
-    const char *assets_dir_end = strstr(destination, "assets/");
+  for(size_t i = 0; i < project->span_count; i++) {
+    ProjectSpan *span = &project->spans[i];
+    const char *value = project->input.data + span->offset;
 
-    if(!assets_dir_end) {
-      fprintf(stderr, "Error: Incorrect destination path format: %s\n", destination);
-      fputs(line, out); // Write the line as-is
-      return;
+    if(span->length >= sizeof(original_path)) {
+      fprintf(stderr, "Error: Path too long in project file: %.64s...\n", value);
+      continue;
     }
 
-    // Skip "assets/" to get the relative path
-    const char *relative_path = assets_dir_end + strlen("assets/");
-    // Replace the original path with the new relative path in the line
-    char new_path[4096] = {0};
-    snprintf(new_path, sizeof(new_path), "assets/%s", relative_path);
-    // Replace the original path with the new path in the line
-    char *modified_line = str_replace(line, original_path, new_path);
-
-    if(modified_line) {
-      fputs(modified_line, out);
-      free(modified_line);
+    memcpy(original_path, value, span->length);
+    original_path[span->length] = '\0';
+
+    if(span->kind == ASSET_RESOURCE) {
+      // The destination is worked out below a relative "assets", which it starts with
+      if(!process_resource_path(original_path, "assets", new_path, sizeof(new_path))) {
+        continue;
+      }
     }
 
     else {
-      perror("Failed to allocate memory for modified resource line");
-      fputs(line, out); // Fallback: Write the original line
+      const char *filename = strrchr(original_path, '/');
+      filename = filename ? filename + 1 : original_path;
+      int length = snprintf(new_path, sizeof(new_path), "assets/%s/%s", asset_subdir(span->kind), filename);
+
+      // A truncated path would point nowhere, so the original is kept instead
+      if(length < 0 || (size_t)length >= sizeof(new_path)) {
+        fprintf(stderr, "Error: Bundle path too long for: %s\n", original_path);
+        continue;
+      }
     }
-  }
 
-  else {
-    // Copy lines with no valid resource path
-    fputs(line, out);
+    span->replacement = strdup(new_path);
+    span->replacement_length = strlen(new_path);
+
+    if(!span->replacement) {
+      perror("Failed to allocate memory for the project rewrite");
+      return 0;
+    }
   }
+
+  return 1;
 }
 
 /*
    ===  FUNCTION  ======================================================================
-           Name:  process_lut_line
-    Description:  Processes a LUT line by extracting the original path and validating it.
-    LUT lines are XML tags that contain LUT file paths.
-    Written by Qwen 2.5 Turbo (https://chat.qwen.ai/)
+           Name:  project_iovecs
+    Description:  Lays out the rewritten project as a list of buffers: the spans of
+                 the input between the replaced paths, pointing straight into it,
+                 and the replacements. Nothing is copied. Stores the number of
+                 buffers in '*count'. Returns the list to free(), or NULL if out
+                 of memory.
    =====================================================================================
 */
-void process_lut_line(char *line, const char *lut_dir, FILE *out, const char *proj_root) {
-  char *start = strchr(line, '>') + 1;
-  char *end = strrchr(line, '<');
-
-  if(start && end && start < end) {
-    size_t len = end - start;
-    char original_path[4096] = {0};
-    strncpy(original_path, start, len);
-    original_path[len] = '\0';
-    /* Debugging statement */
-    /*printf("DEBUG: Original LUT path: %s\n", original_path);*/
-
-    // Validate original_path
-    if(len == 0 || original_path[0] == '\0') {
-      fprintf(stderr, "Error: Invalid LUT path in line: %s\n", line);
-      fputs(line, out); // Write the line as-is
-      return;
-    }
+static struct iovec *project_iovecs(const ParsedProject *project, size_t *count) {
+  struct iovec *iov = malloc((2 * project->span_count + 1) * sizeof(struct iovec));
+  const char *data = project->input.data;
+  size_t written = 0;
+  *count = 0;
 
-    // Extract just the filename from the path
-    const char *filename = strrchr(original_path, '/');
-    filename = filename ? filename + 1 : original_path;
-    char new_path[4096] = {0};
-    snprintf(new_path, sizeof(new_path) + BUFFER, "assets/LUT/%s", filename);
-    // Copy the LUT file to the LUT directory
-    copy_file_to_directory(original_path, lut_dir, proj_root);
-    // Replace the original path with the new path in the line
-    char *modified_line = str_replace(line, original_path, new_path);
-
-    if(modified_line) {
-      fputs(modified_line, out);
-      free(modified_line);
+  if(!iov) {
+    return NULL;
+  }
+
+  for(size_t i = 0; i < project->span_count; i++) {
+    const ProjectSpan *span = &project->spans[i];
+
+    if(!span->replacement) {
+      continue;
     }
 
-    else {
-      perror("Failed to allocate memory for modified LUT line");
-      fputs(line, out); // Fallback: Write the original line
+    if(span->offset > written) {
+      iov[*count].iov_base = (void *)(data + written);
+      iov[(*count)++].iov_len = span->offset - written;
     }
+
+    iov[*count].iov_base = span->replacement;
+    iov[(*count)++].iov_len = span->replacement_length;
+    written = span->offset + span->length;
   }
 
-  else {
-    // Copy lines with no valid LUT path
-    fputs(line, out);
+  if(project->input.size > written) {
+    iov[*count].iov_base = (void *)(data + written);
+    iov[(*count)++].iov_len = project->input.size - written;
   }
+
+  return iov;
 }
 
 /*
    ===  FUNCTION  ======================================================================
-           Name:  process_file_stabilizer_line
-    Description:  Processes a file stabilizer line by extracting the original path and validating it.
-    File stabilizer lines are XML tags that contain the stabilization data file paths.
-    Written by Qwen 2.5 Turbo (https://chat.qwen.ai/)
+           Name:  write_project
+    Description:  Step 7: writes the project to 'fd' from its rewrite plan - the
+                 input unchanged between the spans, and each replaced path in
+                 place of the original - with writev() calls of up to IOV_MAX
+                 buffers, retrying short writes. Returns 1 on success, 0 on
+                 failure with errno set.
    =====================================================================================
 */
-void process_file_stabilizer_line(char *line, const char *stabilizer_presets_dir, FILE *out, const char *proj_root) {
-  char *start = strchr(line, '>') + 1;
-  char *end = strrchr(line, '<');
-
-  if(start && end && start < end) {
-    size_t len = end - start;
-    char original_path[4096] = {0};
-    strncpy(original_path, start, len);
-    original_path[len] = '\0';
-    /* Debugging statement */
-    /*printf("DEBUG: Original stabilization_data path: %s\n", original_path);*/
-
-    // Validate original_path
-    if(len == 0 || original_path[0] == '\0') {
-      fprintf(stderr, "Error: Invalid LUT path in line: %s\n", line);
-      fputs(line, out); // Write the line as-is
-      return;
+int write_project(const ParsedProject *project, int fd) {
+  size_t count;
+  struct iovec *list = project_iovecs(project, &count);
+  struct iovec *iov = list;
+
+  if(!list) {
+    return 0;
+  }
+
+  while(count > 0) {
+    ssize_t n = writev(fd, iov, count < IOV_MAX ? (int)count : IOV_MAX);
+
+    if(n < 0 && errno == EINTR) {
+      continue;
     }
 
-    // Extract just the filename from the path
-    const char *filename = strrchr(original_path, '/');
-    filename = filename ? filename + 1 : original_path;
-    char new_path[4096] = {0};
-    snprintf(new_path, sizeof(new_path) + BUFFER, "assets/stabilization_data/%s", filename);
-    // Copy the LUT file to the LUT directory
-    copy_file_to_directory(original_path, stabilizer_presets_dir, proj_root);
-    // Replace the original path with the new path in the line
-    char *modified_line = str_replace(line, original_path, new_path);
-
-    if(modified_line) {
-      fputs(modified_line, out);
-      free(modified_line);
+    if(n <= 0) {
+      if(n == 0) {
+        errno = EIO;
+      }
+
+      free(list);
+      return 0;
     }
 
-    else {
-      perror("Failed to allocate memory for modified file_stabilizer_line line");
-      fputs(line, out); // Fallback: Write the original line
+    // Drop the buffers that went out; a short write leaves part of one
+    while(count > 0 && (size_t)n >= iov->iov_len) {
+      n -= (ssize_t)iov->iov_len;
+      iov++;
+      count--;
     }
-  }
 
-  else {
-    // Copy lines with no valid LUT path
-    fputs(line, out);
+    if(count > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= (size_t)n;
+    }
   }
+
+  free(list);
+  return 1;
 }
 
 /*
    ===  FUNCTION  ======================================================================
-           Name:  process_alpha_transition_line
-    Description:  Processes an alpha transition line by extracting the original path and validating it.
-    Written by Qwen 2.5 Turbo (https://chat.qwen.ai/)
+           Name:  render_project
+    Description:  Step 7 into memory for --plan and the archive writers: gathers the
+                 buffers of project_iovecs() into one allocation and stores its
+                 size in '*size'. Returns it to free(), or NULL if out of memory.
    =====================================================================================
 */
-void process_alpha_transition_line(char *line, const char *alpha_transition_dir, FILE *out, const char *proj_root) {
-  char *start = strchr(line, '>') + 1;
-  char *end = strrchr(line, '<');
-
-  if(start && end && start < end) {
-    size_t len = end - start;
-    char original_path[4096] = {0};
-    strncpy(original_path, start, len);
-    original_path[len] = '\0';
-
-    // Validate original_path
-    if(strlen(original_path) == 0 || original_path[0] == '\0') {
-      fprintf(stderr, "Error: Invalid alpha transition path in line: %s\n", line);
-      fputs(line, out); // Write the line as-is
-      return;
-    }
+char *render_project(const ParsedProject *project, size_t *size) {
+  size_t count;
+  struct iovec *iov = project_iovecs(project, &count);
+  char *rendered = NULL;
+  *size = 0;
+
+  if(!iov) {
+    return NULL;
+  }
+
+  for(size_t i = 0; i < count; i++) {
+    *size += iov[i].iov_len;
+  }
+
+  // One byte more, so an empty project is not mistaken for a failure
+  rendered = malloc(*size + 1);
 
-    // Construct the new path in alpha_transition directory
-    const char *filename = strrchr(original_path, '/');
-    filename = filename ? filename + 1 : original_path;
-    char new_path[4096] = {0};
-    snprintf(new_path, sizeof(new_path) + BUFFER, "assets/alpha_transition/%s", filename);
-    // Copy the alpha transition file to the alpha transition directory
-    copy_file_to_directory(original_path, alpha_transition_dir, proj_root);
-    // Replace the original path with the new path in the line
-    str_replace_in_place(line, original_path, new_path);
+  for(size_t i = 0, offset = 0; rendered && i < count; i++) {
+    memcpy(rendered + offset, iov[i].iov_base, iov[i].iov_len);
+    offset += iov[i].iov_len;
   }
 
-  // Write the modified or original line to the output file
-  fputs(line, out);
+  free(iov);
+  return rendered;
 }
 
 /*
@@ -806,9 +843,10 @@ void process_alpha_transition_line(char *line, const char *alpha_transition_dir,
   Rewritten several times by Qwen 2.5 Turbo (https://chat.qwen.ai/).
 
   PURPOSE:
-  This function reads through an MLT project file line by line, modifying and copying
-  various resource files to ensure all project dependencies are collected in a centralized
-  assets directory structure.
+  This function writes the MLT project with every path pointed into the centralized
+  assets directory structure. The project was read once by parse_project(), and
+  plan_project_rewrites() worked out the new paths; Step 6 has copied the files they
+  name by the time it runs.
 
   WHAT IT DOES:
   1. Handles three types of resource references:
@@ -817,20 +855,19 @@ void process_alpha_transition_line(char *line, const char *alpha_transition_dir,
      c. Stabilizer data files (via <property name="filename"> tags)
 
   2. For media files:
-     - Extracts the original file path
-     - Copies the file to the main assets directory
      - Updates the project file to use a relative "assets/filename" path
 
   3. For LUT files:
-     - Extracts the original LUT file path
-     - Copies the file to a special "assets/LUT/" subdirectory
      - Updates the project file to use a relative "assets/LUT/filename" path
 
   4. For stabilizer files:
-     - Extracts the original stabilizer data file path
-     - Copies the file to a special "assets/stabilization_data/" subdirectory
      - Updates the project file to use a relative "assets/stabilization_data/filename" path
 
+  5. Writes the new project under a temporary name, writes the checksums file
+     from it with --checksum, and publishes the project last with
+     publish_durably(), so a crash never leaves a project Shotcut would open
+     while its assets are still incomplete.
+
   EXAMPLE TRANSFORMATIONS:
   Media file:
      Input:  <property name="resource">/full/path/to/video.webm</property>
@@ -851,93 +888,41 @@ void process_alpha_transition_line(char *line, const char *alpha_transition_dir,
   - Preserves all project dependencies including stabilization data
 
   PARAMETERS:
-  input       - Path to the original MLT project file
+  project     - The parsed project, with its rewrites planned
   output      - Path where the modified file should be saved
-  assets_dir  - Base directory for collecting assets
-  project_root - Root directory of the project for relative path resolution
 
   RETURNS:
   1 on success, 0 on failure
 */
-int copy_and_modify_project_file(const char *input, const char *output, const char *assets_dir, const char *project_root) {
-  /*printf("DEBUG: fn copy_and_modify_project_file, file_utils.c, received input: %s, output: %s, assets_dir: %s\n", input, output, assets_dir);*/
-  FILE *in = fopen(input, "r");
+int copy_and_modify_project_file(const ParsedProject *project, const char *output) {
+  // Written under a temporary name and published once every asset is on disk
+  char *temporary = temporary_path(output);
+  int fd = temporary ? open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666) : -1;
 
-  if(!in) {
-    perror("Failed to open input project file");
-    return 0;
-  }
-
-  FILE *out = fopen(output, "w");
-
-  if(!out) {
+  if(fd < 0) {
     perror("Failed to open output project file");
-    fclose(in);
+    free(temporary);
     return 0;
   }
 
-  char line[4 * BUFFER]; // Max line length
-  char *lut_dir = concat_paths(assets_dir, "LUT");
-  char *stabilizer_dir = concat_paths(assets_dir, "stabilization_data");
-  char *alpha_transition_dir = concat_paths(assets_dir, "alpha_transition");
+  int written = write_project(project, fd);
 
-  if(!lut_dir || !stabilizer_dir || !alpha_transition_dir) {
-    perror("Failed to allocate memory for subdirectories");
-    fclose(in);
-    fclose(out);
-    free(lut_dir);
-    free(stabilizer_dir);
-    free(alpha_transition_dir);
+  if(close(fd) != 0 || !written) {
+    perror("Failed to write output project file");
+    unlink(temporary);
+    free(temporary);
     return 0;
   }
 
-  int inside_transition = 0; // Track whether we're inside a <transition> block
-
-  while(fgets(line, sizeof(line), in)) {
-    if(strstr(line, "<property name=\"resource\">")) {
-      if(inside_transition) {
-        // Process the alpha transition line
-        process_alpha_transition_line(line, alpha_transition_dir, out, project_root);
-      }
-
-      else {
-        // Process regular resource line
-        process_resource_line(line, assets_dir, out);
-      }
-    }
-
-    else if(strstr(line, "<property name=\"av.file\">")) {
-      process_lut_line(line, lut_dir, out, project_root);
-    }
+  // The checksums go first, so a visible project always comes with a complete bundle
+  int published = checksums_write(output, temporary) && publish_durably(temporary, output);
 
-    else if(strstr(line, "<property name=\"filename\">")) {
-      process_file_stabilizer_line(line, stabilizer_dir, out, project_root);
-    }
-
-    else if(strstr(line, "<transition")) {
-      inside_transition = 1;
-      // Write the opening <transition> tag as-is
-      fputs(line, out);
-    }
-
-    else if(strstr(line, "</transition>")) {
-      inside_transition = 0;
-      // Write the closing </transition> tag as-is
-      fputs(line, out);
-    }
-
-    else {
-      // Copy lines that don't match any condition
-      fputs(line, out);
-    }
+  if(!published) {
+    unlink(temporary);
   }
 
-  free(lut_dir);
-  free(stabilizer_dir);
-  free(alpha_transition_dir);
-  fclose(in);
-  fclose(out);
-  return 1;
+  free(temporary);
+  return published;
 }
 
 
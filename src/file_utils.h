@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "parser.h"
 
 #define  BUFFER  2048
 
@@ -21,6 +22,7 @@ typedef struct {
   char *original_path;  // Full original path
   char *relative_path;  // Path to use in the output
   int is_cousin;        // Flag indicating if this is a cousin
+  long duplicate_of;    // Mapping with identical content (--dedup), -1 if none
 } FileMapping;
 
 extern FileMapping *file_mappings;
@@ -29,7 +31,10 @@ extern size_t file_mapping_count;
 
 void build_file_mappings(char **resources, size_t resource_count, const char *project_root);
 char *concat_paths(const char *path1, const char *path2);
-const char *get_destination_path(const char *source, const char *assets_dir);
+int resolve_source_path(const char *source, const char *project_root, char *out, size_t out_size);
+int write_destination_path(const char *source, const char *assets_dir, char *result, size_t result_size);
+char *get_destination_path(const char *source, const char *assets_dir);
+int is_duplicate_resource(const char *source);
 
 void init_logging(const char *output_dir);
 void log_message(const char *format, ...);
@@ -37,13 +42,13 @@ void detect_and_prepare_cousins(char **resources, size_t resource_count, const c
 int create_directory(const char *path);
 void copy_file_to_directory(const char *source, const char *destination_dir, const char *project_root);
 void copy_file_to_directory_with_context(const char *source, const char *destination_dir, const char *project_root, const char *input_file);
-char *str_replace(const char *src, const char *search, const char *replace);
-void str_replace_in_place(char *line, const char *search, const char *replace);
-void process_resource_line(char *line, const char *assets_dir, FILE *out);
-void process_lut_line(char *line, const char *lut_dir, FILE *out, const char *proj_root);
-void process_file_stabilizer_line(char *line, const char *stabilizer_presets_dir, FILE *out, const char *proj_root);
-void process_alpha_transition_line(char *line, const char *alpha_transition_dir, FILE *out, const char *proj_root);
-int copy_and_modify_project_file(const char *input, const char *output, const char *assets_dir, const char *project_root);
+void collect_resource(const char *resource, const char *assets_dir, const char *project_root, const char *input_file);
+const char *asset_subdir(AssetKind kind);
+void collect_extra(const char *source, AssetKind kind, const char *assets_dir, const char *project_root);
+int plan_project_rewrites(ParsedProject *project);
+int write_project(const ParsedProject *project, int fd);
+char *render_project(const ParsedProject *project, size_t *size);
+int copy_and_modify_project_file(const ParsedProject *project, const char *output);
 void free_file_mappings();
 
 #endif // FILE_UTILS_H
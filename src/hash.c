@@ -0,0 +1,485 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include "hash.h"
+#include "copy_engine.h"
+
+// SHA-256 round constants, from FIPS 180-4
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+// XXH64 primes, from the xxHash specification
+#define  XXH_PRIME64_1  11400714785074694791ULL
+#define  XXH_PRIME64_2  14029467366897019727ULL
+#define  XXH_PRIME64_3  1609587929392839161ULL
+#define  XXH_PRIME64_4  9650029242287828579ULL
+#define  XXH_PRIME64_5  2870177450012600261ULL
+
+static uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+// Little-endian loads that do not care about alignment
+static uint64_t read64(const unsigned char *p) {
+  uint64_t v = 0;
+
+  for(int i = 7; i >= 0; i--) {
+    v = (v << 8) | p[i];
+  }
+
+  return v;
+}
+
+static uint32_t read32(const unsigned char *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+  acc += input * XXH_PRIME64_2;
+  acc = rotl64(acc, 31);
+  return acc * XXH_PRIME64_1;
+}
+
+static uint64_t xxh64_merge_round(uint64_t acc, uint64_t val) {
+  acc ^= xxh64_round(0, val);
+  return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  xxh64_init
+    Description:  Starts a new XXH64 hash with the given seed
+   =====================================================================================
+*/
+void xxh64_init(Xxh64State *state, uint64_t seed) {
+  memset(state, 0, sizeof(*state));
+  state->seed = seed;
+  state->v[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+  state->v[1] = seed + XXH_PRIME64_2;
+  state->v[2] = seed;
+  state->v[3] = seed - XXH_PRIME64_1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  xxh64_update
+    Description:  Adds 'length' bytes to the hash. Full 32-byte stripes are consumed
+                 directly; a partial stripe is kept until the next call.
+   =====================================================================================
+*/
+void xxh64_update(Xxh64State *state, const void *data, size_t length) {
+  const unsigned char *p = data;
+  const unsigned char *end = p + length;
+  state->total_len += length;
+
+  if(state->mem_size + length < 32) {
+    memcpy(state->mem + state->mem_size, p, length);
+    state->mem_size += length;
+    return;
+  }
+
+  if(state->mem_size > 0) {
+    size_t fill = 32 - state->mem_size;
+    memcpy(state->mem + state->mem_size, p, fill);
+
+    for(int i = 0; i < 4; i++) {
+      state->v[i] = xxh64_round(state->v[i], read64(state->mem + i * 8));
+    }
+
+    p += fill;
+    state->mem_size = 0;
+  }
+
+  while(end - p >= 32) {
+    for(int i = 0; i < 4; i++) {
+      state->v[i] = xxh64_round(state->v[i], read64(p + i * 8));
+    }
+
+    p += 32;
+  }
+
+  if(p < end) {
+    memcpy(state->mem, p, (size_t)(end - p));
+    state->mem_size = (size_t)(end - p);
+  }
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  xxh64_digest
+    Description:  Returns the hash of everything added so far. The state is not
+                 changed, so more data can still be added afterwards.
+   =====================================================================================
+*/
+uint64_t xxh64_digest(const Xxh64State *state) {
+  uint64_t h;
+
+  if(state->total_len >= 32) {
+    h = rotl64(state->v[0], 1) + rotl64(state->v[1], 7) + rotl64(state->v[2], 12) + rotl64(state->v[3], 18);
+
+    for(int i = 0; i < 4; i++) {
+      h = xxh64_merge_round(h, state->v[i]);
+    }
+  }
+
+  else {
+    h = state->seed + XXH_PRIME64_5;
+  }
+
+  h += state->total_len;
+  const unsigned char *p = state->mem;
+  const unsigned char *end = p + state->mem_size;
+
+  while(end - p >= 8) {
+    h ^= xxh64_round(0, read64(p));
+    h = rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    p += 8;
+  }
+
+  if(end - p >= 4) {
+    h ^= (uint64_t)read32(p) * XXH_PRIME64_1;
+    h = rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+    p += 4;
+  }
+
+  while(p < end) {
+    h ^= (*p) * XXH_PRIME64_5;
+    h = rotl64(h, 11) * XXH_PRIME64_1;
+    p++;
+  }
+
+  h ^= h >> 33;
+  h *= XXH_PRIME64_2;
+  h ^= h >> 29;
+  h *= XXH_PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+static uint32_t rotr32(uint32_t x, int r) {
+  return (x >> r) | (x << (32 - r));
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  sha256_block
+    Description:  Runs the SHA-256 compression function over one 64-byte block
+   =====================================================================================
+*/
+static void sha256_block(Sha256State *state, const unsigned char *block) {
+  uint32_t w[64];
+
+  for(int i = 0; i < 16; i++) {
+    w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+           ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+  }
+
+  for(int i = 16; i < 64; i++) {
+    uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t a = state->h[0], b = state->h[1], c = state->h[2], d = state->h[3];
+  uint32_t e = state->h[4], f = state->h[5], g = state->h[6], h = state->h[7];
+
+  for(int i = 0; i < 64; i++) {
+    uint32_t t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+    uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+
+  state->h[0] += a;
+  state->h[1] += b;
+  state->h[2] += c;
+  state->h[3] += d;
+  state->h[4] += e;
+  state->h[5] += f;
+  state->h[6] += g;
+  state->h[7] += h;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  sha256_init
+    Description:  Starts a new SHA-256 hash
+   =====================================================================================
+*/
+void sha256_init(Sha256State *state) {
+  static const uint32_t initial[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  memset(state, 0, sizeof(*state));
+  memcpy(state->h, initial, sizeof(initial));
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  sha256_update
+    Description:  Adds 'length' bytes to a SHA-256 hash
+   =====================================================================================
+*/
+void sha256_update(Sha256State *state, const void *data, size_t length) {
+  const unsigned char *p = data;
+  state->total_len += length;
+
+  if(state->block_size > 0) {
+    size_t fill = 64 - state->block_size < length ? 64 - state->block_size : length;
+    memcpy(state->block + state->block_size, p, fill);
+    state->block_size += fill;
+    p += fill;
+    length -= fill;
+
+    if(state->block_size < 64) {
+      return;
+    }
+
+    sha256_block(state, state->block);
+    state->block_size = 0;
+  }
+
+  while(length >= 64) {
+    sha256_block(state, p);
+    p += 64;
+    length -= 64;
+  }
+
+  memcpy(state->block, p, length);
+  state->block_size = length;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  sha256_final
+    Description:  Pads the message and writes the 32-byte digest. The state cannot
+                 be updated afterwards.
+   =====================================================================================
+*/
+void sha256_final(Sha256State *state, unsigned char digest[32]) {
+  uint64_t bits = state->total_len * 8;
+  unsigned char pad[72] = { 0x80 };
+  size_t pad_len = state->block_size < 56 ? 56 - state->block_size : 120 - state->block_size;
+
+  for(int i = 0; i < 8; i++) {
+    pad[pad_len + i] = (unsigned char)(bits >> (56 - i * 8));
+  }
+
+  sha256_update(state, pad, pad_len + 8);
+
+  for(int i = 0; i < 8; i++) {
+    digest[i * 4] = (unsigned char)(state->h[i] >> 24);
+    digest[i * 4 + 1] = (unsigned char)(state->h[i] >> 16);
+    digest[i * 4 + 2] = (unsigned char)(state->h[i] >> 8);
+    digest[i * 4 + 3] = (unsigned char)state->h[i];
+  }
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  checksum_name
+    Description:  Returns the tag of an algorithm as written in .checksums files,
+                 which follow the BSD "ALGORITHM (file) = digest" layout
+   =====================================================================================
+*/
+const char *checksum_name(ChecksumAlgorithm algorithm) {
+  switch(algorithm) {
+    case CHECKSUM_XXH64:
+      return "XXH64";
+
+    case CHECKSUM_SHA256:
+      return "SHA256";
+
+    default:
+      return "NONE";
+  }
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  parse_checksum_algorithm
+    Description:  Parses the value of --checksum (xxh64, sha256 or none).
+                 Returns 1 on success, 0 for an unknown value.
+   =====================================================================================
+*/
+int parse_checksum_algorithm(const char *value, ChecksumAlgorithm *algorithm) {
+  if(strcmp(value, "xxh64") == 0) {
+    *algorithm = CHECKSUM_XXH64;
+  }
+
+  else if(strcmp(value, "sha256") == 0) {
+    *algorithm = CHECKSUM_SHA256;
+  }
+
+  else if(strcmp(value, "none") == 0) {
+    *algorithm = CHECKSUM_NONE;
+  }
+
+  else {
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  checksum_init
+    Description:  Starts a checksum with the given algorithm
+   =====================================================================================
+*/
+void checksum_init(ChecksumState *state, ChecksumAlgorithm algorithm) {
+  state->algorithm = algorithm;
+
+  if(algorithm == CHECKSUM_SHA256) {
+    sha256_init(&state->u.sha256);
+  }
+
+  else {
+    xxh64_init(&state->u.xxh64, 0);
+  }
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  checksum_update
+    Description:  Adds data to a checksum
+   =====================================================================================
+*/
+void checksum_update(ChecksumState *state, const void *data, size_t length) {
+  if(state->algorithm == CHECKSUM_SHA256) {
+    sha256_update(&state->u.sha256, data, length);
+  }
+
+  else {
+    xxh64_update(&state->u.xxh64, data, length);
+  }
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  checksum_final
+    Description:  Writes the digest as lowercase hex
+   =====================================================================================
+*/
+void checksum_final(ChecksumState *state, char hex[CHECKSUM_HEX_MAX]) {
+  if(state->algorithm == CHECKSUM_SHA256) {
+    unsigned char digest[32];
+    sha256_final(&state->u.sha256, digest);
+
+    for(int i = 0; i < 32; i++) {
+      snprintf(hex + i * 2, 3, "%02x", digest[i]);
+    }
+  }
+
+  else {
+    snprintf(hex, CHECKSUM_HEX_MAX, "%016llx", (unsigned long long)xxh64_digest(&state->u.xxh64));
+  }
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  checksum_file
+    Description:  Computes the checksum of a whole file.
+                 Returns 1 on success, 0 if the file could not be read.
+   =====================================================================================
+*/
+int checksum_file(const char *path, ChecksumAlgorithm algorithm, char hex[CHECKSUM_HEX_MAX]) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if(fd < 0) {
+    return 0;
+  }
+
+  char *buffer = malloc(COPY_BUFFER_SIZE);
+
+  if(!buffer) {
+    close(fd);
+    return 0;
+  }
+
+  ChecksumState state;
+  checksum_init(&state, algorithm);
+  ssize_t n;
+
+  while((n = read(fd, buffer, COPY_BUFFER_SIZE)) != 0) {
+    if(n < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+
+      free(buffer);
+      close(fd);
+      return 0;
+    }
+
+    checksum_update(&state, buffer, (size_t)n);
+  }
+
+  free(buffer);
+  close(fd);
+  checksum_final(&state, hex);
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  hash_file_xxh64
+    Description:  Computes the XXH64 (seed 0) of a whole file.
+                 Returns 1 on success, 0 if the file could not be read.
+   =====================================================================================
+*/
+int hash_file_xxh64(const char *path, uint64_t *digest) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if(fd < 0) {
+    return 0;
+  }
+
+  char *buffer = malloc(COPY_BUFFER_SIZE);
+
+  if(!buffer) {
+    close(fd);
+    return 0;
+  }
+
+  Xxh64State state;
+  xxh64_init(&state, 0);
+  ssize_t n;
+
+  while((n = read(fd, buffer, COPY_BUFFER_SIZE)) != 0) {
+    if(n < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+
+      free(buffer);
+      close(fd);
+      return 0;
+    }
+
+    xxh64_update(&state, buffer, (size_t)n);
+  }
+
+  free(buffer);
+  close(fd);
+  *digest = xxh64_digest(&state);
+  return 1;
+}
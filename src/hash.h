@@ -0,0 +1,64 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+   Streaming state of an XXH64 content hash. Feed the data with xxh64_update()
+   in as many pieces as convenient; the digest does not depend on the split.
+*/
+typedef struct {
+  uint64_t total_len;
+  uint64_t v[4];
+  unsigned char mem[32];
+  size_t mem_size;
+  uint64_t seed;
+} Xxh64State;
+
+/*
+   Streaming state of a SHA-256 hash (FIPS 180-4)
+*/
+typedef struct {
+  uint64_t total_len;
+  uint32_t h[8];
+  unsigned char block[64];
+  size_t block_size;
+} Sha256State;
+
+// Checksums written to the bundle's .checksums file (--checksum)
+typedef enum {
+  CHECKSUM_NONE = 0,
+  CHECKSUM_XXH64,
+  CHECKSUM_SHA256
+} ChecksumAlgorithm;
+
+// Longest hex digest plus the terminating NUL
+#define  CHECKSUM_HEX_MAX  65
+
+/*
+   A running checksum of either algorithm, fed while a file is copied
+*/
+typedef struct {
+  ChecksumAlgorithm algorithm;
+  union {
+    Xxh64State xxh64;
+    Sha256State sha256;
+  } u;
+} ChecksumState;
+
+void xxh64_init(Xxh64State *state, uint64_t seed);
+void xxh64_update(Xxh64State *state, const void *data, size_t length);
+uint64_t xxh64_digest(const Xxh64State *state);
+int hash_file_xxh64(const char *path, uint64_t *digest);
+void sha256_init(Sha256State *state);
+void sha256_update(Sha256State *state, const void *data, size_t length);
+void sha256_final(Sha256State *state, unsigned char digest[32]);
+const char *checksum_name(ChecksumAlgorithm algorithm);
+int parse_checksum_algorithm(const char *value, ChecksumAlgorithm *algorithm);
+void checksum_init(ChecksumState *state, ChecksumAlgorithm algorithm);
+void checksum_update(ChecksumState *state, const void *data, size_t length);
+void checksum_final(ChecksumState *state, char hex[CHECKSUM_HEX_MAX]);
+int checksum_file(const char *path, ChecksumAlgorithm algorithm, char hex[CHECKSUM_HEX_MAX]);
+
+#endif // HASH_H
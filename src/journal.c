@@ -0,0 +1,396 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include "journal.h"
+#include "manifest.h"
+#include "file_utils.h"
+#include "logging.h"
+
+/*
+   The journal is an append-only text file with one record per line:
+
+     B <size> <mtime s> <mtime ns> <inode> <offset> <destination>   a copy started
+     P <offset> <destination>        bytes below offset are on disk
+     D <manifest line>               a copy finished
+
+   P records are only written after fdatasync() of the destination, so the
+   offset of the last one is safe to continue from. The journal is removed
+   once the manifest has been saved at the end of a successful run.
+*/
+
+/*
+   A copy the interrupted run started but did not finish, read back by --resume
+*/
+typedef struct {
+  char *key;
+  unsigned long long size;
+  long long mtime_sec;
+  long mtime_nsec;
+  unsigned long long inode;
+  off_t offset;
+} InFlightCopy;
+
+typedef struct {
+  char *output_dir;
+  size_t output_dir_len;
+  int fd;
+  InFlightCopy *copies;
+  size_t count;
+  int partial;         // A failed copy left a prefix for --resume
+  pthread_mutex_t lock;
+} Journal;
+
+static Journal journal = { NULL, 0, -1, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  journal_key
+    Description:  Returns 'destination' relative to the output directory, matching
+                 the keys of the manifest
+   =====================================================================================
+*/
+static const char *journal_key(const char *destination) {
+  if(strncmp(destination, journal.output_dir, journal.output_dir_len) == 0 &&
+     destination[journal.output_dir_len] == '/') {
+    return destination + journal.output_dir_len + 1;
+  }
+
+  return destination;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  find_copy
+    Description:  Returns the in-flight record for 'key', or NULL. The table is only
+                 built by journal_open(), so no locking is needed.
+   =====================================================================================
+*/
+static InFlightCopy *find_copy(const char *key) {
+  for(size_t i = journal.count; i > 0; i--) {
+    if(strcmp(journal.copies[i - 1].key, key) == 0) {
+      return &journal.copies[i - 1];
+    }
+  }
+
+  return NULL;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  append_record
+    Description:  Writes one record with a single write() so concurrent workers
+                 never interleave inside a line. Caller holds the lock.
+                 Returns 1 on success, 0 on failure.
+   =====================================================================================
+*/
+static int append_record(const char *record) {
+  size_t len = strlen(record);
+
+  while(len > 0) {
+    ssize_t n = write(journal.fd, record, len);
+
+    if(n < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+
+      return 0;
+    }
+
+    record += n;
+    len -= (size_t)n;
+  }
+
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  replay_journal
+    Description:  Reads the journal of an interrupted run: finished copies go into
+                 the manifest so they are skipped, started ones are kept with the
+                 offset of their last checkpoint. Returns 1 on success, 0 when out
+                 of memory.
+   =====================================================================================
+*/
+static int replay_journal(const char *path) {
+  FILE *file = fopen(path, "r");
+
+  if(!file) {
+    return 1; // Nothing to resume
+  }
+
+  char line[BUFFER * 3];
+  size_t capacity = 0;
+  size_t finished = 0;
+
+  while(fgets(line, sizeof(line), file)) {
+    size_t len = strlen(line);
+
+    if(len < 3 || line[len - 1] != '\n' || line[1] != '\t') {
+      continue; // A record cut short by the interruption
+    }
+
+    line[len - 1] = '\0';
+    char *record = line + 2;
+
+    if(line[0] == 'D') {
+      finished += manifest_add_line(record);
+      continue;
+    }
+
+    if(line[0] == 'P') {
+      long long offset;
+      int key_offset = 0;
+
+      if(sscanf(record, "%lld\t%n", &offset, &key_offset) == 1 && key_offset > 0) {
+        InFlightCopy *copy = find_copy(record + key_offset);
+
+        if(copy) {
+          copy->offset = (off_t)offset;
+        }
+      }
+
+      continue;
+    }
+
+    if(line[0] != 'B') {
+      continue;
+    }
+
+    InFlightCopy copy = { NULL, 0, 0, 0, 0, 0 };
+    long long offset;
+    int key_offset = 0;
+
+    if(sscanf(record, "%llu\t%lld\t%ld\t%llu\t%lld\t%n", &copy.size, &copy.mtime_sec, &copy.mtime_nsec, &copy.inode, &offset, &key_offset) != 5 ||
+       key_offset == 0 || record[key_offset] == '\0') {
+      continue;
+    }
+
+    copy.offset = (off_t)offset;
+
+    if(journal.count == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      InFlightCopy *copies = realloc(journal.copies, capacity * sizeof(InFlightCopy));
+
+      if(!copies) {
+        fclose(file);
+        return 0;
+      }
+
+      journal.copies = copies;
+    }
+
+    if(!(copy.key = strdup(record + key_offset))) {
+      fclose(file);
+      return 0;
+    }
+
+    journal.copies[journal.count++] = copy;
+  }
+
+  fclose(file);
+
+  if(finished > 0 || journal.count > 0) {
+    printf("Resuming: %zu finished and %zu started copies in the journal.\n", finished, journal.count);
+  }
+
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  journal_open
+    Description:  Starts the journal in 'output_dir'. With 'resume' the journal of
+                 an interrupted run is replayed first and appended to; otherwise it
+                 is started afresh. Call after manifest_load().
+                 Returns 1 on success, 0 on failure.
+   =====================================================================================
+*/
+int journal_open(const char *output_dir, int resume) {
+  char *path = concat_paths(output_dir, JOURNAL_FILE);
+  journal.output_dir = strdup(output_dir);
+
+  if(!path || !journal.output_dir) {
+    perror("Failed to allocate memory for journal");
+    free(path);
+    return 0;
+  }
+
+  journal.output_dir_len = strlen(output_dir);
+
+  if(resume && !replay_journal(path)) {
+    perror("Failed to read journal");
+    free(path);
+    return 0;
+  }
+
+  journal.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (resume ? 0 : O_TRUNC), 0644);
+
+  if(journal.fd < 0) {
+    perror("Failed to open journal");
+    free(path);
+    return 0;
+  }
+
+  free(path);
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  journal_active
+    Description:  Tells whether copies are being journaled
+   =====================================================================================
+*/
+int journal_active(void) {
+  return journal.fd >= 0;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  journal_resume_offset
+    Description:  Returns the offset an interrupted copy to 'destination' can be
+                 continued from: the last checkpoint, provided the source still has
+                 the size, mtime and inode the copy started with. Returns 0 when the
+                 copy has to start from the beginning.
+   =====================================================================================
+*/
+off_t journal_resume_offset(const char *destination, const struct stat *source_st) {
+  if(journal.fd < 0 || journal.count == 0) {
+    return 0;
+  }
+
+  InFlightCopy *copy = find_copy(journal_key(destination));
+
+  if(!copy || copy->offset <= 0 || copy->offset > source_st->st_size ||
+     copy->size != (unsigned long long)source_st->st_size ||
+     copy->mtime_sec != (long long)source_st->st_mtim.tv_sec ||
+     copy->mtime_nsec != source_st->st_mtim.tv_nsec ||
+     copy->inode != (unsigned long long)source_st->st_ino) {
+    return 0;
+  }
+
+  return copy->offset;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  journal_begin
+    Description:  Records that a copy of 'source_st' to 'destination' is starting,
+                 at 'offset' when it continues an interrupted copy
+   =====================================================================================
+*/
+void journal_begin(const char *destination, const struct stat *source_st, off_t offset) {
+  if(journal.fd < 0 || strchr(destination, '\n')) {
+    return;
+  }
+
+  char record[BUFFER * 3];
+  snprintf(record, sizeof(record), "B\t%llu\t%lld\t%ld\t%llu\t%lld\t%s\n", (unsigned long long)source_st->st_size,
+           (long long)source_st->st_mtim.tv_sec, source_st->st_mtim.tv_nsec, (unsigned long long)source_st->st_ino,
+           (long long)offset, journal_key(destination));
+  pthread_mutex_lock(&journal.lock);
+  append_record(record);
+  pthread_mutex_unlock(&journal.lock);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  journal_checkpoint
+    Description:  Flushes the destination behind 'fd' and then records that the
+                 bytes below 'offset' are safely on disk. Returns 1 on success, 0 if
+                 the destination could not be flushed (the copy should fail).
+   =====================================================================================
+*/
+int journal_checkpoint(int fd, const char *destination, off_t offset) {
+  if(journal.fd < 0 || strchr(destination, '\n')) {
+    return 1;
+  }
+
+  if(fdatasync(fd) != 0) {
+    return 0;
+  }
+
+  char record[BUFFER * 3];
+  snprintf(record, sizeof(record), "P\t%lld\t%s\n", (long long)offset, journal_key(destination));
+  pthread_mutex_lock(&journal.lock);
+
+  if(append_record(record)) {
+    fdatasync(journal.fd);
+  }
+
+  pthread_mutex_unlock(&journal.lock);
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  journal_done
+    Description:  Records a finished asset with its manifest line (see manifest.c)
+   =====================================================================================
+*/
+void journal_done(const char *manifest_line) {
+  if(journal.fd < 0 || strchr(manifest_line, '\n')) {
+    return;
+  }
+
+  char record[BUFFER * 3 + 4];
+  snprintf(record, sizeof(record), "D\t%s\n", manifest_line);
+  pthread_mutex_lock(&journal.lock);
+  append_record(record);
+  pthread_mutex_unlock(&journal.lock);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  journal_keep_partial
+    Description:  Notes that a failed copy kept its checkpointed prefix, so the
+                 journal must survive the run for --resume to find it
+   =====================================================================================
+*/
+void journal_keep_partial(void) {
+  pthread_mutex_lock(&journal.lock);
+  journal.partial = 1;
+  pthread_mutex_unlock(&journal.lock);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  journal_close
+    Description:  Closes the journal. When the run 'completed' (the manifest has been
+                 saved) and no failed copy is waiting for --resume, the journal is no
+                 longer needed and is removed.
+   =====================================================================================
+*/
+void journal_close(int completed) {
+  if(journal.fd >= 0) {
+    close(journal.fd);
+    journal.fd = -1;
+
+    if(completed && !journal.partial) {
+      char *path = concat_paths(journal.output_dir, JOURNAL_FILE);
+
+      if(path) {
+        unlink(path);
+        free(path);
+      }
+    }
+  }
+
+  for(size_t i = 0; i < journal.count; i++) {
+    free(journal.copies[i].key);
+  }
+
+  free(journal.copies);
+  free(journal.output_dir);
+  journal.copies = NULL;
+  journal.output_dir = NULL;
+  journal.count = 0;
+}
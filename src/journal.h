@@ -0,0 +1,22 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Name of the write-ahead journal inside the output directory
+#define  JOURNAL_FILE  ".collector_journal"
+// Bytes copied between two checkpoints; smaller files are never checkpointed
+#define  JOURNAL_CHECKPOINT  (128L * 1024L * 1024L)
+
+int journal_open(const char *output_dir, int resume);
+int journal_active(void);
+off_t journal_resume_offset(const char *destination, const struct stat *source_st);
+void journal_begin(const char *destination, const struct stat *source_st, off_t offset);
+int journal_checkpoint(int fd, const char *destination, off_t offset);
+void journal_done(const char *manifest_line);
+void journal_keep_partial(void);
+void journal_close(int completed);
+
+#endif // JOURNAL_H
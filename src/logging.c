@@ -7,10 +7,15 @@
 #include <errno.h>
 #include "logging.h"
 #include "file_utils.h"
+#include "progress.h"
 
 // Global log file pointer
 FILE *log_file = NULL;
 
+// Per-thread capture streams; NULL means print straight to stdout/stderr
+static __thread FILE *capture_out = NULL;
+static __thread FILE *capture_err = NULL;
+
 /*
    ===  FUNCTION  ======================================================================
            Name:  init_logging
@@ -55,3 +60,158 @@ void log_message(const char *format, ...) {
     fflush(log_file);
   }
 }
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  console_printf
+    Description:  printf() for messages from the copy path. Goes to stdout, or to the
+                 calling thread's capture buffer while one is active. Text for the
+                 terminal is printed with the progress status line out of the way.
+   =====================================================================================
+*/
+void console_printf(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+
+  if(capture_out) {
+    vfprintf(capture_out, format, args);
+  }
+
+  else {
+    progress_pause();
+    vfprintf(stdout, format, args);
+    progress_resume();
+  }
+
+  va_end(args);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  console_error
+    Description:  fprintf(stderr, ...) counterpart of console_printf()
+   =====================================================================================
+*/
+void console_error(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+
+  if(capture_err) {
+    vfprintf(capture_err, format, args);
+  }
+
+  else {
+    progress_pause();
+    vfprintf(stderr, format, args);
+    progress_resume();
+  }
+
+  va_end(args);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  console_perror
+    Description:  perror() counterpart of console_printf()
+   =====================================================================================
+*/
+void console_perror(const char *message) {
+  int err = errno;
+  console_error("%s: %s\n", message, strerror(err));
+  errno = err;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  console_capture_begin
+    Description:  Starts buffering the calling thread's console_* output.
+                 Returns 1 on success, 0 if the buffers could not be created, in
+                 which case output keeps going straight to the terminal.
+   =====================================================================================
+*/
+int console_capture_begin(ConsoleCapture *capture) {
+  memset(capture, 0, sizeof(*capture));
+  capture->out = open_memstream(&capture->out_text, &capture->out_size);
+  capture->err = open_memstream(&capture->err_text, &capture->err_size);
+
+  if(!capture->out || !capture->err) {
+    console_capture_end(capture);
+    console_capture_flush(capture);
+    return 0;
+  }
+
+  capture_out = capture->out;
+  capture_err = capture->err;
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  console_capture_end
+    Description:  Stops buffering; the captured text stays in 'capture' until flushed
+   =====================================================================================
+*/
+void console_capture_end(ConsoleCapture *capture) {
+  if(capture->out) {
+    fclose(capture->out);
+    capture->out = NULL;
+  }
+
+  if(capture->err) {
+    fclose(capture->err);
+    capture->err = NULL;
+  }
+
+  capture_out = NULL;
+  capture_err = NULL;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  console_capture_flush
+    Description:  Prints captured text to stdout/stderr and releases it
+   =====================================================================================
+*/
+void console_capture_flush(ConsoleCapture *capture) {
+  progress_pause();
+
+  if(capture->out_text) {
+    fputs(capture->out_text, stdout);
+    free(capture->out_text);
+    capture->out_text = NULL;
+  }
+
+  if(capture->err_text) {
+    fputs(capture->err_text, stderr);
+    free(capture->err_text);
+    capture->err_text = NULL;
+  }
+
+  progress_resume();
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  write_json_string
+    Description:  Writes 's' as a quoted JSON string
+   =====================================================================================
+*/
+void write_json_string(FILE *stream, const char *s) {
+  fputc('"', stream);
+
+  for(const unsigned char *p = (const unsigned char *)s; *p; p++) {
+    if(*p == '"' || *p == '\\') {
+      fprintf(stream, "\\%c", *p);
+    }
+
+    else if(*p < 0x20) {
+      fprintf(stream, "\\u%04x", *p);
+    }
+
+    else {
+      fputc(*p, stream);
+    }
+  }
+
+  fputc('"', stream);
+}
@@ -19,8 +19,28 @@
 #include <stdarg.h>
 #include <errno.h>
 
+/*
+  Console output of a worker thread, held back so the main thread can print it
+  in resource order and keep parallel runs deterministic
+*/
+typedef struct {
+  FILE *out;
+  FILE *err;
+  char *out_text;
+  char *err_text;
+  size_t out_size;
+  size_t err_size;
+} ConsoleCapture;
+
 void init_logging(const char *output_dir);
 void log_message(const char *format, ...);
+void console_printf(const char *format, ...);
+void console_error(const char *format, ...);
+void console_perror(const char *message);
+int console_capture_begin(ConsoleCapture *capture);
+void console_capture_end(ConsoleCapture *capture);
+void console_capture_flush(ConsoleCapture *capture);
+void write_json_string(FILE *stream, const char *s);
 
 /*
 
@@ -11,7 +11,79 @@
   all project dependencies into a centralised assets directory.
 
   Usage:
-  ./shotcut_project_collector '<input_mlt_file>' '<output_directory>'
+  ./shotcut_project_collector [options] '<input_mlt_file>' '<output_directory>'
+  ./shotcut_project_collector --output-format tar [options] '<input_mlt_file>' '<archive.tar>'|-
+  ./shotcut_project_collector --output-format zstd [options] '<input_mlt_file>' '<bundle.tar.zst>'|-
+  ./shotcut_project_collector extract '<bundle.tar.zst>' ['<member>' ['<output_file>']]
+  ./shotcut_project_collector --verify '<bundle>/<project>.mlt.checksums' [-j N]
+  ./shotcut_project_collector --benchmark-parser N '<input_mlt_file>'
+
+  Options:
+  --benchmark   Compare the copy engine with the old 4 KiB stdio loop (bytes/s)
+                on the project's resources instead of collecting them
+  --benchmark-parser N
+                Repeat the body of the project N times in memory and compare
+                the old line-based strstr() scan with the XML tokenizer (MB/s)
+  --plan        Print what the collection would do as JSON on stdout - every
+                source, destination, size and cousin, and every rewritten
+                project line - without creating or copying anything. Other
+                messages go to stderr.
+  --output-format dir|tar
+                Write the bundle as a directory (default) or stream it into a
+                POSIX tar archive with the same layout; the second argument is
+                then the archive, or "-" for stdout (messages go to stderr).
+                The archive is written sequentially, so --jobs, --chunk-streams,
+                --backend and --direct-io do not apply to it.
+  --output-format zstd
+                The tar archive compressed into a seekable zstd bundle by one
+                thread per CPU (or --jobs threads), with an index of its
+                members. Media in compressed formats are stored, not
+                compressed again. "extract" lists a bundle, or writes one member
+                (e.g. the .mlt) to a file or stdout, decompressing only its
+                frames.
+  --reflink=auto|always|never
+                Clone file extents with FICLONE on CoW filesystems (btrfs, XFS)
+                instead of copying data. "auto" (default) falls back to copying.
+  --link=hard|sym|copy
+                Hard-link or symlink assets into the bundle instead of copying
+                them. Files that cannot be linked (e.g. EXDEV) are copied.
+  -j, --jobs N  Copy up to N resources in parallel. Output stays in resource
+                order, so it is the same as a serial run.
+  --backend=sync|io_uring
+                Batch small files (stills, LUTs, stabiliser data) through
+                io_uring; falls back to sync when the kernel lacks support.
+  --chunk-streams N, --chunk-threshold SIZE
+                Split files of at least SIZE (default 1G) into 64 MiB ranges
+                copied by N threads at once into a preallocated destination.
+  --manifest-hash
+                Record an XXH64 hash of every asset in the manifest and only
+                skip an unchanged asset if its copy still has that hash.
+  --resume      Replay the journal of an interrupted collection into the same
+                output directory: finished assets are skipped and large files
+                continue from their last checkpoint instead of from zero.
+  --dedup       Hash the resources whose sizes collide and copy identical
+                content once; the project points every duplicate at that asset.
+  --checksum=xxh64|sha256|none
+                Hash each file while it is copied and write the checksums to
+                <project>.mlt.checksums next to the rewritten project.
+  --verify FILE Re-read a bundle and compare it with a .checksums FILE; runs
+                one thread per CPU unless --jobs is given. No other arguments.
+  --keep-cache  Leave copied data in the page cache. By default it is written
+                back and dropped behind each copy, so collecting does not evict
+                the working set of other programs.
+  --direct-io SIZE
+                Copy files of at least SIZE with O_DIRECT, bypassing the page
+                cache entirely (default: off).
+  --progress-fd N
+                Write progress as newline-delimited JSON events to file
+                descriptor N. A status line with throughput and ETA is shown
+                whenever stderr is a terminal.
+  --max-bandwidth MBPS
+                Limit all copies together to MBPS MB/s (1 MB = 1 MiB) with a
+                token bucket, so the collector does not starve playback.
+  --ioprio idle|be:N
+                Run with the idle or best-effort (level N, 0-7) I/O priority
+                class; honoured by the BFQ and mq-deadline schedulers.
 
   Functionality:
 
@@ -66,12 +138,184 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
 #include "parser.h"
 #include "file_utils.h"
 #include "logging.h"
+#include "copy_engine.h"
+#include "benchmark.h"
+#include "copy_pool.h"
+#include "manifest.h"
+#include "journal.h"
+#include "dedup.h"
+#include "checksums.h"
+#include "progress.h"
+#include "preflight.h"
+#include "plan.h"
+#include "tar_output.h"
+#include "zstd_bundle.h"
 
 const char *proj_root_dir_path;
 
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  print_usage
+    Description:  Prints the command line synopsis and options
+   =====================================================================================
+*/
+static void print_usage(FILE *stream, const char *program) {
+  fprintf(stream, "Usage: %s [options] '<input_mlt_file>' '<output_directory>'\n", program);
+  fprintf(stream, "       %s --output-format tar|zstd [options] '<input_mlt_file>' '<archive>'|-\n", program);
+  fprintf(stream, "       %s extract '<bundle.tar.zst>' ['<member>' ['<output_file>']]\n", program);
+  fprintf(stream, "       %s --verify '<bundle>/<project>.mlt.checksums' [-j N]\n", program);
+  fprintf(stream, "       %s --benchmark-parser N '<input_mlt_file>'\n", program);
+  fprintf(stream, "Options:\n");
+  fprintf(stream, "  --benchmark   Compare the copy engine with the old 4 KiB stdio loop (bytes/s)\n");
+  fprintf(stream, "                on the project's resources instead of collecting them\n");
+  fprintf(stream, "  --benchmark-parser N\n");
+  fprintf(stream, "                Time the project scanners on the project repeated N times\n");
+  fprintf(stream, "  --plan        Print the copy and rewrite plan as JSON without collecting\n");
+  fprintf(stream, "  --output-format dir|tar|zstd\n");
+  fprintf(stream, "                Write a directory, or a tar archive or seekable zstd bundle to\n");
+  fprintf(stream, "                a file or - for stdout (default: dir)\n");
+  fprintf(stream, "  --reflink=auto|always|never\n");
+  fprintf(stream, "                Clone file extents on CoW filesystems instead of copying data\n");
+  fprintf(stream, "                (default: auto, which falls back to copying)\n");
+  fprintf(stream, "  --link=hard|sym|copy\n");
+  fprintf(stream, "                Link assets into the bundle instead of copying them; files\n");
+  fprintf(stream, "                that cannot be linked are copied (default: copy)\n");
+  fprintf(stream, "  -j, --jobs N  Copy up to N resources in parallel (default: 1)\n");
+  fprintf(stream, "  --backend=sync|io_uring\n");
+  fprintf(stream, "                Copy small files in io_uring batches (default: sync)\n");
+  fprintf(stream, "  --chunk-streams N\n");
+  fprintf(stream, "                Copy each large file with N parallel streams (default: 1)\n");
+  fprintf(stream, "  --chunk-threshold SIZE\n");
+  fprintf(stream, "                Smallest file split into streams, e.g. 512M (default: 1G)\n");
+  fprintf(stream, "  --manifest-hash\n");
+  fprintf(stream, "                Also compare content hashes when skipping unchanged assets\n");
+  fprintf(stream, "  --resume      Continue the copies of an interrupted collection\n");
+  fprintf(stream, "  --dedup       Store files with identical content only once\n");
+  fprintf(stream, "  --checksum=xxh64|sha256|none\n");
+  fprintf(stream, "                Checksum every file while copying it (default: none)\n");
+  fprintf(stream, "  --verify FILE Check a bundle against its .checksums FILE (uses --jobs threads)\n");
+  fprintf(stream, "  --keep-cache  Keep copied data in the page cache instead of dropping it\n");
+  fprintf(stream, "  --direct-io SIZE\n");
+  fprintf(stream, "                Copy files of at least SIZE, e.g. 4G, with O_DIRECT (default: off)\n");
+  fprintf(stream, "  --progress-fd N\n");
+  fprintf(stream, "                Write progress events as JSON lines to file descriptor N\n");
+  fprintf(stream, "  --max-bandwidth MBPS\n");
+  fprintf(stream, "                Copy at most MBPS MB/s in total, e.g. 40 (default: unlimited)\n");
+  fprintf(stream, "  --ioprio idle|be:N\n");
+  fprintf(stream, "                I/O priority class, e.g. idle or be:7 (default: unchanged)\n");
+  fprintf(stream, "  --help        Show this help\n");
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  output_project_path
+    Description:  Returns the path of the rewritten project: the input project's
+                 name in 'output_dir', with a .mlt extension. The caller frees it;
+                 NULL if out of memory.
+   =====================================================================================
+*/
+static char *output_project_path(const char *input_file, const char *output_dir) {
+  // Project name should be the input project file's name
+  const char *input_filename = strrchr(input_file, '/');
+
+  if(!input_filename) {
+    input_filename = input_file;
+  }
+
+  else {
+    input_filename++;
+  }
+
+  // Ensure the output file has .mlt extension
+  char *output_project_file = concat_paths(output_dir, input_filename);
+
+  if(output_project_file) {
+    size_t len = strlen(output_project_file);
+
+    if(len < 4 || strcmp(output_project_file + len - 4, ".mlt") != 0) {
+      char *new_output = realloc(output_project_file, len + 5);
+
+      if(new_output) {
+        output_project_file = new_output;
+        strcat(output_project_file, ".mlt");
+      }
+    }
+  }
+
+  return output_project_file;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  collect_into_tar
+    Description:  Steps 3a to 7 for --output-format tar and zstd: checks the sources
+                 and the space beside 'archive_path', then streams the bundle into
+                 the archive, or into 'fd' when 'archive_path' is NULL. A zstd
+                 bundle is compressed by 'compress_threads' threads. No manifest or
+                 journal is kept; an archive is always written whole.
+                 Returns 1 on success, 0 on failure.
+   =====================================================================================
+*/
+static int collect_into_tar(const ParsedProject *project, const char *input_file, const char *archive_path, int fd,
+                            int compress_threads, int progress_fd) {
+  // The space is needed in the directory the archive is written to
+  char *archive_dir = archive_path ? strdup(archive_path) : NULL;
+  char *project_name = output_project_path(input_file, "");
+  PreflightPlan plan;
+
+  if(archive_dir) {
+    char *last_slash = strrchr(archive_dir, '/');
+
+    if(!last_slash) {
+      strcpy(archive_dir, ".");
+    }
+
+    else {
+      last_slash[last_slash == archive_dir ? 1 : 0] = '\0';
+    }
+  }
+
+  if(!project_name || (archive_path && !archive_dir)) {
+    perror("Failed to allocate memory for the tar archive");
+    free(archive_dir);
+    free(project_name);
+    return 0;
+  }
+
+  if(!run_preflight(project, proj_root_dir_path, archive_dir, &plan) ||
+     (copy_options.checksum != CHECKSUM_NONE && !checksums_begin(".", copy_options.checksum)) ||
+     !progress_begin(NULL, plan.files, plan.bytes, progress_fd)) {
+    free(archive_dir);
+    free(project_name);
+    return 0;
+  }
+
+  int written = tar_begin(archive_path, fd, compress_threads) &&
+                write_tar_bundle(project, input_file, proj_root_dir_path, project_name);
+  written = tar_end(written) && written;
+  progress_end(written);
+
+  if(!written) {
+    fprintf(stderr, "Error: Failed to write the %s.\n", compress_threads ? "zstd bundle" : "tar archive");
+  }
+
+  else {
+    printf("%s %s written successfully.\n", compress_threads ? "Bundle" : "Archive", archive_path ? archive_path : "on stdout");
+    print_copy_stats();
+  }
+
+  free(archive_dir);
+  free(project_name);
+  return written;
+}
+
 /*
    ===  FUNCTION  ======================================================================
            Name:  main
@@ -80,15 +324,291 @@ const char *proj_root_dir_path;
    =====================================================================================
 */
 int main(int argc, char *argv[]) {
+  int benchmark = 0;
+  size_t parser_scale = 0;
+  int plan_only = 0;
+  int jobs = 1;
+  int manifest_hash = 0;
+  int resume = 0;
+  int dedup = 0;
+  int jobs_given = 0;
+  const char *verify_file = NULL;
+  int progress_fd = -1;
+  int ioprio = -1;
+  static const struct option long_options[] = {
+    {"benchmark", no_argument, NULL, 'B'},
+    {"benchmark-parser", required_argument, NULL, 'X'},
+    {"plan", no_argument, NULL, 'N'},
+    {"output-format", required_argument, NULL, 'F'},
+    {"reflink", required_argument, NULL, 'R'},
+    {"link", required_argument, NULL, 'L'},
+    {"jobs", required_argument, NULL, 'j'},
+    {"backend", required_argument, NULL, 'b'},
+    {"chunk-streams", required_argument, NULL, 'S'},
+    {"chunk-threshold", required_argument, NULL, 'T'},
+    {"manifest-hash", no_argument, NULL, 'H'},
+    {"resume", no_argument, NULL, 'r'},
+    {"dedup", no_argument, NULL, 'D'},
+    {"checksum", required_argument, NULL, 'C'},
+    {"verify", required_argument, NULL, 'V'},
+    {"keep-cache", no_argument, NULL, 'K'},
+    {"direct-io", required_argument, NULL, 'O'},
+    {"progress-fd", required_argument, NULL, 'P'},
+    {"max-bandwidth", required_argument, NULL, 'W'},
+    {"ioprio", required_argument, NULL, 'I'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+  int opt;
+
+  // "extract" reads members out of a zstd bundle and takes no options
+  if(argc > 1 && strcmp(argv[1], "extract") == 0) {
+    if(argc < 3 || argc > 5) {
+      print_usage(stderr, argv[0]);
+      return EXIT_FAILURE;
+    }
+
+    return extract_from_bundle(argv[2], argc > 3 ? argv[3] : NULL, argc > 4 ? argv[4] : NULL) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  while((opt = getopt_long(argc, argv, "hj:", long_options, NULL)) != -1) {
+    switch(opt) {
+      case 'B':
+        benchmark = 1;
+        break;
+
+      case 'X': {
+          char *end = NULL;
+          unsigned long long value = strtoull(optarg, &end, 10);
+
+          if(!end || *end != '\0' || optarg[0] == '-' || value < 1 || value > SIZE_MAX) {
+            fprintf(stderr, "Error: Invalid --benchmark-parser: %s (expected a repeat count of 1 or more)\n", optarg);
+            return EXIT_FAILURE;
+          }
+
+          parser_scale = (size_t)value;
+          break;
+        }
+
+      case 'N':
+        plan_only = 1;
+        break;
+
+      case 'F':
+        if(!parse_output_format(optarg, &copy_options.output_format)) {
+          fprintf(stderr, "Error: Invalid --output-format: %s (expected dir, tar or zstd)\n", optarg);
+          return EXIT_FAILURE;
+        }
+
+        break;
+
+      case 'H':
+        manifest_hash = 1;
+        break;
+
+      case 'r':
+        resume = 1;
+        break;
+
+      case 'D':
+        dedup = 1;
+        break;
+
+      case 'C':
+        if(!parse_checksum_algorithm(optarg, &copy_options.checksum)) {
+          fprintf(stderr, "Error: Invalid --checksum: %s (expected xxh64, sha256 or none)\n", optarg);
+          return EXIT_FAILURE;
+        }
+
+        break;
+
+      case 'V':
+        verify_file = optarg;
+        break;
+
+      case 'K':
+        copy_options.drop_cache = 0;
+        break;
+
+      case 'P': {
+          char *end = NULL;
+          long value = strtol(optarg, &end, 10);
+
+          if(!end || *end != '\0' || value < 0 || value > INT_MAX) {
+            fprintf(stderr, "Error: Invalid --progress-fd: %s (expected a file descriptor number)\n", optarg);
+            return EXIT_FAILURE;
+          }
+
+          progress_fd = (int)value;
+          break;
+        }
+
+      case 'O':
+        if(!parse_byte_size(optarg, &copy_options.direct_io_threshold) || copy_options.direct_io_threshold == 0) {
+          fprintf(stderr, "Error: Invalid --direct-io: %s (expected a size such as 512M or 4G)\n", optarg);
+          return EXIT_FAILURE;
+        }
+
+        break;
+
+      case 'W':
+        if(!parse_bandwidth(optarg, &copy_options.max_bandwidth)) {
+          fprintf(stderr, "Error: Invalid --max-bandwidth: %s (expected MB/s such as 40 or 2.5)\n", optarg);
+          return EXIT_FAILURE;
+        }
+
+        break;
+
+      case 'I':
+        if(!parse_io_priority(optarg, &ioprio)) {
+          fprintf(stderr, "Error: Invalid --ioprio: %s (expected idle or be:0 to be:7)\n", optarg);
+          return EXIT_FAILURE;
+        }
+
+        break;
+
+      case 'R':
+        if(!parse_reflink_mode(optarg, &copy_options.reflink)) {
+          fprintf(stderr, "Error: Invalid --reflink mode: %s (expected auto, always or never)\n", optarg);
+          return EXIT_FAILURE;
+        }
+
+        break;
+
+      case 'L':
+        if(!parse_link_mode(optarg, &copy_options.link)) {
+          fprintf(stderr, "Error: Invalid --link mode: %s (expected hard, sym or copy)\n", optarg);
+          return EXIT_FAILURE;
+        }
+
+        break;
+
+      case 'b':
+        if(!parse_copy_backend(optarg, &copy_options.backend)) {
+          fprintf(stderr, "Error: Invalid --backend: %s (expected sync or io_uring)\n", optarg);
+          return EXIT_FAILURE;
+        }
+
+        break;
+
+      case 'S': {
+          char *end = NULL;
+          long value = strtol(optarg, &end, 10);
+
+          if(!end || *end != '\0' || value < 1 || value > MAX_CHUNK_STREAMS) {
+            fprintf(stderr, "Error: Invalid --chunk-streams value: %s (expected 1 to %d)\n", optarg, MAX_CHUNK_STREAMS);
+            return EXIT_FAILURE;
+          }
+
+          copy_options.chunk_streams = (int)value;
+          break;
+        }
+
+      case 'T':
+        if(!parse_byte_size(optarg, &copy_options.chunk_threshold)) {
+          fprintf(stderr, "Error: Invalid --chunk-threshold: %s (expected a size such as 512M or 2G)\n", optarg);
+          return EXIT_FAILURE;
+        }
+
+        break;
+
+      case 'j': {
+          char *end = NULL;
+          long value = strtol(optarg, &end, 10);
+
+          if(!end || *end != '\0' || value < 1 || value > MAX_COPY_JOBS) {
+            fprintf(stderr, "Error: Invalid --jobs value: %s (expected 1 to %d)\n", optarg, MAX_COPY_JOBS);
+            return EXIT_FAILURE;
+          }
+
+          jobs = (int)value;
+          jobs_given = 1;
+          break;
+        }
+
+      case 'h':
+        print_usage(stdout, argv[0]);
+        return EXIT_SUCCESS;
+
+      default:
+        print_usage(stderr, argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  // Set before any thread starts so every copy and verify thread inherits it
+  if(ioprio >= 0 && !set_io_priority(ioprio)) {
+    perror("Failed to set --ioprio");
+    return EXIT_FAILURE;
+  }
+
+  // Verification re-reads an existing bundle; nothing is collected
+  if(verify_file) {
+    if(!jobs_given) {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      jobs = cpus < 1 ? 1 : (cpus > MAX_VERIFY_JOBS ? MAX_VERIFY_JOBS : (int)cpus);
+    }
+
+    return verify_bundle(verify_file, jobs) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  // The parser benchmark only reads the project; nothing is collected
+  if(parser_scale) {
+    if(argc - optind != 1) {
+      print_usage(stderr, argv[0]);
+      return EXIT_FAILURE;
+    }
+
+    return run_parser_benchmark(argv[optind], parser_scale) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
   // Check for correct number of arguments
-  if(argc != 3) {
-    fprintf(stderr, "Usage: %s '<input_mlt_file>' '<output_directory>'\n", argv[0]);
+  if(argc - optind != 2) {
+    print_usage(stderr, argv[0]);
     return EXIT_FAILURE;
   }
 
+  // An archive holds copies, written whole; links, resumes and plans need a directory
+  int tar_output = copy_options.output_format != OUTPUT_DIRECTORY;
+
+  if(tar_output && (resume || plan_only || copy_options.link != LINK_COPY)) {
+    fprintf(stderr, "Error: --output-format %s cannot be combined with --resume, --plan or --link.\n",
+            copy_options.output_format == OUTPUT_ZSTD ? "zstd" : "tar");
+    return EXIT_FAILURE;
+  }
+
+  // An archive on stdout, like the plan, keeps stdout to itself; everything else printed goes to stderr
+  int tar_fd = -1;
+
+  if(tar_output && strcmp(argv[optind + 1], "-") == 0) {
+    if(isatty(STDOUT_FILENO)) {
+      fprintf(stderr, "Error: Refusing to write an archive to a terminal.\n");
+      return EXIT_FAILURE;
+    }
+
+    tar_fd = dup(STDOUT_FILENO);
+
+    if(tar_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+      perror("Failed to set up archive output on stdout");
+      return EXIT_FAILURE;
+    }
+  }
+
+  FILE *plan_stream = NULL;
+
+  if(plan_only) {
+    int fd = dup(STDOUT_FILENO);
+    plan_stream = fd < 0 ? NULL : fdopen(fd, "w");
+
+    if(!plan_stream || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+      perror("Failed to set up --plan output");
+      return EXIT_FAILURE;
+    }
+  }
+
   // Create writable copies of the input arguments
-  const char *input_file_raw = argv[1];
-  const char *output_dir_raw = argv[2];
+  const char *input_file_raw = argv[optind];
+  const char *output_dir_raw = argv[optind + 1];
   size_t input_len = strlen(input_file_raw);
   size_t output_len = strlen(output_dir_raw);
   // Create writable copies of the input arguments
@@ -151,9 +671,10 @@ int main(int argc, char *argv[]) {
   /* Debugging statements */
   /*printf("DEBUG: Input directory: %s\n", input_dir);*/
   /*printf("DEBUG: Output directory: %s\n", output_dir);*/
-  // Step 1: Check if input directory matches output directory
-  if(strcmp(input_dir, output_dir) == 0) {
-    fprintf(stderr, "Error: Input file's directory and output directory cannot be the same.\n");
+  // Step 1: Check if input directory matches output directory (an archive may sit beside the project)
+  if(tar_output ? strcmp(input_file, output_dir) == 0 : strcmp(input_dir, output_dir) == 0) {
+    fprintf(stderr, tar_output ? "Error: The archive cannot replace the input project file.\n" :
+            "Error: Input file's directory and output directory cannot be the same.\n");
     free(input_dir);
     free(input_file);
     free(output_dir);
@@ -161,26 +682,93 @@ int main(int argc, char *argv[]) {
   }
 
   free(input_dir); // Free the extracted input directory after the check
-  // Step 2: Parse the project file to extract resources
-  char **resources = NULL;
-  size_t resource_count = 0;
+  // Step 2: Read the project once and list every path in it
+  ParsedProject project;
 
-  if(!parse_project_file(input_file, &resources, &resource_count)) {
+  if(!parse_project(input_file, &project)) {
     fprintf(stderr, "Error: Failed to parse the project file.\n");
-    free_strings_array(resources, resource_count);
+    free_parsed_project(&project);
     free(input_file);
     free(output_dir);
     return EXIT_FAILURE;
   }
 
   // Step 3: Build file mappings for cousin detection
-  build_file_mappings(resources, resource_count, proj_root_dir_path);
+  build_file_mappings(project.resources, project.resource_count, proj_root_dir_path);
+
+  if(dedup) {
+    dedup_file_mappings(proj_root_dir_path);
+  }
+
+  // Benchmark mode only measures copy throughput; nothing is collected
+  if(benchmark) {
+    int ok = run_copy_benchmark(project.resources, project.resource_count, proj_root_dir_path, output_dir);
+    free_parsed_project(&project);
+    free(input_file);
+    free(output_dir);
+    free_file_mappings();
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  // Step 3b: Work out the path every resource, LUT, stabiliser and alpha-transition file gets in the bundle
+  if(!plan_project_rewrites(&project)) {
+    free_parsed_project(&project);
+    free(input_file);
+    free(output_dir);
+    free_file_mappings();
+    return EXIT_FAILURE;
+  }
+
+  // Plan mode only reports what Steps 4 to 7 would do
+  if(plan_stream) {
+    char *output_project_file = output_project_path(input_file, output_dir);
+    int ok = output_project_file &&
+             write_plan(plan_stream, &project, input_file, output_project_file, output_dir, proj_root_dir_path);
+    ok = fclose(plan_stream) == 0 && ok;
+    free(output_project_file);
+    free_parsed_project(&project);
+    free(input_file);
+    free(output_dir);
+    free_file_mappings();
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  // Tar and zstd output stream Steps 6 and 7 into one archive instead of a directory tree
+  if(tar_output) {
+    // A zstd bundle is compressed on one thread per CPU unless --jobs is given
+    int compress_threads = 0;
+
+    if(copy_options.output_format == OUTPUT_ZSTD) {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      compress_threads = jobs_given ? jobs : (cpus < 1 ? 1 : (cpus > BUNDLE_MAX_THREADS ? BUNDLE_MAX_THREADS : (int)cpus));
+    }
+
+    int ok = collect_into_tar(&project, input_file, tar_fd < 0 ? output_dir : NULL, tar_fd,
+                              compress_threads, progress_fd);
+    free_parsed_project(&project);
+    free(input_file);
+    free(output_dir);
+    free_file_mappings();
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  // Step 3a: Check that every source is there and the bundle fits before writing anything
+  PreflightPlan plan;
+
+  if(!run_preflight(&project, proj_root_dir_path, output_dir, &plan)) {
+    free_parsed_project(&project);
+    free(input_file);
+    free(output_dir);
+    free_file_mappings();
+    return EXIT_FAILURE;
+  }
+
   // Step 4: Create the assets directory
   char *assets_dir = concat_paths(output_dir, "assets");
 
   if(!create_directory(assets_dir)) {
     fprintf(stderr, "Error: Failed to create assets directory.\n");
-    free_strings_array(resources, resource_count);
+    free_parsed_project(&project);
     free(assets_dir);
     free(input_file);
     free(output_dir);
@@ -192,7 +780,7 @@ int main(int argc, char *argv[]) {
 
   if(!create_directory(lut3d_presets_dir)) {
     fprintf(stderr, "Error: Failed to create lut3d_presets directory.\n");
-    free_strings_array(resources, resource_count);
+    free_parsed_project(&project);
     free(assets_dir);
     free(lut3d_presets_dir);
     return EXIT_FAILURE;
@@ -202,7 +790,7 @@ int main(int argc, char *argv[]) {
 
   if(!create_directory(stabilization_presets_dir)) {
     fprintf(stderr, "Error: Failed to create stabilization_data directory.\n");
-    free_strings_array(resources, resource_count);
+    free_parsed_project(&project);
     free(assets_dir);
     free(lut3d_presets_dir);
     free(stabilization_presets_dir);
@@ -213,7 +801,7 @@ int main(int argc, char *argv[]) {
 
   if(!create_directory(alpha_transition_dir)) {
     fprintf(stderr, "Error: Failed to create alpha_transition directory.\n");
-    free_strings_array(resources, resource_count);
+    free_parsed_project(&project);
     free(assets_dir);
     free(lut3d_presets_dir);
     free(stabilization_presets_dir);
@@ -221,68 +809,39 @@ int main(int argc, char *argv[]) {
     return EXIT_FAILURE;
   }
 
-  // Step 6: Copy assets to the output directory
-  for(size_t i = 0; i < resource_count; ++i) {
-    const char *destination = get_destination_path(resources[i], assets_dir);
-
-    if(!destination) {
-      continue; // Skip invalid paths
-    }
-
-    // Create the directory if it doesn't exist
-    char *dest_dir = strdup(destination);
-
-    if(!dest_dir) {
-      perror("Failed to allocate memory for destination directory");
-      continue;
-    }
-
-    last_slash = strrchr(dest_dir, '/');
-
-    if(last_slash) {
-      *last_slash = '\0'; // Null-terminate before the filename
-
-      if(!create_directory(dest_dir)) {
-        fprintf(stderr, "Error: Failed to create destination directory: %s\n", dest_dir);
-      }
-    }
-
-    free(dest_dir);
-    // Copy the file
-    copy_file_to_directory_with_context(resources[i], assets_dir, proj_root_dir_path, input_file);
-  }
-
-  // Step 7: Copy and modify the project file
-  // Project name should be the input project file's name
-  const char *input_filename = strrchr(input_file, '/');
-
-  if(!input_filename) {
-    input_filename = input_file;
-  }
-
-  else {
-    input_filename++;
+  // Assets recorded by an earlier collection into this directory are only copied again if they changed
+  if(!manifest_load(output_dir, manifest_hash) || !journal_open(output_dir, resume) ||
+     (copy_options.checksum != CHECKSUM_NONE && !checksums_begin(output_dir, copy_options.checksum)) ||
+     !progress_begin(output_dir, plan.files, plan.bytes, progress_fd)) {
+    free_parsed_project(&project);
+    free(assets_dir);
+    free(lut3d_presets_dir);
+    free(stabilization_presets_dir);
+    free(alpha_transition_dir);
+    return EXIT_FAILURE;
   }
 
-  // Ensure the output file has .mlt extension
-  char *output_project_file = concat_paths(output_dir, input_filename);
-
-  if(output_project_file) {
-    size_t len = strlen(output_project_file);
-
-    if(len < 4 || strcmp(output_project_file + len - 4, ".mlt") != 0) {
-      char *new_output = realloc(output_project_file, len + 5);
+  // Step 6: Copy the resources and the LUT, stabiliser and alpha-transition files to the output directory
+  run_copy_jobs(&project, assets_dir, proj_root_dir_path, input_file, jobs);
+  // Step 7: Write the project file from its planned rewrites, unless it would point at assets that are not there
+  char *output_project_file = output_project_path(input_file, output_dir);
+  int copied_all = copy_stats.failed_files == 0;
+  int project_written = copied_all && copy_and_modify_project_file(&project, output_project_file);
+  progress_end(project_written);
+  // Record what was collected even if the project file failed, so a re-run skips those assets
+  journal_close(manifest_save());
+  manifest_free();
+
+  if(!project_written) {
+    if(!copied_all) {
+      fprintf(stderr, "Error: Failed to collect %llu file(s); the project file is not written.\n", copy_stats.failed_files);
+    }
 
-      if(new_output) {
-        output_project_file = new_output;
-        strcat(output_project_file, ".mlt");
-      }
+    else {
+      fprintf(stderr, "Error: Failed to copy and modify the project file.\n");
     }
-  }
 
-  if(!copy_and_modify_project_file(input_file, output_project_file, assets_dir, proj_root_dir_path)) {
-    fprintf(stderr, "Error: Failed to copy and modify the project file.\n");
-    free_strings_array(resources, resource_count);
+    free_parsed_project(&project);
     free(assets_dir);
     free(output_project_file);
     free(input_file);
@@ -295,11 +854,12 @@ int main(int argc, char *argv[]) {
   }
 
   // Clean up
-  free_strings_array(resources, resource_count);
+  free_parsed_project(&project);
   free(assets_dir);
   free(output_project_file);
   free(input_file);
   free(output_dir);
+  print_copy_stats();
   printf("Assets collected successfully.\n");
   free_file_mappings();
   return EXIT_SUCCESS;
@@ -0,0 +1,550 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include "manifest.h"
+#include "hash.h"
+#include "copy_engine.h"
+#include "file_utils.h"
+#include "journal.h"
+#include "progress.h"
+#include "checksums.h"
+#include "logging.h"
+
+#define  MANIFEST_HEADER  "# shotcut_project_collector manifest v1"
+
+/*
+   What happened to a manifest entry during this run. Only KEPT and WRITTEN
+   entries are saved, so assets the project no longer uses drop out.
+*/
+typedef enum {
+  ENTRY_LOADED = 0,
+  ENTRY_KEPT,
+  ENTRY_WRITTEN
+} EntryState;
+
+/*
+   One collected asset: the source metadata it was collected from, keyed by
+   the destination path relative to the output directory
+*/
+typedef struct {
+  char *key;
+  unsigned long long size;
+  long long mtime_sec;
+  long mtime_nsec;
+  unsigned long long inode;
+  uint64_t hash;
+  int has_hash;
+  EntryState state;
+} ManifestEntry;
+
+typedef struct {
+  char *output_dir;
+  size_t output_dir_len;
+  int use_hash;
+  ManifestEntry *entries;
+  size_t count;
+  size_t capacity;
+  size_t *slots;       // Open-addressing index: entry index + 1, 0 when free
+  size_t slot_count;
+  pthread_mutex_t lock;
+} Manifest;
+
+static Manifest manifest = { NULL, 0, 0, NULL, 0, 0, NULL, 0, PTHREAD_MUTEX_INITIALIZER };
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  key_hash
+    Description:  FNV-1a hash of a manifest key for the lookup table
+   =====================================================================================
+*/
+static size_t key_hash(const char *key) {
+  uint64_t h = 14695981039346656037ULL;
+
+  for(; *key; key++) {
+    h ^= (unsigned char)*key;
+    h *= 1099511628211ULL;
+  }
+
+  return (size_t)h;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  relative_key
+    Description:  Returns 'destination' relative to the output directory, or the
+                 path itself if it lies elsewhere
+   =====================================================================================
+*/
+static const char *relative_key(const char *destination) {
+  if(strncmp(destination, manifest.output_dir, manifest.output_dir_len) == 0 &&
+     destination[manifest.output_dir_len] == '/') {
+    return destination + manifest.output_dir_len + 1;
+  }
+
+  return destination;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  find_slot
+    Description:  Returns the lookup slot holding 'key', or the free slot where it
+                 would go. Caller holds the lock.
+   =====================================================================================
+*/
+static size_t find_slot(const char *key) {
+  size_t mask = manifest.slot_count - 1;
+  size_t slot = key_hash(key) & mask;
+
+  while(manifest.slots[slot] != 0 && strcmp(manifest.entries[manifest.slots[slot] - 1].key, key) != 0) {
+    slot = (slot + 1) & mask;
+  }
+
+  return slot;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  find_entry
+    Description:  Looks up an entry by key. Caller holds the lock.
+                 Returns NULL when the asset is not in the manifest.
+   =====================================================================================
+*/
+static ManifestEntry *find_entry(const char *key) {
+  if(manifest.slot_count == 0) {
+    return NULL;
+  }
+
+  size_t slot = find_slot(key);
+  return manifest.slots[slot] ? &manifest.entries[manifest.slots[slot] - 1] : NULL;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  add_entry
+    Description:  Appends an entry for 'key' and indexes it, growing the entry array
+                 and the lookup table as needed. Caller holds the lock.
+                 Returns the new entry, or NULL when out of memory.
+   =====================================================================================
+*/
+static ManifestEntry *add_entry(const char *key) {
+  if(manifest.count == manifest.capacity) {
+    size_t capacity = manifest.capacity ? manifest.capacity * 2 : 64;
+    ManifestEntry *entries = realloc(manifest.entries, capacity * sizeof(ManifestEntry));
+
+    if(!entries) {
+      return NULL;
+    }
+
+    manifest.entries = entries;
+    manifest.capacity = capacity;
+  }
+
+  // Keep the table at most half full so probe chains stay short
+  if((manifest.count + 1) * 2 > manifest.slot_count) {
+    size_t slot_count = manifest.slot_count ? manifest.slot_count * 2 : 128;
+    size_t *slots = calloc(slot_count, sizeof(size_t));
+
+    if(!slots) {
+      return NULL;
+    }
+
+    free(manifest.slots);
+    manifest.slots = slots;
+    manifest.slot_count = slot_count;
+
+    for(size_t i = 0; i < manifest.count; i++) {
+      manifest.slots[find_slot(manifest.entries[i].key)] = i + 1;
+    }
+  }
+
+  ManifestEntry *entry = &manifest.entries[manifest.count];
+  memset(entry, 0, sizeof(*entry));
+  entry->key = strdup(key);
+
+  if(!entry->key) {
+    return NULL;
+  }
+
+  manifest.slots[find_slot(key)] = ++manifest.count;
+  return entry;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  load_entry_line
+    Description:  Parses one manifest line (size, mtime seconds and nanoseconds,
+                 inode, hash or "-", key; tab-separated) into the table. A later
+                 line for the same key replaces the earlier one. Caller holds the
+                 lock or is the only thread. Returns 1 on success, 0 for a
+                 malformed line (logged and ignored) and -1 when out of memory.
+   =====================================================================================
+*/
+static int load_entry_line(const char *line) {
+  unsigned long long size;
+  unsigned long long inode;
+  long long mtime_sec;
+  long mtime_nsec;
+  char hash[17];
+  int key_offset = 0;
+
+  if(sscanf(line, "%llu\t%lld\t%ld\t%llu\t%16s\t%n", &size, &mtime_sec, &mtime_nsec, &inode, hash, &key_offset) != 5 ||
+     key_offset == 0 || line[key_offset] == '\0') {
+    log_message("Ignoring malformed manifest line: %s\n", line);
+    return 0;
+  }
+
+  ManifestEntry *entry = find_entry(line + key_offset);
+
+  if(!entry && !(entry = add_entry(line + key_offset))) {
+    return -1;
+  }
+
+  entry->size = size;
+  entry->mtime_sec = mtime_sec;
+  entry->mtime_nsec = mtime_nsec;
+  entry->inode = inode;
+  entry->has_hash = strcmp(hash, "-") != 0;
+  entry->hash = entry->has_hash ? strtoull(hash, NULL, 16) : 0;
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  format_entry_line
+    Description:  Formats an entry the way load_entry_line() reads it, without the
+                 trailing newline
+   =====================================================================================
+*/
+static void format_entry_line(const ManifestEntry *entry, char *line, size_t size) {
+  char hash[17] = "-";
+
+  if(entry->has_hash) {
+    snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)entry->hash);
+  }
+
+  snprintf(line, size, "%llu\t%lld\t%ld\t%llu\t%s\t%s", entry->size, entry->mtime_sec, entry->mtime_nsec, entry->inode, hash, entry->key);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  manifest_load
+    Description:  Reads the manifest of a previous collection into 'output_dir'.
+                 A missing manifest is not an error: every asset is then copied.
+                 With 'use_hash' a content hash is recorded for new copies and
+                 unchanged assets are only kept if their hash still matches.
+                 Returns 1 on success, 0 when out of memory.
+   =====================================================================================
+*/
+int manifest_load(const char *output_dir, int use_hash) {
+  manifest.output_dir = strdup(output_dir);
+
+  if(!manifest.output_dir) {
+    perror("Failed to allocate memory for manifest");
+    return 0;
+  }
+
+  manifest.output_dir_len = strlen(output_dir);
+  manifest.use_hash = use_hash;
+  char *path = concat_paths(output_dir, MANIFEST_FILE);
+
+  if(!path) {
+    perror("Failed to allocate memory for manifest path");
+    return 0;
+  }
+
+  FILE *file = fopen(path, "r");
+  free(path);
+
+  if(!file) {
+    return 1; // First collection into this directory
+  }
+
+  char line[BUFFER * 3];
+
+  while(fgets(line, sizeof(line), file)) {
+    size_t len = strlen(line);
+
+    if(len == 0 || line[len - 1] != '\n' || line[0] == '#') {
+      continue; // Comment, or a line too long to be ours
+    }
+
+    line[len - 1] = '\0';
+
+    if(load_entry_line(line) < 0) {
+      perror("Failed to allocate memory for manifest entry");
+      fclose(file);
+      return 0;
+    }
+  }
+
+  fclose(file);
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  manifest_add_line
+    Description:  Adds an entry in manifest line format, e.g. an asset the journal
+                 shows was finished by an interrupted run (see journal.c).
+                 Returns 1 on success, 0 for a malformed line or no memory.
+   =====================================================================================
+*/
+int manifest_add_line(const char *line) {
+  if(!manifest.output_dir) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&manifest.lock);
+  int status = load_entry_line(line);
+  pthread_mutex_unlock(&manifest.lock);
+  return status > 0;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  manifest_is_current
+    Description:  Replaces the old "destination exists" check. An asset is current
+                 when it was already collected during this run, or when the manifest
+                 entry matches the source's size, mtime and inode and the destination
+                 still has that size (and hash with --manifest-hash). Skipped bytes
+                 are counted in copy_stats. A stale destination is removed, so a
+                 copy that then fails does not leave an outdated asset in the bundle.
+                 Without a loaded manifest it only checks that the destination exists.
+                 Returns 1 if the copy can be skipped, 0 if it must be made.
+   =====================================================================================
+*/
+int manifest_is_current(const char *source, const char *destination) {
+  if(!manifest.output_dir) {
+    return access(destination, F_OK) == 0;
+  }
+
+  const char *key = relative_key(destination);
+  struct stat src;
+  struct stat dst;
+  pthread_mutex_lock(&manifest.lock);
+  ManifestEntry *entry = find_entry(key);
+
+  if(entry && entry->state != ENTRY_LOADED) {
+    pthread_mutex_unlock(&manifest.lock);
+    return 1; // Another resource already put this file in place
+  }
+
+  ManifestEntry recorded;
+  int known = entry != NULL;
+
+  if(known) {
+    recorded = *entry; // The array may move once the lock is dropped
+  }
+
+  pthread_mutex_unlock(&manifest.lock);
+  int current = known && stat(source, &src) == 0 && stat(destination, &dst) == 0 && S_ISREG(dst.st_mode) &&
+                (unsigned long long)src.st_size == recorded.size &&
+                (unsigned long long)dst.st_size == recorded.size &&
+                (long long)src.st_mtim.tv_sec == recorded.mtime_sec &&
+                src.st_mtim.tv_nsec == recorded.mtime_nsec &&
+                (unsigned long long)src.st_ino == recorded.inode;
+
+  uint64_t hash = 0;
+  int hashed = 0;
+
+  if(current && manifest.use_hash) {
+    hashed = hash_file_xxh64(destination, &hash);
+    current = hashed && (!recorded.has_hash || hash == recorded.hash);
+  }
+
+  if(!current) {
+    struct stat existing;
+
+    // An interrupted copy that --resume can continue is under the temporary name, not here
+    if(lstat(destination, &existing) == 0) {
+      log_message("Stale copy, collecting again: %s\n", destination);
+      unlink(destination);
+    }
+
+    return 0;
+  }
+
+  pthread_mutex_lock(&manifest.lock);
+  entry = find_entry(key);
+  int first = entry && entry->state == ENTRY_LOADED;
+
+  if(first) {
+    entry->state = ENTRY_KEPT;
+
+    // Manifests written without --manifest-hash gain the hash on the first hashed run
+    if(hashed && !entry->has_hash) {
+      entry->hash = hash;
+      entry->has_hash = 1;
+    }
+  }
+
+  pthread_mutex_unlock(&manifest.lock);
+
+  if(first) {
+    record_skip(recorded.size);
+    progress_file_done(destination, recorded.size, 0, "unchanged");
+    log_message("Unchanged, skipped: %s\n", destination);
+
+    // The bundle's checksum file lists every asset, so unchanged ones are read once
+    if(hashed && copy_options.checksum == CHECKSUM_XXH64) {
+      char hex[CHECKSUM_HEX_MAX];
+      snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hash);
+      checksums_record(destination, hex);
+    }
+
+    else if(copy_options.checksum != CHECKSUM_NONE) {
+      checksums_record_file(destination);
+    }
+  }
+
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  manifest_record
+    Description:  Records the source metadata (and hash of the copy with
+                 --manifest-hash) of an asset that was just put into the bundle
+   =====================================================================================
+*/
+void manifest_record(const char *source, const char *destination) {
+  if(!manifest.output_dir) {
+    return;
+  }
+
+  struct stat src;
+
+  if(stat(source, &src) != 0) {
+    return;
+  }
+
+  uint64_t hash = 0;
+  int has_hash = manifest.use_hash && hash_file_xxh64(destination, &hash);
+  const char *key = relative_key(destination);
+  pthread_mutex_lock(&manifest.lock);
+  ManifestEntry *entry = find_entry(key);
+
+  if(!entry) {
+    entry = add_entry(key);
+  }
+
+  char line[BUFFER * 3] = "";
+
+  if(entry) {
+    entry->size = (unsigned long long)src.st_size;
+    entry->mtime_sec = (long long)src.st_mtim.tv_sec;
+    entry->mtime_nsec = src.st_mtim.tv_nsec;
+    entry->inode = (unsigned long long)src.st_ino;
+    entry->hash = hash;
+    entry->has_hash = has_hash;
+    entry->state = ENTRY_WRITTEN;
+    format_entry_line(entry, line, sizeof(line));
+  }
+
+  pthread_mutex_unlock(&manifest.lock);
+
+  // Lets --resume skip this asset if the run is interrupted before the manifest is saved
+  if(line[0]) {
+    journal_done(line);
+  }
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  manifest_save
+    Description:  Writes the entries used by this run to a temporary file and
+                 renames it over the manifest, so an interrupted save leaves the
+                 previous manifest intact. Returns 1 on success, 0 on failure.
+   =====================================================================================
+*/
+int manifest_save(void) {
+  if(!manifest.output_dir) {
+    return 1;
+  }
+
+  char *path = concat_paths(manifest.output_dir, MANIFEST_FILE);
+  char *temp_path = concat_paths(manifest.output_dir, MANIFEST_FILE ".tmp");
+
+  if(!path || !temp_path) {
+    perror("Failed to allocate memory for manifest path");
+    free(path);
+    free(temp_path);
+    return 0;
+  }
+
+  FILE *file = fopen(temp_path, "w");
+
+  if(!file) {
+    perror("Failed to write manifest");
+    free(path);
+    free(temp_path);
+    return 0;
+  }
+
+  fprintf(file, "%s\n", MANIFEST_HEADER);
+
+  for(size_t i = 0; i < manifest.count; i++) {
+    ManifestEntry *entry = &manifest.entries[i];
+
+    if(entry->state == ENTRY_LOADED || strchr(entry->key, '\n')) {
+      continue;
+    }
+
+    char line[BUFFER * 3];
+    format_entry_line(entry, line, sizeof(line));
+    fprintf(file, "%s\n", line);
+  }
+
+  int ok = fclose(file) == 0;
+
+  if(ok && rename(temp_path, path) != 0) {
+    ok = 0;
+  }
+
+  if(!ok) {
+    perror("Failed to write manifest");
+    unlink(temp_path);
+  }
+
+  free(path);
+  free(temp_path);
+  return ok;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  manifest_entry_count
+    Description:  Returns how many assets the manifest knows, 0 on a first collection
+   =====================================================================================
+*/
+size_t manifest_entry_count(void) {
+  pthread_mutex_lock(&manifest.lock);
+  size_t count = manifest.count;
+  pthread_mutex_unlock(&manifest.lock);
+  return count;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  manifest_free
+    Description:  Frees the in-memory manifest
+   =====================================================================================
+*/
+void manifest_free(void) {
+  for(size_t i = 0; i < manifest.count; i++) {
+    free(manifest.entries[i].key);
+  }
+
+  free(manifest.entries);
+  free(manifest.slots);
+  free(manifest.output_dir);
+  manifest.entries = NULL;
+  manifest.slots = NULL;
+  manifest.output_dir = NULL;
+  manifest.count = manifest.capacity = manifest.slot_count = 0;
+}
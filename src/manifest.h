@@ -0,0 +1,18 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+// Name of the manifest inside the output directory
+#define  MANIFEST_FILE  ".collector_manifest"
+
+int manifest_load(const char *output_dir, int use_hash);
+int manifest_add_line(const char *line);
+int manifest_is_current(const char *source, const char *destination);
+void manifest_record(const char *source, const char *destination);
+int manifest_save(void);
+size_t manifest_entry_count(void);
+void manifest_free(void);
+
+#endif // MANIFEST_H
@@ -1,17 +1,18 @@
 // Last Change: 2025-04-02  Wednesday: 12:27:42 PM
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "parser.h"
 #include "logging.h"
-
-#define MAX_LINE_LENGTH 4096
+#include "xml_scan.h"
 
 // Snippet generated by Grok 3
 // ----------------- Grok 3 snippet
-char **remove_duplicates_and_sort(char **lines, size_t *count);
-
 #ifdef  _WIN32
   static ssize_t getline(char **lineptr, size_t *n, FILE *stream);
   char *strdup(const char *s);
@@ -105,180 +106,380 @@ char *strndup(const char *s, size_t n) {
 }
 #endif
 
-// Comparison function for qsort
-static int compare_strings(const void *a, const void *b) {
-  return strcmp(*(const char **)a, *(const char **)b);
+// ----------------- Grok 3 snippet
+
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  map_project_file
+    Description:  Makes the whole project file available at 'project->data'. A
+                 regular file is mapped read-only, so its pages come straight from
+                 the page cache; anything else, such as a pipe, is read into an
+                 allocated buffer until it ends. Release it with
+                 unmap_project_file(). Returns 1 on success, 0 on failure.
+   =====================================================================================
+*/
+int map_project_file(const char *filename, ProjectFile *project) {
+  project->data = NULL;
+  project->size = 0;
+  project->mapped = 0;
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+
+  if(fd < 0) {
+    perror("Failed to open project file");
+    return 0;
+  }
+
+  struct stat st;
+
+  if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if(data != MAP_FAILED) {
+      // The scan reads it once from start to end
+      madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+      close(fd);
+      project->data = data;
+      project->size = (size_t)st.st_size;
+      project->mapped = 1;
+      return 1;
+    }
+  }
+
+  size_t capacity = 64 * 1024;
+  size_t length = 0;
+  char *data = malloc(capacity);
+
+  while(data) {
+    if(length == capacity) {
+      char *grown = realloc(data, capacity * 2);
+
+      if(!grown) {
+        free(data);
+        data = NULL;
+        break;
+      }
+
+      data = grown;
+      capacity *= 2;
+    }
+
+    ssize_t got = read(fd, data + length, capacity - length);
+
+    if(got == 0) {
+      break;
+    }
+
+    if(got < 0 && errno != EINTR) {
+      perror("Failed to read project file");
+      free(data);
+      close(fd);
+      return 0;
+    }
+
+    length += got > 0 ? (size_t)got : 0;
+  }
+
+  close(fd);
+
+  if(!data) {
+    perror("Failed to allocate memory for the project file");
+    return 0;
+  }
+
+  project->data = data;
+  project->size = length;
+  return 1;
 }
 
-// Function to remove duplicates and sort the array
-char **remove_duplicates_and_sort(char **lines, size_t *count) {
-  if(lines == NULL || count == NULL) {
-    fprintf(stderr, "Error: Null pointer\n");
-    exit(EXIT_FAILURE);
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  unmap_project_file
+    Description:  Releases a project file made available by map_project_file()
+   =====================================================================================
+*/
+void unmap_project_file(ProjectFile *project) {
+  if(project->mapped) {
+    munmap((void *)project->data, project->size);
   }
 
-  if(*count == 0) {
-    return NULL;
+  else {
+    free((void *)project->data);
   }
 
-  // Sort the array first (makes duplicate removal easier)
-  qsort(lines, *count, sizeof(char *), compare_strings);
-  // Create a new array to hold unique strings
-  char **unique_lines = malloc(*count * sizeof(char *));
+  project->data = NULL;
+  project->size = 0;
+  project->mapped = 0;
+}
+
+// A path in the project file, not NUL-terminated
+typedef struct {
+  const char *path;
+  size_t length;
+} PathView;
+
+// The state of parse_project() while it scans the project
+typedef struct {
+  ParsedProject *project;
+  PathView *views;  // Resources of chains, producers and transitions, as views into the project
+  size_t view_count;
+  size_t view_capacity;
+} ProjectParse;
 
-  if(unique_lines == NULL) {
-    fprintf(stderr, "Memory allocation failed\n");
-    exit(EXIT_FAILURE);
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  add_extra_file
+    Description:  Adds the LUT, stabiliser or alpha-transition file named by the
+                 'length' bytes at 'path' to the project's extras unless it is
+                 there already. A file bound for the destination of an earlier
+                 one is left out, as the first one was always the one copied.
+                 Returns 1 on success, 0 if out of memory.
+   =====================================================================================
+*/
+static int add_extra_file(ParsedProject *project, const char *path, size_t length, AssetKind kind) {
+  // Longer paths are reported and kept as they are by plan_project_rewrites()
+  if(length >= 4096) {
+    return 1;
   }
 
-  // Copy the first string (it's always unique after sorting)
-  unique_lines[0] = lines[0];
-  size_t new_count = 1;
+  const char *filename = memrchr(path, '/', length);
+  filename = filename ? filename + 1 : path;
+  size_t filename_length = path + length - filename;
 
-  // Process the rest of the strings
-  for(size_t i = 1; i < *count; ++i) {
-    if(strcmp(lines[i], unique_lines[new_count - 1]) != 0) {
-      // If not a duplicate, add to unique_lines
-      unique_lines[new_count] = lines[i];
-      new_count++;
+  for(size_t i = 0; i < project->extra_count; i++) {
+    ProjectExtra *extra = &project->extras[i];
+
+    if(extra->kind != kind) {
+      continue;
+    }
+
+    // A LUT used by several filters is copied once
+    if(strncmp(extra->path, path, length) == 0 && extra->path[length] == '\0') {
+      return 1;
+    }
+
+    // Two files of the same name would be copied over each other; the first one is kept
+    const char *name = strrchr(extra->path, '/');
+    name = name ? name + 1 : extra->path;
+
+    if(strlen(name) == filename_length && memcmp(name, filename, filename_length) == 0) {
+      return 1;
     }
+  }
+
+  if(project->extra_count == project->extra_capacity) {
+    size_t capacity = project->extra_capacity ? project->extra_capacity * 2 : 16;
+    ProjectExtra *extras = realloc(project->extras, capacity * sizeof(ProjectExtra));
 
-    else {
-      // If duplicate, free the string
-      free(lines[i]);
+    if(!extras) {
+      return 0;
     }
+
+    project->extras = extras;
+    project->extra_capacity = capacity;
   }
 
-  // Free the original lines array (but not its strings, as they're now in unique_lines or freed)
-  free(lines);
-  // Reallocate unique_lines to the exact size needed
-  char **result = realloc(unique_lines, new_count * sizeof(char *));
+  char *copy = malloc(length + 1);
 
-  if(result == NULL && new_count > 0) {
-    fprintf(stderr, "Memory reallocation failed\n");
-    exit(EXIT_FAILURE);
+  if(!copy) {
+    return 0;
   }
 
-  // Update count
-  *count = new_count;
-  return result ? result : unique_lines;
+  memcpy(copy, path, length);
+  copy[length] = '\0';
+  project->extras[project->extra_count].path = copy;
+  project->extras[project->extra_count].kind = kind;
+  project->extra_count++;
+  return 1;
 }
-// ----------------- Grok 3 snippet
 
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  collect_project_property
+    Description:  xml_scan_properties() handler of parse_project(): records the span
+                 of every non-empty path, keeps a view of the resource of every
+                 chain, producer and transition, and adds every av.file, filename
+                 and resource inside a <transition> to the extras.
+                 Returns 0 to stop the scan when out of memory.
+   =====================================================================================
+*/
+static int collect_project_property(const XmlProperty *property, void *context) {
+  ProjectParse *parse = context;
+  ParsedProject *project = parse->project;
+  AssetKind kind = ASSET_RESOURCE;
+
+  if(property->length == 0) {
+    return 1;
+  }
+
+  if(property->kind == XML_PROPERTY_AV_FILE) {
+    kind = ASSET_LUT;
+  }
+
+  else if(property->kind == XML_PROPERTY_FILENAME) {
+    kind = ASSET_STABILIZER;
+  }
+
+  else if(property->in_transition) {
+    kind = ASSET_ALPHA_TRANSITION;
+  }
+
+  if(project->span_count == project->span_capacity) {
+    size_t capacity = project->span_capacity ? project->span_capacity * 2 : 64;
+    ProjectSpan *spans = realloc(project->spans, capacity * sizeof(ProjectSpan));
+
+    if(!spans) {
+      return 0;
+    }
+
+    project->spans = spans;
+    project->span_capacity = capacity;
+  }
+
+  ProjectSpan *span = &project->spans[project->span_count++];
+  span->offset = property->value - project->input.data;
+  span->length = property->length;
+  span->kind = kind;
+  span->replacement = NULL;
+  span->replacement_length = 0;
+
+  if(kind != ASSET_RESOURCE && !add_extra_file(project, property->value, property->length, kind)) {
+    return 0;
+  }
+
+  if(property->kind != XML_PROPERTY_RESOURCE || (!property->in_producer && !property->in_transition)) {
+    return 1;
+  }
+
+  if(parse->view_count == parse->view_capacity) {
+    size_t capacity = parse->view_capacity ? parse->view_capacity * 2 : 64;
+    PathView *views = realloc(parse->views, capacity * sizeof(PathView));
+
+    if(!views) {
+      return 0;
+    }
+
+    parse->views = views;
+    parse->view_capacity = capacity;
+  }
+
+  parse->views[parse->view_count].path = property->value;
+  parse->views[parse->view_count].length = property->length;
+  parse->view_count++;
+  return 1;
+}
 
 /*
    ===  FUNCTION  ======================================================================
-           Name:  parse_project_file
-    Description:  Parse a project file and return a list of resources
+           Name:  compare_path_views
+    Description:  qsort() comparison of two PathViews in strcmp() order
+   =====================================================================================
+*/
+static int compare_path_views(const void *a, const void *b) {
+  const PathView *first = a;
+  const PathView *second = b;
+  int order = memcmp(first->path, second->path, first->length < second->length ? first->length : second->length);
+
+  if(order != 0) {
+    return order;
+  }
+
+  return first->length < second->length ? -1 : (first->length > second->length ? 1 : 0);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  parse_project
+    Description:  Reads the project once and fills 'project' with what Steps 3 to 7
+                 need: the input, which stays mapped, the span of every path, the
+                 resources, sorted and without duplicates, and the extra files.
+                 Only the distinct paths are copied out of the input. Release it
+                 with free_parsed_project(), also after a failure.
+                 Returns 1 on success, 0 on failure.
     Written by Qwen 2.5 Turbo (https://chat.qwen.ai/)
    =====================================================================================
 */
-int parse_project_file(const char *filename, char ***resources, size_t *count) {
-  /*printf("DEBUG: fn parse_project_file, parser.c, received filename: %s\n", filename);*/
-  FILE *file = fopen(filename, "r");
+int parse_project(const char *filename, ParsedProject *project) {
+  /*printf("DEBUG: fn parse_project, parser.c, received filename: %s\n", filename);*/
+  memset(project, 0, sizeof(*project));
 
-  if(!file) {
-    perror("Failed to open project file");
+  if(!map_project_file(filename, &project->input)) {
     return 0;
   }
 
-  *resources = NULL;
-  *count = 0;
-  char line[MAX_LINE_LENGTH];
-  int inside_chain_or_producer = 0; // Tracks whether we're inside <chain> or <producer>
-  int inside_transition = 0; // Tracks whether we're inside <transition>
+  // Every path of the project, in one pass
+  ProjectParse parse = { project, NULL, 0, 0 };
 
-  while(fgets(line, sizeof(line), file)) {
-    // Check for the start of a <chain> or <producer>
-    if(strstr(line, "<chain id=") || strstr(line, "<producer id=")) {
-      inside_chain_or_producer = 1;
-    }
+  if(!xml_scan_properties(project->input.data, project->input.size, collect_project_property, &parse)) {
+    perror("Failed to allocate memory for resources");
+    free(parse.views);
+    return 0;
+  }
 
-    else if(inside_chain_or_producer && (strstr(line, "</chain>") || strstr(line, "</producer>"))) {
-      inside_chain_or_producer = 0;
-    }
+  // Sort the views so duplicates sit together, then own one copy of each
+  qsort(parse.views, parse.view_count, sizeof(PathView), compare_path_views);
+  size_t unique = 0;
 
-    // Extract resource paths within <chain> or <producer>
-    if(inside_chain_or_producer && strstr(line, "<property name=\"resource\">")) {
-      char *start = strchr(line, '>') + 1;
-      char *end = strrchr(line, '<');
-
-      if(start && end) {
-        size_t len = end - start;
-        char *resource = malloc(len + 1);
-
-        if(!resource) {
-          fclose(file);
-          free_strings_array(*resources, *count);
-          return 0;
-        }
-
-        strncpy(resource, start, len);
-        resource[len] = '\0';
-        // Add to resources array
-        *resources = realloc(*resources, (*count + 1) * sizeof(char *));
-
-        if(!*resources) {
-          fclose(file);
-          free_strings_array(*resources, *count);
-          free(resource);
-          return 0;
-        }
-
-        (*resources)[*count] = resource;
-        (*count)++;
-      }
+  for(size_t i = 0; i < parse.view_count; i++) {
+    if(unique == 0 || compare_path_views(&parse.views[i], &parse.views[unique - 1]) != 0) {
+      parse.views[unique++] = parse.views[i];
     }
+  }
 
-    // Check for the start of a <transition>
-    else if(strstr(line, "<transition")) {
-      inside_transition = 1;
-    }
+  project->resources = unique ? malloc(unique * sizeof(char *)) : NULL;
 
-    else if(inside_transition && strstr(line, "</transition>")) {
-      inside_transition = 0;
-    }
+  for(size_t i = 0; i < unique && project->resources; i++) {
+    char *resource = malloc(parse.views[i].length + 1);
 
-    // Extract resource paths within <transition>
-    else if(inside_transition && strstr(line, "<property name=\"resource\">")) {
-      char *start = strchr(line, '>') + 1;
-      char *end = strrchr(line, '<');
-
-      if(start && end) {
-        size_t len = end - start;
-        char *resource = malloc(len + 1);
-
-        if(!resource) {
-          fclose(file);
-          free_strings_array(*resources, *count);
-          return 0;
-        }
-
-        strncpy(resource, start, len);
-        resource[len] = '\0';
-        // Add to resources array
-        *resources = realloc(*resources, (*count + 1) * sizeof(char *));
-
-        if(!*resources) {
-          fclose(file);
-          free_strings_array(*resources, *count);
-          free(resource);
-          return 0;
-        }
-
-        (*resources)[*count] = resource;
-        (*count)++;
-      }
+    if(!resource) {
+      free_strings_array(project->resources, i);
+      project->resources = NULL;
+      break;
     }
+
+    memcpy(resource, parse.views[i].path, parse.views[i].length);
+    resource[parse.views[i].length] = '\0';
+    project->resources[i] = resource;
+  }
+
+  free(parse.views);
+
+  if(unique && !project->resources) {
+    perror("Failed to allocate memory for resources");
+    return 0;
   }
 
-  fclose(file);
-  // Remove duplicates and sort the resources
-  *resources = remove_duplicates_and_sort(*resources, count);
-  /*printf("DEBUG: fn parse_project_file, parser.c, Total unique resources parsed: %ld\n", *count);*/
+  project->resource_count = unique;
+  /*printf("DEBUG: fn parse_project, parser.c, Total unique resources parsed: %ld\n", project->resource_count);*/
   return 1;
 }
 
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  free_parsed_project
+    Description:  Releases everything parse_project() filled in, and the input
+   =====================================================================================
+*/
+void free_parsed_project(ParsedProject *project) {
+  for(size_t i = 0; i < project->span_count; i++) {
+    free(project->spans[i].replacement);
+  }
+
+  for(size_t i = 0; i < project->extra_count; i++) {
+    free(project->extras[i].path);
+  }
+
+  free(project->spans);
+  free(project->extras);
+  free_strings_array(project->resources, project->resource_count);
+
+  if(project->input.data) {
+    unmap_project_file(&project->input);
+  }
+
+  memset(project, 0, sizeof(*project));
+}
+
 /*
    ===  FUNCTION  ======================================================================
            Name:  free_strings_array
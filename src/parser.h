@@ -3,7 +3,63 @@
 
 #include <stdio.h>
 
+// A project file in memory: mapped when it is a regular file, read otherwise
+typedef struct {
+  const char *data;
+  size_t size;
+  int mapped;
+} ProjectFile;
+
+// Where Step 6 puts a file: the assets directory or one of its subdirectories
+typedef enum {
+  ASSET_RESOURCE = 0,
+  ASSET_LUT,
+  ASSET_STABILIZER,
+  ASSET_ALPHA_TRANSITION
+} AssetKind;
+
+/*
+   A path in the project that the bundle may point elsewhere: the 'length'
+   bytes at 'offset' in the input. 'replacement' is its path in the bundle,
+   'replacement_length' bytes long, set by plan_project_rewrites(); NULL
+   keeps the original.
+*/
+typedef struct {
+  size_t offset;
+  size_t length;
+  AssetKind kind;
+  char *replacement;
+  size_t replacement_length;
+} ProjectSpan;
+
+// A LUT, stabiliser or alpha-transition file named by the project
+typedef struct {
+  char *path;
+  AssetKind kind;
+} ProjectExtra;
+
+/*
+   Everything a collection needs from the project, from one pass over it: the
+   input, every path in it in document order, the distinct resources of its
+   chains, producers and transitions, sorted, and the distinct extra files in
+   the order they appear.
+*/
+typedef struct {
+  ProjectFile input;
+  ProjectSpan *spans;
+  size_t span_count;
+  size_t span_capacity;
+  char **resources;
+  size_t resource_count;
+  ProjectExtra *extras;
+  size_t extra_count;
+  size_t extra_capacity;
+} ParsedProject;
+
 void free_strings_array(char **array, size_t count);
-int parse_project_file(const char *filename, char ***resources, size_t *count);
+int map_project_file(const char *filename, ProjectFile *project);
+void unmap_project_file(ProjectFile *project);
+int parse_project(const char *filename, ParsedProject *project);
+void free_parsed_project(ParsedProject *project);
 
 #endif // PARSER_H
@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "plan.h"
+#include "preflight.h"
+#include "copy_engine.h"
+#include "file_utils.h"
+#include "logging.h"
+#include "parser.h"
+
+/*
+   --plan writes what a collection would do as one JSON object, without
+   creating a directory or copying a byte:
+
+     {"project":"/in/p.mlt","output":"/out/p.mlt",
+      "files":[{"kind":"resource","source":"...","destination":"...","status":"ok",
+                "size":N,"needed":N,"cousin":false,"duplicate_of":null,"transfer":true}],
+      "rewrites":[{"line":N,"from":"...","to":"..."}],
+      "totals":{"files":N,"bytes":N,"needed":N,"available":N,"missing":N,"fits":true},
+      "elapsed":S}
+
+   The files come from preflight_scan(), so destinations are resolved by
+   get_destination_path() and the rules Step 6 copies by. The rewrites come
+   from render_project(), the layout Step 7 writes, put together in memory and
+   compared with the project line by line, so they are exactly the lines
+   Step 7 would change.
+*/
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  asset_kind_name
+    Description:  Returns the name of an AssetKind used in the plan
+   =====================================================================================
+*/
+static const char *asset_kind_name(AssetKind kind) {
+  switch(kind) {
+    case ASSET_LUT:
+      return "lut";
+
+    case ASSET_STABILIZER:
+      return "stabilizer";
+
+    case ASSET_ALPHA_TRANSITION:
+      return "alpha_transition";
+
+    default:
+      return "resource";
+  }
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  find_mapping
+    Description:  Returns the file mapping of a resource, or NULL if it has none
+   =====================================================================================
+*/
+static const FileMapping *find_mapping(const char *resource) {
+  for(size_t i = 0; i < file_mapping_count; i++) {
+    if(strcmp(resource, file_mappings[i].original_path) == 0) {
+      return &file_mappings[i];
+    }
+  }
+
+  return NULL;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  write_plan_files
+    Description:  Writes the "files" array. The first 'resource_count' entries of the
+                 scan are the resources, in order, so their mappings can be found.
+   =====================================================================================
+*/
+static void write_plan_files(FILE *stream, const PreflightScan *scan, const ParsedProject *project) {
+  char **resources = project->resources;
+  size_t resource_count = project->resource_count;
+  fputs("  \"files\": [", stream);
+
+  for(size_t i = 0; i < scan->count; i++) {
+    const PreflightEntry *entry = &scan->entries[i];
+    const FileMapping *mapping = i < resource_count ? find_mapping(resources[i]) : NULL;
+    fprintf(stream, "%s\n    {\"kind\":\"%s\",\"source\":", i ? "," : "", asset_kind_name(entry->kind));
+    write_json_string(stream, entry->source ? entry->source : (i < resource_count ? resources[i] : ""));
+    fputs(",\"destination\":", stream);
+    write_json_string(stream, entry->destination);
+    fprintf(stream, ",\"status\":\"%s\"", entry->status == 1 ? "ok" : (entry->status == 0 ? "missing" : "not_a_file"));
+
+    if(entry->status == 1) {
+      fprintf(stream, ",\"size\":%llu,\"needed\":%llu", entry->size, entry->needed);
+    }
+
+    else {
+      fputs(",\"size\":null,\"needed\":0", stream);
+    }
+
+    fprintf(stream, ",\"cousin\":%s,\"duplicate_of\":", mapping && mapping->is_cousin ? "true" : "false");
+
+    if(mapping && mapping->duplicate_of >= 0) {
+      write_json_string(stream, file_mappings[mapping->duplicate_of].original_path);
+    }
+
+    else {
+      fputs("null", stream);
+    }
+
+    fprintf(stream, ",\"transfer\":%s}", entry->status == 1 && entry->counted ? "true" : "false");
+  }
+
+  fputs(scan->count ? "\n  ],\n" : "],\n", stream);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  write_plan_rewrites
+    Description:  Writes the "rewrites" array: every project line Step 7 changes,
+                 with its 1-based line number. Returns 1 on success, 0 on failure.
+   =====================================================================================
+*/
+static int write_plan_rewrites(FILE *stream, const ParsedProject *project) {
+  size_t rewritten_size;
+  char *rewritten = render_project(project, &rewritten_size);
+
+  if(!rewritten) {
+    perror("Failed to allocate memory for the plan");
+    return 0;
+  }
+
+  // Paths hold no newlines, so the two versions have the same lines
+  const char *from = project->input.data;
+  const char *to = rewritten;
+  const char *from_end = project->input.data + project->input.size;
+  const char *to_end = rewritten + rewritten_size;
+  size_t line_number = 0;
+  size_t rewrites = 0;
+  fputs("  \"rewrites\": [", stream);
+
+  while(from < from_end && to < to_end) {
+    const char *from_newline = memchr(from, '\n', from_end - from);
+    const char *to_newline = memchr(to, '\n', to_end - to);
+    size_t from_length = (from_newline ? from_newline : from_end) - from;
+    size_t to_length = (to_newline ? to_newline : to_end) - to;
+    line_number++;
+
+    if(from_length != to_length || memcmp(from, to, from_length) != 0) {
+      char *original = strndup(from, from_length);
+      char *changed = strndup(to, to_length);
+
+      if(original) {
+        original[strcspn(original, "\r")] = '\0';
+      }
+
+      if(changed) {
+        changed[strcspn(changed, "\r")] = '\0';
+      }
+
+      fprintf(stream, "%s\n    {\"line\":%zu,\"from\":", rewrites++ ? "," : "", line_number);
+      write_json_string(stream, original ? original : "");
+      fputs(",\"to\":", stream);
+      write_json_string(stream, changed ? changed : "");
+      fputc('}', stream);
+      free(original);
+      free(changed);
+    }
+
+    from += from_length + 1;
+    to += to_length + 1;
+  }
+
+  fputs(rewrites ? "\n  ],\n" : "],\n", stream);
+  free(rewritten);
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  write_plan
+    Description:  Writes the --plan JSON for collecting 'input_file', parsed into
+                 'project' with its rewrites planned, into 'output_dir' to
+                 'stream'. Nothing is created or copied. Returns 1 on success,
+                 0 on failure.
+   =====================================================================================
+*/
+int write_plan(FILE *stream, const ParsedProject *project, const char *input_file, const char *output_project_file,
+               const char *output_dir, const char *project_root) {
+  double started = monotonic_seconds();
+  PreflightScan scan;
+
+  if(!preflight_scan(project, project_root, output_dir, &scan)) {
+    preflight_free(&scan);
+    return 0;
+  }
+
+  fputs("{\n  \"project\": ", stream);
+  write_json_string(stream, input_file);
+  fputs(",\n  \"output\": ", stream);
+  write_json_string(stream, output_project_file);
+  fputs(",\n", stream);
+  write_plan_files(stream, &scan, project);
+  int ok = write_plan_rewrites(stream, project);
+  const PreflightPlan *plan = &scan.plan;
+  fprintf(stream, "  \"totals\": {\"files\":%zu,\"bytes\":%llu,\"needed\":%llu,\"available\":%llu,\"missing\":%zu,\"fits\":%s},\n",
+          plan->files, plan->bytes, plan->needed, plan->available, plan->missing,
+          plan->needed <= plan->available && plan->inodes_needed <= plan->inodes_available ? "true" : "false");
+  fprintf(stream, "  \"elapsed\": %.6f\n}\n", monotonic_seconds() - started);
+  preflight_free(&scan);
+  return ok && fflush(stream) == 0 && !ferror(stream);
+}
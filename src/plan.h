@@ -0,0 +1,11 @@
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include "parser.h"
+
+int write_plan(FILE *stream, const ParsedProject *project, const char *input_file, const char *output_project_file,
+               const char *output_dir, const char *project_root);
+
+#endif // PLAN_H
@@ -0,0 +1,376 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/sysmacros.h>
+#include "preflight.h"
+#include "copy_engine.h"
+#include "file_utils.h"
+#include "tar_output.h"
+#include "parser.h"
+
+/*
+   The preflight runs between parsing the project and creating the bundle. It
+   stats every file the run will collect - the resources and the LUT,
+   stabiliser and alpha-transition files parse_project() found - with a pool of threads, so a project on a network mount does not wait for
+   one round trip after another. The sizes are checked against the free space
+   of the output filesystem, and the run stops before it writes anything when
+   the bundle cannot fit. With --output-format tar or zstd the output
+   directory is the archive's, and no space is checked when the archive goes
+   to a pipe.
+*/
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  add_entry
+    Description:  Adds 'source' to the scan. Takes ownership of 'destination'.
+                 Returns 1 on success, 0 if out of memory.
+   =====================================================================================
+*/
+static int add_entry(PreflightScan *scan, const char *source, const char *project_root, char *destination, AssetKind kind, int counted) {
+  if(!destination) {
+    return 0;
+  }
+
+  if(scan->count == scan->capacity) {
+    size_t capacity = scan->capacity ? scan->capacity * 2 : 64;
+    PreflightEntry *entries = realloc(scan->entries, capacity * sizeof(PreflightEntry));
+
+    if(!entries) {
+      free(destination);
+      return 0;
+    }
+
+    scan->entries = entries;
+    scan->capacity = capacity;
+  }
+
+  char full_source_path[4096] = {0};
+  PreflightEntry *entry = &scan->entries[scan->count];
+  memset(entry, 0, sizeof(*entry));
+  entry->destination = destination;
+  entry->kind = kind;
+  entry->counted = counted;
+  entry->names_file = strchr(source, '/') || strchr(source, '.');
+
+  if(resolve_source_path(source, project_root, full_source_path, sizeof(full_source_path))) {
+    entry->source = strdup(full_source_path);
+
+    if(!entry->source) {
+      free(destination);
+      return 0;
+    }
+  }
+
+  scan->count++;
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  add_extra
+    Description:  Adds the LUT, stabiliser or alpha-transition file 'path', bound for
+                 its subdirectory of the assets directory the way collect_extra()
+                 copies it. Returns 1 on success, 0 if out of memory.
+   =====================================================================================
+*/
+static int add_extra(PreflightScan *scan, const char *path, const char *assets_dir, AssetKind kind,
+                     const char *project_root) {
+  const char *subdir = asset_subdir(kind);
+  const char *filename = strrchr(path, '/');
+  filename = filename ? filename + 1 : path;
+  char *destination = malloc(strlen(assets_dir) + strlen(subdir) + strlen(filename) + 3);
+
+  if(!destination) {
+    return 0;
+  }
+
+  sprintf(destination, "%s/%s/%s", assets_dir, subdir, filename);
+  return add_entry(scan, path, project_root, destination, kind, 1);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  preflight_worker
+    Description:  Thread body of run_preflight(): stats sources, and the destinations
+                 an earlier run may have left, until none are left. statx() with
+                 AT_STATX_DONT_SYNC lets network filesystems answer from their
+                 attribute cache.
+   =====================================================================================
+*/
+static void *preflight_worker(void *arg) {
+  PreflightScan *scan = arg;
+
+  for(;;) {
+    pthread_mutex_lock(&scan->lock);
+    size_t i = scan->next++;
+    pthread_mutex_unlock(&scan->lock);
+
+    if(i >= scan->count) {
+      break;
+    }
+
+    PreflightEntry *entry = &scan->entries[i];
+    struct statx stx;
+
+    if(!entry->source ||
+       statx(AT_FDCWD, entry->source, AT_STATX_DONT_SYNC, STATX_TYPE | STATX_SIZE | STATX_BLOCKS, &stx) != 0) {
+      entry->status = 0;
+      continue;
+    }
+
+    if(!S_ISREG(stx.stx_mode)) {
+      entry->status = -1;
+      continue;
+    }
+
+    entry->status = 1;
+    entry->size = stx.stx_size;
+    entry->allocated = stx.stx_blocks * 512ULL;
+    entry->device = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+
+    if(entry->counted && copy_options.output_format == OUTPUT_DIRECTORY &&
+       statx(AT_FDCWD, entry->destination, AT_STATX_DONT_SYNC, STATX_TYPE | STATX_BLOCKS, &stx) == 0 &&
+       S_ISREG(stx.stx_mode)) {
+      entry->existing = stx.stx_blocks * 512ULL;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  output_filesystem
+    Description:  Fills 'vfs' and 'device' for the filesystem the bundle will be
+                 written to: the output directory, or its nearest existing parent
+                 when it has not been created yet. Returns 1 on success, 0 on failure.
+   =====================================================================================
+*/
+static int output_filesystem(const char *output_dir, struct statvfs *vfs, dev_t *device) {
+  char path[4096];
+  struct stat st;
+  snprintf(path, sizeof(path), "%s", output_dir[0] ? output_dir : ".");
+
+  while(statvfs(path, vfs) != 0 || stat(path, &st) != 0) {
+    char *last_slash = strrchr(path, '/');
+
+    if(errno != ENOENT || strcmp(path, "/") == 0 || strcmp(path, ".") == 0) {
+      perror("Failed to check free space of the output directory");
+      return 0;
+    }
+
+    if(!last_slash) {
+      strcpy(path, ".");
+    }
+
+    else {
+      last_slash[last_slash == path ? 1 : 0] = '\0';
+    }
+  }
+
+  *device = st.st_dev;
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  space_needed
+    Description:  Bytes 'entry' adds to the output filesystem: nothing for links
+                 and clones that share the source's blocks, the allocated blocks of
+                 a sparse file, otherwise its size rounded up to whole blocks,
+                 less what an earlier copy of the asset already takes up. In an
+                 archive it is the member: a header and the padded data (an upper
+                 bound for a zstd bundle).
+   =====================================================================================
+*/
+static unsigned long long space_needed(const PreflightEntry *entry, dev_t output_device, unsigned long long block) {
+  if(copy_options.output_format != OUTPUT_DIRECTORY) {
+    return (entry->size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE + TAR_BLOCK_SIZE;
+  }
+
+  if(copy_options.link == LINK_SYM ||
+     (entry->device == output_device && (copy_options.link == LINK_HARD || copy_options.reflink == REFLINK_ALWAYS))) {
+    return 0;
+  }
+
+  unsigned long long data = (entry->size + block - 1) / block * block;
+
+  if(entry->allocated < entry->size) {
+    data = entry->allocated;
+  }
+
+  return data > entry->existing ? data - entry->existing : 0;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  preflight_scan
+    Description:  Lists every file the collection will copy - the resources first, in
+                 their order, then the extra files of the project - stats
+                 them in parallel and fills 'scan->plan' with the totals. Nothing
+                 is printed or written. Free the scan with preflight_free().
+                 A NULL 'output_dir' (an archive on stdout) stands for the
+                 current directory. Returns 1 on success, 0 on failure.
+   =====================================================================================
+*/
+int preflight_scan(const ParsedProject *project, const char *project_root, const char *output_dir, PreflightScan *scan) {
+  memset(scan, 0, sizeof(*scan));
+  pthread_mutex_init(&scan->lock, NULL);
+  output_dir = output_dir ? output_dir : ".";
+  char *assets_dir = concat_paths(output_dir, "assets");
+  int ok = assets_dir != NULL;
+
+  for(size_t i = 0; ok && i < project->resource_count; i++) {
+    const char *resource = project->resources[i];
+    ok = add_entry(scan, resource, project_root, get_destination_path(resource, assets_dir), ASSET_RESOURCE,
+                   !is_duplicate_resource(resource));
+  }
+
+  for(size_t i = 0; ok && i < project->extra_count; i++) {
+    ok = add_extra(scan, project->extras[i].path, assets_dir, project->extras[i].kind, project_root);
+  }
+
+  if(!ok) {
+    perror("Failed to allocate memory for preflight");
+  }
+
+  free(assets_dir);
+  struct statvfs vfs;
+  dev_t output_device = 0;
+
+  if(!ok || !output_filesystem(output_dir, &vfs, &output_device)) {
+    return 0;
+  }
+
+  pthread_t threads[PREFLIGHT_THREADS];
+  int started_threads = 0;
+
+  for(int i = 0; i < PREFLIGHT_THREADS && (size_t)i < scan->count; i++) {
+    if(pthread_create(&threads[i], NULL, preflight_worker, scan) != 0) {
+      break;
+    }
+
+    started_threads++;
+  }
+
+  if(started_threads == 0) {
+    preflight_worker(scan);
+  }
+
+  for(int i = 0; i < started_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  PreflightPlan *plan = &scan->plan;
+  unsigned long long block = vfs.f_frsize ? vfs.f_frsize : 4096;
+  // The rewritten project and the bookkeeping files next to it
+  plan->needed = (unsigned long long)project->input.size + block;
+
+  for(size_t i = 0; i < scan->count; i++) {
+    PreflightEntry *entry = &scan->entries[i];
+
+    if(entry->status == 0 && entry->names_file) {
+      plan->missing++;
+    }
+
+    if(entry->status == 1 && entry->counted) {
+      entry->needed = space_needed(entry, output_device, block);
+      plan->files++;
+      plan->bytes += entry->size;
+      plan->needed += entry->needed;
+
+      if(entry->existing == 0 && !(copy_options.link == LINK_HARD && entry->device == output_device) &&
+         copy_options.output_format == OUTPUT_DIRECTORY) {
+        plan->inodes_needed++;
+      }
+    }
+  }
+
+  // An archive is one file, however many members it has
+  if(copy_options.output_format != OUTPUT_DIRECTORY) {
+    plan->inodes_needed = 1;
+  }
+
+  plan->available = (unsigned long long)vfs.f_bavail * vfs.f_frsize;
+  // Filesystems without an inode limit report no inodes at all
+  plan->inodes_available = vfs.f_files != 0 ? vfs.f_favail : ~0ULL;
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  preflight_free
+    Description:  Frees the entries of a scan from preflight_scan()
+   =====================================================================================
+*/
+void preflight_free(PreflightScan *scan) {
+  for(size_t i = 0; i < scan->count; i++) {
+    free(scan->entries[i].source);
+    free(scan->entries[i].destination);
+  }
+
+  free(scan->entries);
+  pthread_mutex_destroy(&scan->lock);
+  memset(scan, 0, sizeof(*scan));
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  run_preflight
+    Description:  Runs preflight_scan(), reports the sources that are missing and
+                 copies the totals to 'plan'. Returns 1 if the bundle fits on the
+                 output filesystem, 0 if it does not or the check failed; nothing
+                 is written either way. With a NULL 'output_dir' (an archive
+                 on stdout) the space is not checked.
+   =====================================================================================
+*/
+int run_preflight(const ParsedProject *project, const char *project_root, const char *output_dir, PreflightPlan *plan) {
+  PreflightScan scan;
+  int ok = preflight_scan(project, project_root, output_dir, &scan);
+
+  for(size_t i = 0; ok && i < scan.count; i++) {
+    PreflightEntry *entry = &scan.entries[i];
+
+    if(entry->status == 0 && entry->names_file) {
+      fprintf(stderr, "Missing source: %s\n", entry->source ? entry->source : entry->destination);
+    }
+  }
+
+  *plan = scan.plan;
+  preflight_free(&scan);
+
+  if(!ok) {
+    return 0;
+  }
+
+  printf("Preflight: %zu files, %.1f MiB to transfer, %.1f MiB needed, %.1f MiB free\n", plan->files,
+         (double)plan->bytes / (1024.0 * 1024.0), (double)plan->needed / (1024.0 * 1024.0),
+         (double)plan->available / (1024.0 * 1024.0));
+
+  if(plan->missing) {
+    fprintf(stderr, "Warning: %zu source file(s) are missing and will not be collected.\n", plan->missing);
+  }
+
+  if(!output_dir) {
+    return 1;
+  }
+
+  if(plan->needed > plan->available) {
+    fprintf(stderr, "Error: Not enough space in %s: %.1f MiB needed, %.1f MiB available.\n", output_dir,
+            (double)plan->needed / (1024.0 * 1024.0), (double)plan->available / (1024.0 * 1024.0));
+    return 0;
+  }
+
+  if(plan->inodes_needed > plan->inodes_available) {
+    fprintf(stderr, "Error: Not enough inodes in %s: %llu needed, %llu available.\n", output_dir,
+            plan->inodes_needed, plan->inodes_available);
+    return 0;
+  }
+
+  return 1;
+}
@@ -0,0 +1,65 @@
+#ifndef PREFLIGHT_H
+#define PREFLIGHT_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "parser.h"
+
+// Threads that stat the sources at once; slow network mounts answer them in parallel
+#define  PREFLIGHT_THREADS  16
+
+/*
+   What a collection will transfer and the space it needs, worked out before
+   anything is written. 'files' and 'bytes' count the source files the run
+   copies or links; 'needed' is what they take up on the output filesystem
+   after links, --dedup and assets already in the bundle are accounted for.
+*/
+typedef struct {
+  size_t files;
+  unsigned long long bytes;
+  unsigned long long needed;
+  unsigned long long available;
+  unsigned long long inodes_needed;
+  unsigned long long inodes_available;
+  size_t missing;
+} PreflightPlan;
+
+/*
+   One file the run will collect. 'counted' is 0 for --dedup duplicates: they
+   need no space of their own. 'status' is 1 for a regular file, 0 if the
+   source is missing and -1 for anything else; a missing source is only
+   reported when it names a file, since producers such as color have a
+   resource that is not one.
+   'existing' is the space already taken by the destination when an earlier
+   run left the asset in the bundle, 'needed' what the file adds to it.
+*/
+typedef struct {
+  char *source;
+  char *destination;
+  AssetKind kind;
+  int counted;
+  int names_file;
+  int status;
+  unsigned long long size;
+  unsigned long long allocated;
+  dev_t device;
+  unsigned long long existing;
+  unsigned long long needed;
+} PreflightEntry;
+
+// The files of a preflight_scan(), handed to its stat threads from 'next'
+typedef struct {
+  PreflightEntry *entries;
+  size_t count;
+  size_t capacity;
+  size_t next;
+  pthread_mutex_t lock;
+  PreflightPlan plan;
+} PreflightScan;
+
+int preflight_scan(const ParsedProject *project, const char *project_root, const char *output_dir, PreflightScan *scan);
+void preflight_free(PreflightScan *scan);
+int run_preflight(const ParsedProject *project, const char *project_root, const char *output_dir, PreflightPlan *plan);
+
+#endif // PREFLIGHT_H
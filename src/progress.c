@@ -0,0 +1,384 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "progress.h"
+#include "copy_engine.h"
+#include "logging.h"
+
+/*
+   Progress of Step 6 and 7. The copy engine reports bytes as they are copied
+   and every finished asset; a ticker thread turns that into a status line on
+   a terminal stderr and, with --progress-fd, newline-delimited JSON events:
+
+     {"event":"start","files":N,"bytes":N}
+     {"event":"file","path":"assets/...","bytes":N,"method":"copy_file_range"}
+     {"event":"progress","files_done":N,"files":N,"bytes_done":N,"bytes":N,
+      "elapsed":S,"rate":B/s,"eta":S|null}
+     {"event":"finish","status":"ok"|"failed","files_done":N,"bytes_done":N,"elapsed":S}
+*/
+
+typedef struct {
+  int active;
+  int tty;
+  FILE *events;
+  const char *output_dir;
+  size_t output_dir_len;
+  unsigned long long bytes_total;
+  unsigned long long bytes_done;
+  size_t files_total;
+  size_t files_done;
+  double started;
+  double rate;
+  double sampled_at;
+  unsigned long long sampled_bytes;
+  double event_at;
+  int line_shown;
+  int stop;
+  pthread_t ticker;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+} Progress;
+
+static Progress progress = { 0, 0, NULL, NULL, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  format_bytes
+    Description:  Formats a byte count as a short human-readable size
+   =====================================================================================
+*/
+static void format_bytes(unsigned long long bytes, char *text, size_t size) {
+  if(bytes >= 1024ULL * 1024ULL * 1024ULL) {
+    snprintf(text, size, "%.1f GiB", (double)bytes / (1024.0 * 1024.0 * 1024.0));
+  }
+
+  else {
+    snprintf(text, size, "%.1f MiB", (double)bytes / (1024.0 * 1024.0));
+  }
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  seconds_left
+    Description:  Estimated seconds until every planned byte is copied at the current
+                 rate, or -1 while there is no rate yet. Caller holds the lock.
+   =====================================================================================
+*/
+static double seconds_left(void) {
+  if(progress.rate <= 0) {
+    return -1;
+  }
+
+  unsigned long long left = progress.bytes_total > progress.bytes_done ? progress.bytes_total - progress.bytes_done : 0;
+  return (double)left / progress.rate;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  draw_line
+    Description:  Redraws the status line on stderr. Caller holds the lock.
+   =====================================================================================
+*/
+static void draw_line(double now) {
+  char done[32];
+  char total[32];
+  char eta[32] = "--:--:--";
+  double left = seconds_left();
+  double percent = progress.bytes_total ? 100.0 * (double)progress.bytes_done / (double)progress.bytes_total : 100.0;
+
+  if(left >= 0) {
+    long s = (long)(left + 0.5);
+    snprintf(eta, sizeof(eta), "%ld:%02ld:%02ld", s / 3600, s / 60 % 60, s % 60);
+  }
+
+  format_bytes(progress.bytes_done, done, sizeof(done));
+  format_bytes(progress.bytes_total, total, sizeof(total));
+  fprintf(stderr, "\r\033[K%5.1f%%  %s of %s  %zu/%zu files  %.1f MiB/s  ETA %s  (%.0f s)",
+          percent > 100.0 ? 100.0 : percent, done, total, progress.files_done, progress.files_total,
+          progress.rate / (1024.0 * 1024.0), eta, now - progress.started);
+  fflush(stderr);
+  progress.line_shown = 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  clear_line
+    Description:  Erases the status line so other output starts at column 0.
+                 Caller holds the lock.
+   =====================================================================================
+*/
+static void clear_line(void) {
+  if(progress.line_shown) {
+    fputs("\r\033[K", stderr);
+    fflush(stderr);
+    progress.line_shown = 0;
+  }
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  write_progress_event
+    Description:  Writes a "progress" event. Caller holds the lock.
+   =====================================================================================
+*/
+static void write_progress_event(double now) {
+  double left = seconds_left();
+  fprintf(progress.events, "{\"event\":\"progress\",\"files_done\":%zu,\"files\":%zu,\"bytes_done\":%llu,\"bytes\":%llu,"
+          "\"elapsed\":%.3f,\"rate\":%.0f,\"eta\":", progress.files_done, progress.files_total,
+          progress.bytes_done, progress.bytes_total, now - progress.started, progress.rate);
+
+  if(left >= 0) {
+    fprintf(progress.events, "%.1f}\n", left);
+  }
+
+  else {
+    fputs("null}\n", progress.events);
+  }
+
+  fflush(progress.events);
+  progress.event_at = now;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  sample_rate
+    Description:  Updates the throughput, smoothed so one slow or fast second does
+                 not make the ETA jump. Caller holds the lock.
+   =====================================================================================
+*/
+static void sample_rate(double now) {
+  double interval = now - progress.sampled_at;
+
+  if(interval <= 0) {
+    return;
+  }
+
+  double current = (double)(progress.bytes_done - progress.sampled_bytes) / interval;
+  progress.rate = progress.rate > 0 ? 0.7 * progress.rate + 0.3 * current : current;
+  progress.sampled_at = now;
+  progress.sampled_bytes = progress.bytes_done;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  progress_ticker
+    Description:  Thread body: redraws the status line and writes progress events
+                 until progress_end()
+   =====================================================================================
+*/
+static void *progress_ticker(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&progress.lock);
+
+  while(!progress.stop) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += (long)(PROGRESS_LINE_INTERVAL * 1e9);
+    until.tv_sec += until.tv_nsec / 1000000000L;
+    until.tv_nsec %= 1000000000L;
+
+    if(pthread_cond_timedwait(&progress.wake, &progress.lock, &until) != ETIMEDOUT) {
+      continue;
+    }
+
+    double now = monotonic_seconds();
+    sample_rate(now);
+
+    if(progress.tty) {
+      draw_line(now);
+    }
+
+    if(progress.events && now - progress.event_at >= PROGRESS_EVENT_INTERVAL - 0.01) {
+      write_progress_event(now);
+    }
+  }
+
+  pthread_mutex_unlock(&progress.lock);
+  return NULL;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  progress_begin
+    Description:  Starts reporting a run the preflight planned at 'files' files of
+                 'bytes' bytes: a status line when stderr is a terminal, JSON
+                 events when 'events_fd' is not -1. File events name assets
+                 relative to 'output_dir', which must stay valid until
+                 progress_end(); NULL when the names are relative already.
+                 Returns 1 on success, 0 if 'events_fd' is not an open descriptor.
+   =====================================================================================
+*/
+int progress_begin(const char *output_dir, size_t files, unsigned long long bytes, int events_fd) {
+  progress.output_dir = output_dir;
+  progress.output_dir_len = output_dir ? strlen(output_dir) : 0;
+
+  if(events_fd >= 0) {
+    int fd = fcntl(events_fd, F_GETFD) < 0 ? -1 : dup(events_fd);
+    progress.events = fd < 0 ? NULL : fdopen(fd, "w");
+
+    if(!progress.events) {
+      perror("Failed to open --progress-fd");
+
+      if(fd >= 0) {
+        close(fd);
+      }
+
+      return 0;
+    }
+  }
+
+  progress.tty = isatty(STDERR_FILENO);
+
+  if(!progress.tty && !progress.events) {
+    return 1;
+  }
+
+  progress.files_total = files;
+  progress.bytes_total = bytes;
+  progress.started = progress.sampled_at = progress.event_at = monotonic_seconds();
+
+  if(progress.events) {
+    fprintf(progress.events, "{\"event\":\"start\",\"files\":%zu,\"bytes\":%llu}\n", progress.files_total, progress.bytes_total);
+    fflush(progress.events);
+  }
+
+  progress.stop = 0;
+  progress.active = pthread_create(&progress.ticker, NULL, progress_ticker, NULL) == 0;
+
+  if(!progress.active && progress.events) {
+    fclose(progress.events);
+    progress.events = NULL;
+  }
+
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  progress_advance
+    Description:  Counts bytes the engine has just copied of a file still in progress
+   =====================================================================================
+*/
+void progress_advance(unsigned long long bytes) {
+  if(!progress.active || bytes == 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&progress.lock);
+  progress.bytes_done += bytes;
+  pthread_mutex_unlock(&progress.lock);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  progress_file_done
+    Description:  Counts an asset as finished: 'size' bytes in total, 'streamed' of
+                 which were already counted by progress_advance(). 'how' is the copy
+                 method, or e.g. "unchanged" for a skipped asset.
+   =====================================================================================
+*/
+void progress_file_done(const char *destination, unsigned long long size, unsigned long long streamed, const char *how) {
+  if(!progress.active) {
+    return;
+  }
+
+  pthread_mutex_lock(&progress.lock);
+  progress.bytes_done += size > streamed ? size - streamed : 0;
+  progress.files_done++;
+
+  // A source that changed since the preflight can outgrow the plan
+  if(progress.files_done > progress.files_total) {
+    progress.files_total = progress.files_done;
+  }
+
+  if(progress.bytes_done > progress.bytes_total) {
+    progress.bytes_total = progress.bytes_done;
+  }
+
+  if(progress.events) {
+    // Directory mode passes '<output_dir>/assets/...'; the event always says 'assets/...'
+    const char *path = destination;
+
+    if(progress.output_dir && strncmp(destination, progress.output_dir, progress.output_dir_len) == 0 &&
+       destination[progress.output_dir_len] == '/') {
+      path += progress.output_dir_len + 1;
+    }
+
+    fputs("{\"event\":\"file\",\"path\":", progress.events);
+    write_json_string(progress.events, path);
+    fprintf(progress.events, ",\"bytes\":%llu,\"method\":", size);
+    write_json_string(progress.events, how);
+    fputs("}\n", progress.events);
+    fflush(progress.events);
+  }
+
+  pthread_mutex_unlock(&progress.lock);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  progress_pause
+    Description:  Erases the status line and holds it back until progress_resume(),
+                 so a message can be printed on the terminal in between
+   =====================================================================================
+*/
+void progress_pause(void) {
+  if(!progress.active) {
+    return;
+  }
+
+  pthread_mutex_lock(&progress.lock);
+  clear_line();
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  progress_resume
+    Description:  Ends a progress_pause(); the line is redrawn on the next tick
+   =====================================================================================
+*/
+void progress_resume(void) {
+  if(!progress.active) {
+    return;
+  }
+
+  fflush(stdout);
+  pthread_mutex_unlock(&progress.lock);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  progress_end
+    Description:  Stops the ticker, erases the status line and writes the "finish"
+                 event
+   =====================================================================================
+*/
+void progress_end(int completed) {
+  if(!progress.active) {
+    return;
+  }
+
+  pthread_mutex_lock(&progress.lock);
+  progress.stop = 1;
+  pthread_cond_signal(&progress.wake);
+  pthread_mutex_unlock(&progress.lock);
+  pthread_join(progress.ticker, NULL);
+  progress.active = 0;
+  clear_line();
+
+  if(progress.events) {
+    double now = monotonic_seconds();
+    sample_rate(now);
+    write_progress_event(now);
+    fprintf(progress.events, "{\"event\":\"finish\",\"status\":\"%s\",\"files_done\":%zu,\"bytes_done\":%llu,\"elapsed\":%.3f}\n",
+            completed ? "ok" : "failed", progress.files_done, progress.bytes_done, now - progress.started);
+    fclose(progress.events);
+    progress.events = NULL;
+  }
+}
@@ -0,0 +1,17 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <stddef.h>
+
+// How often the status line is redrawn and a progress event written, in seconds
+#define  PROGRESS_LINE_INTERVAL   0.5
+#define  PROGRESS_EVENT_INTERVAL  1.0
+
+int progress_begin(const char *output_dir, size_t files, unsigned long long bytes, int events_fd);
+void progress_advance(unsigned long long bytes);
+void progress_file_done(const char *destination, unsigned long long size, unsigned long long streamed, const char *how);
+void progress_pause(void);
+void progress_resume(void);
+void progress_end(int completed);
+
+#endif // PROGRESS_H
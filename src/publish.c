@@ -0,0 +1,101 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "publish.h"
+#include "logging.h"
+
+/*
+   Every file in the bundle is written under a temporary name next to its final
+   path and renamed into place once complete, so a crash never leaves a file
+   that looks finished but is not. Nothing is synced per file: the project file
+   is published last by publish_durably(), whose single syncfs() makes every
+   asset durable before the project that refers to them appears.
+*/
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  temporary_path
+    Description:  Returns the temporary name 'destination' is written under: a hidden
+                 ".<name>.collector-part" in the same directory, so the rename never
+                 crosses filesystems and --resume finds a partial copy again.
+                 The caller frees the result; NULL if out of memory.
+   =====================================================================================
+*/
+char *temporary_path(const char *destination) {
+  const char *name = strrchr(destination, '/');
+  size_t dir_len = name ? (size_t)(name - destination) + 1 : 0;
+  name = name ? name + 1 : destination;
+  size_t size = strlen(destination) + sizeof(PUBLISH_SUFFIX) + 1;
+  char *path = malloc(size);
+
+  if(path) {
+    snprintf(path, size, "%.*s.%s%s", (int)dir_len, destination, name, PUBLISH_SUFFIX);
+  }
+
+  return path;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  publish_file
+    Description:  Renames a finished 'temporary' over 'destination'. The temporary
+                 file is removed if that fails. Returns 1 on success, 0 on failure.
+   =====================================================================================
+*/
+int publish_file(const char *temporary, const char *destination) {
+  if(rename(temporary, destination) == 0) {
+    return 1;
+  }
+
+  console_perror("Failed to move finished file into place");
+  unlink(temporary);
+  return 0;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  publish_durably
+    Description:  Publishes the last file of a bundle. One syncfs() on the
+                 destination's filesystem flushes it together with every asset
+                 renamed into place before it, then the file is renamed and the
+                 directory synced so the rename itself survives a crash.
+                 Returns 1 on success, 0 on failure.
+   =====================================================================================
+*/
+int publish_durably(const char *temporary, const char *destination) {
+  const char *slash = strrchr(destination, '/');
+  char *directory = slash ? strndup(destination, slash == destination ? 1 : (size_t)(slash - destination)) : strdup(".");
+
+  if(!directory) {
+    perror("Failed to allocate memory for directory path");
+    unlink(temporary);
+    return 0;
+  }
+
+  int fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  free(directory);
+
+  if(fd < 0 || syncfs(fd) != 0) {
+    perror("Failed to flush the bundle to disk");
+
+    if(fd >= 0) {
+      close(fd);
+    }
+
+    unlink(temporary);
+    return 0;
+  }
+
+  int ok = publish_file(temporary, destination);
+
+  if(ok && fsync(fd) != 0) {
+    perror("Failed to flush the output directory");
+    ok = 0;
+  }
+
+  close(fd);
+  return ok;
+}
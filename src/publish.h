@@ -0,0 +1,11 @@
+#ifndef PUBLISH_H
+#define PUBLISH_H
+
+// Files are written as ".<name>" PUBLISH_SUFFIX in their final directory, then renamed into place
+#define  PUBLISH_SUFFIX  ".collector-part"
+
+char *temporary_path(const char *destination);
+int publish_file(const char *temporary, const char *destination);
+int publish_durably(const char *temporary, const char *destination);
+
+#endif // PUBLISH_H
@@ -0,0 +1,603 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "tar_output.h"
+#include "copy_engine.h"
+#include "file_utils.h"
+#include "checksums.h"
+#include "logging.h"
+#include "parser.h"
+#include "progress.h"
+#include "publish.h"
+#include "zstd_bundle.h"
+
+/*
+   --output-format tar streams the bundle into one POSIX (ustar) archive
+   instead of a directory tree: the assets under the same assets/,
+   assets/LUT/, assets/stabilization_data/ and assets/alpha_transition/ names,
+   then the rewritten project and, with --checksum, its .checksums file.
+   Members are appended in the order the collection reaches them, so the
+   archive can go straight into a pipe:
+
+     shotcut_project_collector p.mlt - | ssh host tar -x -C /srv/projects
+
+   Names that do not fit the ustar name and prefix fields, and files of
+   8 GiB or more, get a pax extended header first. A file archive is written
+   under a temporary name and only appears once it is complete. With
+   --output-format zstd the same stream goes through zstd_bundle.c instead of
+   straight to the descriptor.
+*/
+
+// Largest size the 11 octal digits of a ustar header can hold
+#define  TAR_MAX_OCTAL_SIZE  077777777777ULL
+
+typedef struct {
+  int fd;
+  char *path;              // The archive file, NULL when writing to a pipe
+  char *temporary;
+  unsigned long long offset;
+  int failed;
+  int compressed;          // The stream goes into a zstd bundle
+  char **names;            // Open-addressing set of the member names written
+  size_t name_count;
+  size_t slot_count;
+} TarArchive;
+
+static TarArchive archive = { -1, NULL, NULL, 0, 0, 0, NULL, 0, 0 };
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  name_hash
+    Description:  FNV-1a hash of a member name for the name set
+   =====================================================================================
+*/
+static size_t name_hash(const char *name) {
+  uint64_t h = 14695981039346656037ULL;
+
+  for(; *name; name++) {
+    h ^= (unsigned char)*name;
+    h *= 1099511628211ULL;
+  }
+
+  return (size_t)h;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  find_name_slot
+    Description:  Returns the slot holding 'name', or the free slot where it would go
+   =====================================================================================
+*/
+static size_t find_name_slot(char **slots, size_t slot_count, const char *name) {
+  size_t mask = slot_count - 1;
+  size_t slot = name_hash(name) & mask;
+
+  while(slots[slot] && strcmp(slots[slot], name) != 0) {
+    slot = (slot + 1) & mask;
+  }
+
+  return slot;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  remember_name
+    Description:  Adds 'name' to the members written. Returns 1 if it is new, 0 if
+                 the archive already has it. Out of memory, a name is treated as
+                 new: a second copy of a member is harmless, a missing one is not.
+   =====================================================================================
+*/
+static int remember_name(const char *name) {
+  // Keep the table at most half full so probe chains stay short
+  if((archive.name_count + 1) * 2 > archive.slot_count) {
+    size_t slot_count = archive.slot_count ? archive.slot_count * 2 : 128;
+    char **slots = calloc(slot_count, sizeof(char *));
+
+    if(!slots) {
+      return 1;
+    }
+
+    for(size_t i = 0; i < archive.slot_count; i++) {
+      if(archive.names[i]) {
+        slots[find_name_slot(slots, slot_count, archive.names[i])] = archive.names[i];
+      }
+    }
+
+    free(archive.names);
+    archive.names = slots;
+    archive.slot_count = slot_count;
+  }
+
+  size_t slot = find_name_slot(archive.names, archive.slot_count, name);
+
+  if(archive.names[slot]) {
+    return 0;
+  }
+
+  if((archive.names[slot] = strdup(name))) {
+    archive.name_count++;
+  }
+
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  write_all
+    Description:  Appends 'size' bytes to the archive, retrying short writes. The
+                 first error is reported and fails the archive.
+                 Returns 1 on success, 0 on failure.
+   =====================================================================================
+*/
+static int write_all(const void *data, size_t size) {
+  const char *bytes = data;
+
+  if(archive.compressed) {
+    if(!archive.failed && bundle_write(data, size)) {
+      archive.offset += size;
+    }
+
+    else {
+      archive.failed = 1;
+    }
+
+    return !archive.failed;
+  }
+
+  while(!archive.failed && size > 0) {
+    ssize_t n = write(archive.fd, bytes, size);
+
+    if(n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if(n <= 0) {
+      console_perror("Failed to write the tar archive");
+      archive.failed = 1;
+      break;
+    }
+
+    bytes += n;
+    size -= (size_t)n;
+    archive.offset += (unsigned long long)n;
+  }
+
+  return !archive.failed;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  write_padding
+    Description:  Fills the archive with zeros up to the next multiple of 'unit'
+   =====================================================================================
+*/
+static int write_padding(unsigned long long unit) {
+  static const char zeros[TAR_BLOCK_SIZE];
+
+  while(archive.offset % unit != 0) {
+    unsigned long long gap = unit - archive.offset % unit;
+
+    if(!write_all(zeros, gap < sizeof(zeros) ? (size_t)gap : sizeof(zeros))) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  put_octal
+    Description:  Writes 'value' into a header field as zero-padded octal digits
+                 followed by a NUL, filled in from the right
+   =====================================================================================
+*/
+static void put_octal(char *field, size_t width, unsigned long long value) {
+  field[width - 1] = '\0';
+
+  for(size_t i = width - 1; i > 0; i--) {
+    field[i - 1] = (char)('0' + (value & 7));
+    value >>= 3;
+  }
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  write_block_header
+    Description:  Writes one ustar header block. 'prefix_length' bytes of 'name' go
+                 to the prefix field and the rest, after the '/', to the name field;
+                 fields that are too small are truncated (a pax header carries the
+                 real values). Returns 1 on success, 0 on failure.
+   =====================================================================================
+*/
+static int write_block_header(const char *name, size_t prefix_length, unsigned long long size, time_t mtime,
+                              char type, unsigned int mode) {
+  char header[TAR_BLOCK_SIZE] = {0};
+  const char *rest = prefix_length ? name + prefix_length + 1 : name;
+  unsigned int sum = 0;
+  memcpy(header + 345, name, prefix_length > 155 ? 155 : prefix_length);
+  memcpy(header, rest, strlen(rest) > 100 ? 100 : strlen(rest));
+  put_octal(header + 100, 8, mode);
+  put_octal(header + 108, 8, 0);
+  put_octal(header + 116, 8, 0);
+  put_octal(header + 124, 12, size > TAR_MAX_OCTAL_SIZE ? 0 : size);
+  put_octal(header + 136, 12, mtime < 0 ? 0 : (unsigned long long)mtime);
+  memset(header + 148, ' ', 8);
+  header[156] = type;
+  memcpy(header + 257, "ustar", 6);
+  memcpy(header + 263, "00", 2);
+
+  for(size_t i = 0; i < sizeof(header); i++) {
+    sum += (unsigned char)header[i];
+  }
+
+  snprintf(header + 148, 7, "%06o", sum);
+  header[155] = ' ';
+  return write_all(header, sizeof(header));
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  append_pax_record
+    Description:  Appends a "<length> <key>=<value>\n" record, whose length counts
+                 its own digits, to 'records'
+   =====================================================================================
+*/
+static void append_pax_record(char *records, size_t *length, const char *key, const char *value) {
+  size_t payload = strlen(key) + strlen(value) + 3;
+  int digits = 1;
+
+  while(snprintf(NULL, 0, "%zu", payload + digits) != digits) {
+    digits++;
+  }
+
+  *length += (size_t)sprintf(records + *length, "%zu %s=%s\n", payload + digits, key, value);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  write_header
+    Description:  Writes the header of a member: a ustar header, preceded by a pax
+                 extended header when the name or size does not fit in it.
+                 Returns 1 on success, 0 on failure.
+   =====================================================================================
+*/
+static int write_header(const char *name, unsigned long long size, time_t mtime, char type, unsigned int mode) {
+  size_t length = strlen(name);
+  size_t prefix_length = 0;
+  int long_name = length > 100;
+
+  // Split at the first '/' that leaves at most 100 bytes for the name field
+  for(const char *slash = strchr(name, '/'); long_name && slash; slash = strchr(slash + 1, '/')) {
+    size_t before = (size_t)(slash - name);
+
+    if(length - before - 1 <= 100 && slash[1]) {
+      if(before <= 155) {
+        prefix_length = before;
+        long_name = 0;
+      }
+
+      break;
+    }
+  }
+
+  if(long_name || size > TAR_MAX_OCTAL_SIZE) {
+    char *records = malloc(length + 64);
+    size_t records_length = 0;
+    char size_text[32];
+
+    if(!records) {
+      console_error("Error: Failed to allocate memory for the pax header of %s\n", name);
+      archive.failed = 1;
+      return 0;
+    }
+
+    if(long_name) {
+      append_pax_record(records, &records_length, "path", name);
+    }
+
+    if(size > TAR_MAX_OCTAL_SIZE) {
+      snprintf(size_text, sizeof(size_text), "%llu", size);
+      append_pax_record(records, &records_length, "size", size_text);
+    }
+
+    int ok = write_block_header("PaxHeader", 0, records_length, mtime, 'x', 0644) &&
+             write_all(records, records_length) && write_padding(TAR_BLOCK_SIZE);
+    free(records);
+
+    if(!ok) {
+      return 0;
+    }
+  }
+
+  return write_block_header(name, prefix_length, size, mtime, type, mode);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  tar_begin
+    Description:  Starts an archive at 'path', written under a temporary name until
+                 tar_end(), or on the open descriptor 'fd' when 'path' is NULL,
+                 and adds the directories of the bundle layout. With
+                 'compress_threads' above 0 the archive is compressed into a
+                 zstd bundle by that many threads. Returns 1 on success, 0 on
+                 failure; call tar_end() either way.
+   =====================================================================================
+*/
+int tar_begin(const char *path, int fd, int compress_threads) {
+  static const char *directories[] = { "assets/", "assets/LUT/", "assets/stabilization_data/", "assets/alpha_transition/" };
+  archive.fd = fd;
+
+  if(path) {
+    archive.path = strdup(path);
+    archive.temporary = archive.path ? temporary_path(path) : NULL;
+    archive.fd = archive.temporary ? open(archive.temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+
+    if(archive.fd < 0) {
+      perror("Failed to create the tar archive");
+      free(archive.path);
+      free(archive.temporary);
+      archive.path = archive.temporary = NULL;
+      return 0;
+    }
+  }
+
+  if(compress_threads > 0) {
+    archive.compressed = 1;
+
+    if(!bundle_begin(archive.fd, compress_threads)) {
+      archive.failed = 1;
+      return 0;
+    }
+  }
+
+  time_t now = time(NULL);
+
+  for(size_t i = 0; i < sizeof(directories) / sizeof(directories[0]); i++) {
+    remember_name(directories[i]);
+
+    if(!write_header(directories[i], 0, now, '5', 0755)) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  tar_add_file
+    Description:  Appends the regular file 'source' as member 'name', hashing it for
+                 --checksum on the way. A file already in the archive (a LUT used
+                 by several filters) is not added twice. A source that shrinks
+                 while it is read is padded with zeros, so the archive stays
+                 readable, and reported. Returns 1 if the file was added, 0 if it
+                 was not or an error was reported.
+   =====================================================================================
+*/
+int tar_add_file(const char *source, const char *name) {
+  if(archive.failed || !remember_name(name)) {
+    return 0;
+  }
+
+  int in = open(source, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+
+  if(in < 0) {
+    console_perror("Failed to open source file");
+    return 0;
+  }
+
+  if(fstat(in, &st) != 0 || !S_ISREG(st.st_mode)) {
+    console_error("Error: %s is not a regular file; it is not archived.\n", source);
+    close(in);
+    return 0;
+  }
+
+  ChecksumState sum;
+  int hashing = copy_options.checksum != CHECKSUM_NONE;
+  off_t copied = 0;
+
+  if(hashing) {
+    checksum_init(&sum, copy_options.checksum);
+  }
+
+  if(!write_header(name, (unsigned long long)st.st_size, st.st_mtime, '0', 0644)) {
+    close(in);
+    return 0;
+  }
+
+  if(archive.compressed && !bundle_member(name, (unsigned long long)st.st_size)) {
+    archive.failed = 1;
+    close(in);
+    return 0;
+  }
+
+  int status = archive.compressed ? bundle_copy(in, st.st_size, hashing ? &sum : NULL, &copied) :
+               copy_to_stream(in, archive.fd, st.st_size, hashing ? &sum : NULL, &copied);
+  close(in);
+  archive.offset += (unsigned long long)copied;
+
+  if(status < 0) {
+    console_error("Error: Failed to archive %s: %s\n", source, strerror(errno));
+    archive.failed = 1;
+    return 0;
+  }
+
+  if(status == 0) {
+    static const char zeros[TAR_BLOCK_SIZE];
+    console_error("Error: %s shrank while it was archived; %s is padded with zeros.\n", source, name);
+
+    for(off_t left = st.st_size - copied; left > 0 && !archive.failed; left -= TAR_BLOCK_SIZE) {
+      write_all(zeros, left < TAR_BLOCK_SIZE ? (size_t)left : TAR_BLOCK_SIZE);
+    }
+
+    write_padding(TAR_BLOCK_SIZE);
+    return 0;
+  }
+
+  if(!write_padding(TAR_BLOCK_SIZE)) {
+    return 0;
+  }
+
+  if(hashing) {
+    char hex[CHECKSUM_HEX_MAX];
+    checksum_final(&sum, hex);
+    checksums_record(name, hex);
+  }
+
+  progress_file_done(name, (unsigned long long)st.st_size, (unsigned long long)copied, archive.compressed ? "zstd" : "tar");
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  tar_add_data
+    Description:  Appends 'size' bytes from memory as member 'name'.
+                 Returns 1 on success, 0 on failure.
+   =====================================================================================
+*/
+int tar_add_data(const char *name, const char *data, size_t size) {
+  if(archive.failed) {
+    return 0;
+  }
+
+  remember_name(name);
+
+  if(!write_header(name, size, time(NULL), '0', 0644)) {
+    return 0;
+  }
+
+  if(archive.compressed && !bundle_member(name, size)) {
+    archive.failed = 1;
+    return 0;
+  }
+
+  return write_all(data, size) && write_padding(TAR_BLOCK_SIZE);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  tar_end
+    Description:  Writes the two zero blocks that end the archive, padded to a whole
+                 record, finishes a zstd bundle with its index and seek table,
+                 and publishes an archive file once it is on disk. An
+                 archive that did not complete is removed. Returns 1 on success,
+                 0 on failure.
+   =====================================================================================
+*/
+int tar_end(int completed) {
+  static const char zeros[2 * TAR_BLOCK_SIZE];
+  int ok = completed && write_all(zeros, sizeof(zeros)) && write_padding(TAR_RECORD_SIZE);
+
+  // The bundle's workers are stopped even when the archive failed
+  if(archive.compressed) {
+    ok = bundle_end(ok) && ok;
+  }
+
+  if(archive.fd >= 0 && close(archive.fd) != 0 && ok) {
+    perror("Failed to write the tar archive");
+    ok = 0;
+  }
+
+  if(archive.path) {
+    if(ok) {
+      ok = publish_durably(archive.temporary, archive.path);
+    }
+
+    else {
+      unlink(archive.temporary);
+    }
+  }
+
+  for(size_t i = 0; i < archive.slot_count; i++) {
+    free(archive.names[i]);
+  }
+
+  free(archive.names);
+  free(archive.path);
+  free(archive.temporary);
+  memset(&archive, 0, sizeof(archive));
+  archive.fd = -1;
+  return ok;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  write_tar_bundle
+    Description:  Steps 6 and 7 for --output-format tar: appends the resources and
+                 the LUT, stabiliser and alpha-transition files of 'parsed', then
+                 puts the project together from its planned rewrites with
+                 render_project() and appends it as 'project_name', followed by
+                 its checksums with --checksum. The archive is written by this
+                 thread only, so the files are added one after another.
+                 Returns 1 on success, 0 on failure or if any asset failed.
+   =====================================================================================
+*/
+int write_tar_bundle(const ParsedProject *parsed, const char *input_file, const char *project_root,
+                     const char *project_name) {
+  // Step 6: Append the assets
+  for(size_t i = 0; i < parsed->resource_count && !archive.failed; i++) {
+    if(!is_duplicate_resource(parsed->resources[i])) {
+      copy_file_to_directory_with_context(parsed->resources[i], "assets", project_root, input_file);
+    }
+  }
+
+  for(size_t i = 0; i < parsed->extra_count && !archive.failed; i++) {
+    collect_extra(parsed->extras[i].path, parsed->extras[i].kind, "assets", project_root);
+  }
+
+  // Step 7: Write the project with its paths pointed into the bundle
+  size_t project_size;
+  char *project = render_project(parsed, &project_size);
+
+  if(!project) {
+    perror("Failed to allocate memory for the project file");
+    return 0;
+  }
+
+  int ok = tar_add_data(project_name, project, project_size);
+
+  // The checksum file follows the project and covers it too
+  if(ok && copy_options.checksum != CHECKSUM_NONE) {
+    ChecksumState sum;
+    char hex[CHECKSUM_HEX_MAX];
+    char *list = NULL;
+    size_t list_size = 0;
+    char *list_name = malloc(strlen(project_name) + sizeof(CHECKSUMS_SUFFIX));
+    checksum_init(&sum, copy_options.checksum);
+    checksum_update(&sum, project, project_size);
+    checksum_final(&sum, hex);
+    checksums_record(project_name, hex);
+    FILE *stream = open_memstream(&list, &list_size);
+
+    if(stream) {
+      checksums_print(stream);
+    }
+
+    ok = stream && fclose(stream) == 0 && list_name;
+
+    if(ok) {
+      sprintf(list_name, "%s%s", project_name, CHECKSUMS_SUFFIX);
+      ok = tar_add_data(list_name, list, list_size);
+    }
+
+    else {
+      perror("Failed to write checksums");
+    }
+
+    free(list);
+    free(list_name);
+  }
+
+  free(project);
+  // An archive whose project points at missing assets is discarded like a failed one
+  return ok && !archive.failed && copy_stats.failed_files == 0;
+}
@@ -0,0 +1,18 @@
+#ifndef TAR_OUTPUT_H
+#define TAR_OUTPUT_H
+
+#include <stddef.h>
+#include "parser.h"
+
+// Archive members are padded to whole blocks, the archive to whole records
+#define  TAR_BLOCK_SIZE   512
+#define  TAR_RECORD_SIZE  (20 * TAR_BLOCK_SIZE)
+
+int tar_begin(const char *path, int fd, int compress_threads);
+int tar_add_file(const char *source, const char *name);
+int tar_add_data(const char *name, const char *data, size_t size);
+int tar_end(int completed);
+int write_tar_bundle(const ParsedProject *parsed, const char *input_file, const char *project_root,
+                     const char *project_name);
+
+#endif // TAR_OUTPUT_H
@@ -0,0 +1,536 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "uring_copy.h"
+
+/*
+   Minimal io_uring ring built on the raw system calls, so no liburing is
+   needed at build time
+*/
+typedef struct {
+  int fd;
+  unsigned entries;
+  unsigned to_submit;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr;
+  void *cq_ptr;
+  size_t sq_len;
+  size_t cq_len;
+  size_t sqes_len;
+} Ring;
+
+// Operation encoded in the low bits of a request's user_data
+enum {
+  OP_OPEN_SOURCE = 0,
+  OP_OPEN_DESTINATION,
+  OP_READ,
+  OP_WRITE,
+  OP_CLOSE
+};
+
+/*
+   Per-file state while its batch is in flight
+*/
+typedef struct {
+  int in;
+  int out;
+  char *buffer;
+  off_t read_done;
+  off_t write_done;
+  int failed;
+} FileState;
+
+static pthread_once_t probe_once = PTHREAD_ONCE_INIT;
+static int uring_supported = 0;
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  ring_init
+    Description:  Creates an io_uring instance with room for 'entries' requests and
+                 maps its queues. Returns 1 on success, 0 if io_uring is not
+                 available (old kernel, seccomp, io_uring_disabled sysctl).
+   =====================================================================================
+*/
+static int ring_init(Ring *ring, unsigned entries) {
+  struct io_uring_params params;
+  memset(ring, 0, sizeof(*ring));
+  memset(&params, 0, sizeof(params));
+  ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+
+  if(ring->fd < 0) {
+    return 0;
+  }
+
+  ring->entries = params.sq_entries;
+  ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+  if(ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    if(ring->sq_ptr != MAP_FAILED) {
+      munmap(ring->sq_ptr, ring->sq_len);
+    }
+
+    if(ring->cq_ptr != MAP_FAILED) {
+      munmap(ring->cq_ptr, ring->cq_len);
+    }
+
+    if(ring->sqes != MAP_FAILED) {
+      munmap(ring->sqes, ring->sqes_len);
+    }
+
+    close(ring->fd);
+    return 0;
+  }
+
+  char *sq = ring->sq_ptr;
+  char *cq = ring->cq_ptr;
+  ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  ring_free
+    Description:  Unmaps the queues and closes the ring
+   =====================================================================================
+*/
+static void ring_free(Ring *ring) {
+  munmap(ring->sqes, ring->sqes_len);
+  munmap(ring->cq_ptr, ring->cq_len);
+  munmap(ring->sq_ptr, ring->sq_len);
+  close(ring->fd);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  ring_get_sqe
+    Description:  Returns a cleared submission entry, or NULL if the queue is full.
+                 The entry is published to the kernel by ring_submit_and_wait().
+   =====================================================================================
+*/
+static struct io_uring_sqe *ring_get_sqe(Ring *ring, unsigned long long user_data) {
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *ring->sq_tail + ring->to_submit;
+
+  if(tail - head >= ring->entries) {
+    return NULL;
+  }
+
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = user_data;
+  ring->sq_array[index] = index;
+  ring->to_submit++;
+  return sqe;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  ring_submit_and_wait
+    Description:  Submits all prepared entries with one io_uring_enter() and waits
+                 until 'wait_nr' completions are available. Returns 1 on success.
+   =====================================================================================
+*/
+static int ring_submit_and_wait(Ring *ring, unsigned wait_nr) {
+  __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->to_submit, __ATOMIC_RELEASE);
+  unsigned to_submit = ring->to_submit;
+  ring->to_submit = 0;
+
+  for(;;) {
+    int ret = (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr, IORING_ENTER_GETEVENTS, NULL, 0);
+
+    if(ret >= 0) {
+      return 1;
+    }
+
+    if(errno != EINTR) {
+      return 0;
+    }
+
+    to_submit = 0; // Entries were consumed before the interruption
+  }
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  ring_pop_cqe
+    Description:  Takes one completion off the queue. Returns 1 if one was
+                 available, 0 otherwise.
+   =====================================================================================
+*/
+static int ring_pop_cqe(Ring *ring, struct io_uring_cqe *cqe) {
+  unsigned head = *ring->cq_head;
+
+  if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+
+  *cqe = ring->cqes[head & *ring->cq_mask];
+  __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  probe_uring
+    Description:  Checks once per process that a ring can be created and that the
+                 kernel knows the open, read, write and close operations
+   =====================================================================================
+*/
+static void probe_uring(void) {
+  Ring ring;
+
+  if(!ring_init(&ring, 4)) {
+    return;
+  }
+
+  size_t probe_len = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, probe_len);
+
+  if(probe && syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0) {
+    const int needed[] = { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE };
+    uring_supported = 1;
+
+    for(size_t i = 0; i < sizeof(needed) / sizeof(needed[0]); ++i) {
+      if(needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+        uring_supported = 0;
+      }
+    }
+  }
+
+  free(probe);
+  ring_free(&ring);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  uring_copy_supported
+    Description:  Returns 1 if the io_uring backend can be used on this kernel
+   =====================================================================================
+*/
+int uring_copy_supported(void) {
+  pthread_once(&probe_once, probe_uring);
+  return uring_supported;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  size_changed
+    Description:  Returns 1 if the open source no longer has the size it was
+                 queued with (or cannot be checked). The batch only reads that
+                 many bytes, so such a file goes back to copy_file_contents(),
+                 which copies to end of file.
+   =====================================================================================
+*/
+static int size_changed(int in, off_t size) {
+  struct stat st;
+  return fstat(in, &st) != 0 || st.st_size != size;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  run_round
+    Description:  Submits one request per file that still needs operation 'op' and
+                 reaps all completions, updating the file states. Returns the number
+                 of requests that were submitted (0 means the stage is finished).
+   =====================================================================================
+*/
+static unsigned run_round(Ring *ring, UringCopy *copies, FileState *states, size_t count, int op) {
+  unsigned submitted = 0;
+
+  for(size_t i = 0; i < count; ++i) {
+    FileState *state = &states[i];
+    struct io_uring_sqe *sqe = NULL;
+
+    if(state->failed) {
+      continue;
+    }
+
+    if(op == OP_READ && state->read_done < copies[i].size) {
+      sqe = ring_get_sqe(ring, (unsigned long long)i << 3 | OP_READ);
+
+      if(sqe) {
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = state->in;
+        sqe->addr = (unsigned long)(state->buffer + state->read_done);
+        sqe->len = (unsigned)(copies[i].size - state->read_done);
+        sqe->off = (unsigned long long)state->read_done;
+      }
+    }
+
+    else if(op == OP_WRITE && state->write_done < state->read_done) {
+      sqe = ring_get_sqe(ring, (unsigned long long)i << 3 | OP_WRITE);
+
+      if(sqe) {
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = state->out;
+        sqe->addr = (unsigned long)(state->buffer + state->write_done);
+        sqe->len = (unsigned)(state->read_done - state->write_done);
+        sqe->off = (unsigned long long)state->write_done;
+      }
+    }
+
+    else {
+      continue;
+    }
+
+    if(!sqe) {
+      break; // Queue full; the rest goes in the next round
+    }
+
+    submitted++;
+  }
+
+  if(submitted == 0) {
+    return 0;
+  }
+
+  if(!ring_submit_and_wait(ring, submitted)) {
+    for(size_t i = 0; i < count; ++i) {
+      states[i].failed = 1;
+    }
+
+    return 0;
+  }
+
+  for(unsigned reaped = 0; reaped < submitted;) {
+    struct io_uring_cqe cqe;
+
+    if(!ring_pop_cqe(ring, &cqe)) {
+      if(!ring_submit_and_wait(ring, 1)) {
+        break;
+      }
+
+      continue;
+    }
+
+    reaped++;
+    FileState *state = &states[cqe.user_data >> 3];
+    UringCopy *copy = &copies[cqe.user_data >> 3];
+
+    if(cqe.res < 0) {
+      state->failed = 1;
+    }
+
+    else if((cqe.user_data & 7) == OP_READ) {
+      if(cqe.res == 0) {
+        copy->size = state->read_done; // File shrank since it was queued
+      }
+
+      state->read_done += cqe.res;
+    }
+
+    else if(cqe.res == 0) {
+      state->failed = 1; // A write that makes no progress would repeat forever
+    }
+
+    else {
+      state->write_done += cqe.res;
+    }
+  }
+
+  return submitted;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  uring_copy_batch
+    Description:  Copies a batch of small files from one thread. All opens are
+                 submitted with a single io_uring_enter(), then all reads, all
+                 writes and all closes, so a batch of N files costs a handful of
+                 system calls instead of ~6N. Every file is read whole into its own
+                 buffer, which is why only files up to URING_SMALL_FILE are queued.
+                 A source whose size changed since it was queued is not copied.
+                 Sets status to 1 for each file that was copied completely; files
+                 left at 0 (and their partial temporary files) are for the caller
+                 to redo through the regular copy path.
+   =====================================================================================
+*/
+void uring_copy_batch(UringCopy *copies, size_t count) {
+  Ring ring;
+  FileState *states = calloc(count, sizeof(FileState));
+
+  for(size_t i = 0; i < count; ++i) {
+    copies[i].status = 0;
+    copies[i].copied = 0;
+  }
+
+  if(!states || !ring_init(&ring, 2 * URING_BATCH)) {
+    free(states);
+    return;
+  }
+
+  // Round 1: open every source and destination
+  unsigned submitted = 0;
+
+  for(size_t i = 0; i < count; ++i) {
+    states[i].in = -1;
+    states[i].out = -1;
+    struct io_uring_sqe *sqe = ring_get_sqe(&ring, (unsigned long long)i << 3 | OP_OPEN_SOURCE);
+    struct io_uring_sqe *dqe = sqe ? ring_get_sqe(&ring, (unsigned long long)i << 3 | OP_OPEN_DESTINATION) : NULL;
+
+    if(!sqe || !dqe) {
+      states[i].failed = 1;
+      continue;
+    }
+
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)copies[i].source;
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    dqe->opcode = IORING_OP_OPENAT;
+    dqe->fd = AT_FDCWD;
+    dqe->addr = (unsigned long)copies[i].temporary;
+    dqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    dqe->len = 0666;
+    submitted += 2;
+  }
+
+  if(submitted > 0 && ring_submit_and_wait(&ring, submitted)) {
+    for(unsigned reaped = 0; reaped < submitted;) {
+      struct io_uring_cqe cqe;
+
+      if(!ring_pop_cqe(&ring, &cqe)) {
+        if(!ring_submit_and_wait(&ring, 1)) {
+          break;
+        }
+
+        continue;
+      }
+
+      reaped++;
+      FileState *state = &states[cqe.user_data >> 3];
+
+      if(cqe.res < 0) {
+        state->failed = 1;
+      }
+
+      else if((cqe.user_data & 7) == OP_OPEN_SOURCE) {
+        state->in = cqe.res;
+      }
+
+      else {
+        state->out = cqe.res;
+      }
+    }
+  }
+
+  for(size_t i = 0; i < count; ++i) {
+    if(states[i].in < 0 || states[i].out < 0 || size_changed(states[i].in, copies[i].size)) {
+      states[i].failed = 1;
+    }
+
+    else if(copies[i].size > 0 && !(states[i].buffer = malloc(copies[i].size))) {
+      states[i].failed = 1;
+    }
+  }
+
+  // Rounds 2 and 3: read every file whole, then write it out; short transfers repeat
+  while(run_round(&ring, copies, states, count, OP_READ) > 0) {
+  }
+
+  // A file that grew while it was read would otherwise be cut at its queued size
+  for(size_t i = 0; i < count; ++i) {
+    if(!states[i].failed && size_changed(states[i].in, states[i].read_done)) {
+      states[i].failed = 1;
+    }
+  }
+
+  // The whole file is in memory now, so the checksum costs no extra read
+  for(size_t i = 0; i < count; ++i) {
+    if(!states[i].failed && copies[i].checksum != CHECKSUM_NONE) {
+      ChecksumState sum;
+      checksum_init(&sum, copies[i].checksum);
+
+      if(states[i].read_done > 0) {
+        checksum_update(&sum, states[i].buffer, (size_t)states[i].read_done);
+      }
+
+      checksum_final(&sum, copies[i].hex);
+    }
+  }
+
+  while(run_round(&ring, copies, states, count, OP_WRITE) > 0) {
+  }
+
+  // Round 4: close everything that was opened
+  submitted = 0;
+
+  for(size_t i = 0; i < count; ++i) {
+    int fds[2] = { states[i].in, states[i].out };
+
+    for(int k = 0; k < 2; ++k) {
+      if(fds[k] < 0) {
+        continue;
+      }
+
+      struct io_uring_sqe *sqe = ring_get_sqe(&ring, (unsigned long long)i << 3 | OP_CLOSE);
+
+      if(!sqe) {
+        close(fds[k]);
+        continue;
+      }
+
+      sqe->opcode = IORING_OP_CLOSE;
+      sqe->fd = fds[k];
+      submitted++;
+    }
+
+    if(!states[i].failed && states[i].write_done == copies[i].size) {
+      copies[i].status = 1;
+      copies[i].copied = states[i].write_done;
+    }
+
+    free(states[i].buffer);
+  }
+
+  if(submitted > 0 && ring_submit_and_wait(&ring, submitted)) {
+    struct io_uring_cqe cqe;
+
+    for(unsigned reaped = 0; reaped < submitted;) {
+      if(ring_pop_cqe(&ring, &cqe)) {
+        reaped++;
+
+        if(cqe.res < 0) {
+          copies[cqe.user_data >> 3].status = 0; // A failed close may have lost data
+        }
+      }
+
+      else if(!ring_submit_and_wait(&ring, 1)) {
+        break;
+      }
+    }
+  }
+
+  ring_free(&ring);
+  free(states);
+}
@@ -0,0 +1,34 @@
+#ifndef URING_COPY_H
+#define URING_COPY_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include "hash.h"
+
+// Files up to this size are batched through io_uring; larger ones use copy_file_range()
+#define  URING_SMALL_FILE   (8 * 1024 * 1024)
+// Maximum number of files and bytes in flight in one batch
+#define  URING_BATCH        64
+#define  URING_BATCH_BYTES  (64 * 1024 * 1024)
+
+/*
+   One small-file copy in an io_uring batch. The data is written to 'temporary';
+   renaming it to 'destination' is left to the caller. 'status' is 1 once the
+   file was copied completely and 0 if the caller has to copy it another way.
+   Unless 'checksum' is CHECKSUM_NONE, 'hex' receives the checksum of the data.
+*/
+typedef struct {
+  char *source;
+  char *destination;
+  char *temporary;
+  off_t size;
+  off_t copied;
+  int status;
+  ChecksumAlgorithm checksum;
+  char hex[CHECKSUM_HEX_MAX];
+} UringCopy;
+
+int uring_copy_supported(void);
+void uring_copy_batch(UringCopy *copies, size_t count);
+
+#endif // URING_COPY_H
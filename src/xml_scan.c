@@ -0,0 +1,612 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include "xml_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define XML_SCAN_X86 1
+#endif
+
+/*
+   A single pass over an MLT project in memory. It jumps from one '<' to the
+   next, skips comments, processing instructions and CDATA, and reads each
+   tag up to the '>' that is not inside a quoted attribute, so tags may span
+   lines and a line may hold several elements. Open <chain>, <producer> and
+   <transition> elements are counted as their start and end tags go by, and
+   every resource, av.file and filename property is handed to the caller with
+   pointers into the buffer. Nothing is allocated or copied.
+
+   The positions of '<', '>' and quotes come from a ScanIndex: the buffer is
+   classified 64 bytes at a time into one bitmask per character, with AVX2,
+   SSE2 or 8-byte words (picked once at run time), and the next '<' is the
+   lowest bit set past the current position. Most of a Shotcut project is
+   <property name="meta.media..."> lines: a tag that starts with exactly
+   '<property name="' is judged by the first 8 bytes of its key and, when the
+   collector has no use for it, skipped together with its value and
+   </property> without reading its attributes.
+*/
+
+#define SCAN_BLOCK_SIZE  64
+
+// Bit i is set when byte i of the block is '<', '>', or a quote
+typedef struct {
+  uint64_t open;
+  uint64_t close;
+  uint64_t quote;
+} BlockMasks;
+
+typedef void (*ClassifyFunction)(const char *block, BlockMasks *masks);
+
+/*
+   Where xml_scan_properties() is in the buffer: the block at 'block' (up to
+   SCAN_BLOCK_SIZE bytes, fewer at the end) and its masks. It only moves
+   forward; a search past the block classifies the block at that position.
+*/
+typedef struct {
+  const char *end;
+  const char *block;
+  BlockMasks masks;
+} ScanIndex;
+
+static const char PROPERTY_TAG[] = "<property name=\"";
+static const char PROPERTY_END_TAG[] = "</property>";
+#define PROPERTY_TAG_LENGTH      (sizeof(PROPERTY_TAG) - 1)
+#define PROPERTY_END_TAG_LENGTH  (sizeof(PROPERTY_END_TAG) - 1)
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  word_matches
+    Description:  Returns the bytes of 'word' equal to 'c' as the low 8 bits, byte 0
+                 of the block first. Exact for every byte, unlike the usual
+                 has-zero-byte test.
+   =====================================================================================
+*/
+static uint64_t word_matches(uint64_t word, char c) {
+  const uint64_t low7 = 0x7F7F7F7F7F7F7F7FULL;
+  uint64_t x = word ^ (0x0101010101010101ULL * (unsigned char)c);
+  uint64_t zero = ~(((x & low7) + low7) | x | low7);
+  // Gather the high bit of every byte, byte 0 into bit 0
+  return ((zero >> 7) * 0x0102040810204080ULL) >> 56;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  classify_scalar
+    Description:  Fills 'masks' for 64 bytes, 8 at a time in ordinary registers
+   =====================================================================================
+*/
+static void classify_scalar(const char *block, BlockMasks *masks) {
+  masks->open = 0;
+  masks->close = 0;
+  masks->quote = 0;
+
+  for(int i = 0; i < SCAN_BLOCK_SIZE; i += 8) {
+    uint64_t word;
+    memcpy(&word, block + i, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    masks->open |= word_matches(word, '<') << i;
+    masks->close |= word_matches(word, '>') << i;
+    masks->quote |= (word_matches(word, '"') | word_matches(word, '\'')) << i;
+  }
+}
+
+#ifdef XML_SCAN_X86
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  classify_sse2
+    Description:  Fills 'masks' for 64 bytes, 16 at a time with SSE2
+   =====================================================================================
+*/
+__attribute__((target("sse2")))
+static void classify_sse2(const char *block, BlockMasks *masks) {
+  const __m128i open = _mm_set1_epi8('<');
+  const __m128i close = _mm_set1_epi8('>');
+  const __m128i double_quote = _mm_set1_epi8('"');
+  const __m128i single_quote = _mm_set1_epi8('\'');
+  masks->open = 0;
+  masks->close = 0;
+  masks->quote = 0;
+
+  for(int i = 0; i < SCAN_BLOCK_SIZE; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(block + i));
+    __m128i quotes = _mm_or_si128(_mm_cmpeq_epi8(chunk, double_quote), _mm_cmpeq_epi8(chunk, single_quote));
+    masks->open |= (uint64_t)(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, open)) << i;
+    masks->close |= (uint64_t)(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, close)) << i;
+    masks->quote |= (uint64_t)(unsigned int)_mm_movemask_epi8(quotes) << i;
+  }
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  classify_avx2
+    Description:  Fills 'masks' for 64 bytes, 32 at a time with AVX2
+   =====================================================================================
+*/
+__attribute__((target("avx2")))
+static void classify_avx2(const char *block, BlockMasks *masks) {
+  const __m256i open = _mm256_set1_epi8('<');
+  const __m256i close = _mm256_set1_epi8('>');
+  const __m256i double_quote = _mm256_set1_epi8('"');
+  const __m256i single_quote = _mm256_set1_epi8('\'');
+  __m256i low = _mm256_loadu_si256((const __m256i *)block);
+  __m256i high = _mm256_loadu_si256((const __m256i *)(block + 32));
+  __m256i low_quotes = _mm256_or_si256(_mm256_cmpeq_epi8(low, double_quote), _mm256_cmpeq_epi8(low, single_quote));
+  __m256i high_quotes = _mm256_or_si256(_mm256_cmpeq_epi8(high, double_quote), _mm256_cmpeq_epi8(high, single_quote));
+  masks->open = (uint64_t)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, open)) |
+                (uint64_t)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(high, open)) << 32;
+  masks->close = (uint64_t)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, close)) |
+                 (uint64_t)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(high, close)) << 32;
+  masks->quote = (uint64_t)(unsigned int)_mm256_movemask_epi8(low_quotes) |
+                 (uint64_t)(unsigned int)_mm256_movemask_epi8(high_quotes) << 32;
+}
+#endif
+
+// The classifier xml_scan_properties() uses, set by xml_scan_use_level()
+static ClassifyFunction classify = NULL;
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  xml_scan_best_level
+    Description:  Returns the widest search this CPU supports
+   =====================================================================================
+*/
+XmlScanLevel xml_scan_best_level(void) {
+#ifdef XML_SCAN_X86
+  __builtin_cpu_init();
+
+  if(__builtin_cpu_supports("avx2")) {
+    return XML_SCAN_AVX2;
+  }
+
+  if(__builtin_cpu_supports("sse2")) {
+    return XML_SCAN_SSE2;
+  }
+#endif
+  return XML_SCAN_SCALAR;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  xml_scan_use_level
+    Description:  Makes xml_scan_properties() search with 'level'. Returns 1 on
+                 success, 0 if this CPU does not support it.
+   =====================================================================================
+*/
+int xml_scan_use_level(XmlScanLevel level) {
+  if(level > xml_scan_best_level()) {
+    return 0;
+  }
+
+  switch(level) {
+#ifdef XML_SCAN_X86
+    case XML_SCAN_AVX2:
+      classify = classify_avx2;
+      break;
+
+    case XML_SCAN_SSE2:
+      classify = classify_sse2;
+      break;
+#endif
+
+    default:
+      classify = classify_scalar;
+      break;
+  }
+
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  xml_scan_level_name
+    Description:  Returns the name of a search level used in messages
+   =====================================================================================
+*/
+const char *xml_scan_level_name(XmlScanLevel level) {
+  switch(level) {
+    case XML_SCAN_AVX2:
+      return "avx2";
+
+    case XML_SCAN_SSE2:
+      return "sse2";
+
+    default:
+      return "scalar";
+  }
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  index_block
+    Description:  Makes the block starting at 'p' the current one. The last block
+                 of the buffer is copied into zeroed space first, so nothing past
+                 'end' is read or matched.
+   =====================================================================================
+*/
+static void index_block(ScanIndex *index, const char *p) {
+  index->block = p;
+
+  if(index->end - p >= SCAN_BLOCK_SIZE) {
+    classify(p, &index->masks);
+    return;
+  }
+
+  char tail[SCAN_BLOCK_SIZE] = {0};
+  memcpy(tail, p, index->end - p);
+  classify(tail, &index->masks);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  index_find
+    Description:  Returns the first byte at or after 'p' whose bit is set in the mask
+                 chosen by 'select', or NULL if the buffer ends first
+   =====================================================================================
+*/
+static inline const char *index_find(ScanIndex *index, const char *p, uint64_t (*select)(const BlockMasks *)) {
+  while(p < index->end) {
+    if(p < index->block || p >= index->block + SCAN_BLOCK_SIZE) {
+      index_block(index, p);
+    }
+
+    uint64_t bits = select(&index->masks) & (~0ULL << (p - index->block));
+
+    if(bits) {
+      return index->block + __builtin_ctzll(bits);
+    }
+
+    p = index->block + SCAN_BLOCK_SIZE;
+  }
+
+  return NULL;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  open_bits
+    Description:  index_find() selector for '<'
+   =====================================================================================
+*/
+static inline uint64_t open_bits(const BlockMasks *masks) {
+  return masks->open;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  quote_bits
+    Description:  index_find() selector for quotes
+   =====================================================================================
+*/
+static inline uint64_t quote_bits(const BlockMasks *masks) {
+  return masks->quote;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  tag_bits
+    Description:  index_find() selector for the '>' and quotes that end or open
+                 something inside a tag
+   =====================================================================================
+*/
+static inline uint64_t tag_bits(const BlockMasks *masks) {
+  return masks->close | masks->quote;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  is_name_end
+    Description:  Tells whether 'c' ends an element or attribute name
+   =====================================================================================
+*/
+static int is_name_end(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '/' || c == '>' || c == '=';
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  name_is
+    Description:  Tells whether the 'length' bytes at 'name' are the name 'expected'
+   =====================================================================================
+*/
+static int name_is(const char *name, size_t length, const char *expected) {
+  return strlen(expected) == length && memcmp(name, expected, length) == 0;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  load64
+    Description:  Returns the 8 bytes at 'p' as one word, for prefix compares
+   =====================================================================================
+*/
+static uint64_t load64(const char *p) {
+  uint64_t word;
+  memcpy(&word, p, sizeof(word));
+  return word;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  skip_past
+    Description:  Returns the byte after the first 'terminator' at or after 'p', or
+                 'end' if the buffer ends first
+   =====================================================================================
+*/
+static const char *skip_past(const char *p, const char *end, const char *terminator) {
+  const char *found = memmem(p, end - p, terminator, strlen(terminator));
+  return found ? found + strlen(terminator) : end;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  tag_end
+    Description:  Returns the '>' that closes the tag whose attributes start at 'p',
+                 skipping quoted attribute values, or NULL if the buffer ends first
+   =====================================================================================
+*/
+static const char *tag_end(ScanIndex *index, const char *p) {
+  while((p = index_find(index, p, tag_bits)) != NULL) {
+    if(*p == '>') {
+      return p;
+    }
+
+    // The value runs to the next quote of the same kind
+    const char *quote = p;
+
+    do {
+      quote = index_find(index, quote + 1, quote_bits);
+    }
+    while(quote && *quote != *p);
+
+    if(!quote) {
+      return NULL;
+    }
+
+    p = quote + 1;
+  }
+
+  return NULL;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  property_kind
+    Description:  Reads the name attribute of the <property> tag whose attributes run
+                 from 'p' to 'end' and stores the kind it names in '*kind'.
+                 Returns 1 for a property the collector wants, 0 otherwise.
+   =====================================================================================
+*/
+static int property_kind(const char *p, const char *end, XmlPropertyKind *kind) {
+  while(p < end) {
+    while(p < end && is_name_end(*p) && *p != '=') {
+      p++;
+    }
+
+    const char *attribute = p;
+
+    while(p < end && !is_name_end(*p)) {
+      p++;
+    }
+
+    size_t attribute_length = p - attribute;
+
+    while(p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r' || *p == '=')) {
+      p++;
+    }
+
+    if(p >= end || (*p != '"' && *p != '\'')) {
+      return 0;
+    }
+
+    const char *value = p + 1;
+    const char *quote = memchr(value, *p, end - value);
+
+    if(!quote) {
+      return 0;
+    }
+
+    p = quote + 1;
+
+    if(!name_is(attribute, attribute_length, "name")) {
+      continue;
+    }
+
+    size_t length = quote - value;
+
+    if(name_is(value, length, "resource")) {
+      *kind = XML_PROPERTY_RESOURCE;
+    }
+
+    else if(name_is(value, length, "av.file")) {
+      *kind = XML_PROPERTY_AV_FILE;
+    }
+
+    else if(name_is(value, length, "filename")) {
+      *kind = XML_PROPERTY_FILENAME;
+    }
+
+    else {
+      return 0;
+    }
+
+    return 1;
+  }
+
+  return 0;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  skip_unwanted_property
+    Description:  Fast path for a tag at 'p' that starts with '<property name="':
+                 when the first bytes of its key rule out resource, av.file and
+                 filename, returns the position after the property's value and
+                 its </property>. Returns NULL when the tag needs the full parse.
+   =====================================================================================
+*/
+static const char *skip_unwanted_property(ScanIndex *index, const char *p) {
+  const char *key = p + PROPERTY_TAG_LENGTH;
+  uint64_t prefix = load64(key);
+
+  if(prefix == load64("av.file\"") || ((prefix == load64("resource") || prefix == load64("filename")) && key[8] == '"')) {
+    return NULL;
+  }
+
+  const char *quote = key;
+
+  do {
+    quote = index_find(index, quote, quote_bits);
+  }
+  while(quote && *quote++ != '"');
+
+  const char *close = quote ? tag_end(index, quote) : NULL;
+
+  if(!close) {
+    return index->end;
+  }
+
+  if(close[-1] == '/') {
+    return close + 1;
+  }
+
+  const char *value_end = index_find(index, close + 1, open_bits);
+
+  if(!value_end) {
+    return index->end;
+  }
+
+  if((size_t)(index->end - value_end) >= PROPERTY_END_TAG_LENGTH &&
+     memcmp(value_end, PROPERTY_END_TAG, PROPERTY_END_TAG_LENGTH) == 0) {
+    return value_end + PROPERTY_END_TAG_LENGTH;
+  }
+
+  return value_end;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  xml_scan_properties
+    Description:  Walks the 'size' bytes of the project at 'data' once and calls
+                 'handler' with 'context' for every resource, av.file and filename
+                 property that has a start and an end tag, in document order.
+                 Returns 1 when the whole buffer was scanned, 0 if 'handler'
+                 stopped the scan.
+   =====================================================================================
+*/
+int xml_scan_properties(const char *data, size_t size, XmlPropertyHandler handler, void *context) {
+  const char *end = data + size;
+  const char *p = data;
+  int producers = 0;
+  int transitions = 0;
+
+  if(!classify) {
+    xml_scan_use_level(xml_scan_best_level());
+  }
+
+  if(size == 0) {
+    return 1;
+  }
+
+  ScanIndex index;
+  index.end = end;
+  index_block(&index, data);
+
+  while(p < end && (p = index_find(&index, p, open_bits)) != NULL) {
+    const char *tag = p + 1;
+
+    // The key and the byte after it must be in the buffer for the prefix compare
+    if((size_t)(end - p) >= PROPERTY_TAG_LENGTH + 9 && memcmp(p, PROPERTY_TAG, PROPERTY_TAG_LENGTH) == 0) {
+      const char *next = skip_unwanted_property(&index, p);
+
+      if(next) {
+        p = next;
+        continue;
+      }
+    }
+
+    if(tag >= end) {
+      break;
+    }
+
+    if(end - tag >= 3 && memcmp(tag, "!--", 3) == 0) {
+      p = skip_past(tag + 3, end, "-->");
+      continue;
+    }
+
+    if(end - tag >= 8 && memcmp(tag, "![CDATA[", 8) == 0) {
+      p = skip_past(tag + 8, end, "]]>");
+      continue;
+    }
+
+    if(*tag == '?') {
+      p = skip_past(tag + 1, end, "?>");
+      continue;
+    }
+
+    int closing = *tag == '/';
+    const char *name = tag + closing;
+    const char *name_end = name;
+
+    while(name_end < end && !is_name_end(*name_end)) {
+      name_end++;
+    }
+
+    const char *close = tag_end(&index, name_end);
+
+    if(!close) {
+      break;
+    }
+
+    size_t name_length = name_end - name;
+    int empty = !closing && close[-1] == '/';
+    p = close + 1;
+
+    if(name_is(name, name_length, "chain") || name_is(name, name_length, "producer")) {
+      if(closing && producers > 0) {
+        producers--;
+      }
+
+      else if(!closing && !empty) {
+        producers++;
+      }
+    }
+
+    else if(name_is(name, name_length, "transition")) {
+      if(closing && transitions > 0) {
+        transitions--;
+      }
+
+      else if(!closing && !empty) {
+        transitions++;
+      }
+    }
+
+    else if(!closing && !empty && name_is(name, name_length, "property")) {
+      XmlProperty property;
+
+      if(!property_kind(name_end, close, &property.kind)) {
+        continue;
+      }
+
+      const char *value_end = index_find(&index, p, open_bits);
+
+      if(!value_end) {
+        break;
+      }
+
+      property.value = p;
+      property.length = value_end - p;
+      property.in_producer = producers > 0;
+      property.in_transition = transitions > 0;
+      p = value_end;
+
+      if(!handler(&property, context)) {
+        return 0;
+      }
+    }
+  }
+
+  return 1;
+}
@@ -0,0 +1,42 @@
+#ifndef XML_SCAN_H
+#define XML_SCAN_H
+
+#include <stddef.h>
+
+// The properties of a project that name files the collector copies
+typedef enum {
+  XML_PROPERTY_RESOURCE = 0,  // <property name="resource">: media, or an alpha transition's matte
+  XML_PROPERTY_AV_FILE,       // <property name="av.file">: a LUT
+  XML_PROPERTY_FILENAME       // <property name="filename">: stabilisation data
+} XmlPropertyKind;
+
+/*
+   One property found by xml_scan_properties(). 'value' points at its text in
+   the scanned buffer and is not NUL-terminated; it runs up to the next '<'.
+   'in_producer' and 'in_transition' tell whether a <chain> or <producer>, or
+   a <transition>, is open around it at any depth.
+*/
+typedef struct {
+  XmlPropertyKind kind;
+  const char *value;
+  size_t length;
+  int in_producer;
+  int in_transition;
+} XmlProperty;
+
+// Called for every property; returns 1 to go on scanning, 0 to stop
+typedef int (*XmlPropertyHandler)(const XmlProperty *property, void *context);
+
+// How the scan searches for '<', '>' and quotes: the best one is used unless set
+typedef enum {
+  XML_SCAN_SCALAR = 0,
+  XML_SCAN_SSE2,
+  XML_SCAN_AVX2
+} XmlScanLevel;
+
+XmlScanLevel xml_scan_best_level(void);
+int xml_scan_use_level(XmlScanLevel level);
+const char *xml_scan_level_name(XmlScanLevel level);
+int xml_scan_properties(const char *data, size_t size, XmlPropertyHandler handler, void *context);
+
+#endif // XML_SCAN_H
@@ -0,0 +1,1008 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "zstd_bundle.h"
+#include "copy_engine.h"
+#include "logging.h"
+#include "progress.h"
+
+/*
+   --output-format zstd compresses the tar stream of tar_output.c into a
+   seekable zstd bundle:
+
+     data frames   zstd frames that decompress, one after another, into the
+                   tar archive, so "zstd -dc bundle.tar.zst | tar -x" unpacks it
+     index         skippable frame: "SPCI", the member count, then for every
+                   member its offset and size in the tar stream and its name
+     seek table    skippable frame in the zstd seekable format: the compressed
+                   size, decompressed size and XXH64 checksum of every frame
+
+   The data of every member starts a new frame and no frame holds more than
+   BUNDLE_FRAME_SIZE bytes, so `extract` reads the index and the seek table
+   and decompresses only the frames of the member it is asked for. Worker
+   threads compress frames while the main thread reads the next ones, and
+   the main thread writes them in order. Media that are compressed already
+   (h264, webm, JPEG, MP3, ...) are stored in raw zstd blocks, which costs no
+   CPU; without libzstd every frame is stored.
+*/
+
+#define  ZSTD_FRAME_MAGIC   0xFD2FB528U
+// Frame header descriptor of a stored frame: single segment, 4-byte content size
+#define  STORED_DESCRIPTOR  0xA0
+#define  RAW_BLOCK_SIZE     (128 * 1024)
+#define  INDEX_TAG          "SPCI"
+
+// One frame on its way through the workers: 'data' in, 'frame' out
+typedef struct {
+  unsigned char *data;
+  size_t size;
+  int compress;
+  int stored;
+  unsigned char *frame;
+  size_t frame_size;
+  uint32_t checksum;
+  int done;
+} BundleFrame;
+
+// A seek table entry
+typedef struct {
+  uint32_t compressed;
+  uint32_t decompressed;
+  uint32_t checksum;
+} SeekEntry;
+
+// An index entry: where a member's data lies in the tar stream
+typedef struct {
+  unsigned long long offset;
+  unsigned long long size;
+  char *name;
+} IndexEntry;
+
+/*
+   The bundle being written. Frames are numbered in the order the main
+   thread fills them; slot 'n % depth' holds frame n. A worker takes frame
+   'next_compress' once the main thread has moved 'next_fill' past it, and
+   the main thread writes frame 'next_write' once it is done.
+*/
+typedef struct {
+  int fd;
+  int failed;
+  BundleFrame *frames;
+  size_t depth;
+  size_t frame_capacity;
+  size_t next_fill;
+  size_t next_compress;
+  size_t next_write;
+  int compress;
+  unsigned long long offset;
+  unsigned long long written;
+  size_t stored_frames;
+  SeekEntry *seek;
+  size_t seek_count;
+  size_t seek_capacity;
+  IndexEntry *index;
+  size_t index_count;
+  size_t index_capacity;
+  pthread_t threads[BUNDLE_MAX_THREADS];
+  int thread_count;
+  int stop;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+} Bundle;
+
+static Bundle bundle;
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  put_le32
+    Description:  Stores a 32-bit value little-endian
+   =====================================================================================
+*/
+static void put_le32(unsigned char *p, uint32_t value) {
+  p[0] = (unsigned char)value;
+  p[1] = (unsigned char)(value >> 8);
+  p[2] = (unsigned char)(value >> 16);
+  p[3] = (unsigned char)(value >> 24);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  put_le64
+    Description:  Stores a 64-bit value little-endian
+   =====================================================================================
+*/
+static void put_le64(unsigned char *p, uint64_t value) {
+  put_le32(p, (uint32_t)value);
+  put_le32(p + 4, (uint32_t)(value >> 32));
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  get_le32
+    Description:  Loads a little-endian 32-bit value
+   =====================================================================================
+*/
+static uint32_t get_le32(const unsigned char *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  get_le64
+    Description:  Loads a little-endian 64-bit value
+   =====================================================================================
+*/
+static uint64_t get_le64(const unsigned char *p) {
+  return (uint64_t)get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  worth_compressing
+    Description:  Tells whether a member is worth compressing. Video, audio and
+                 images in compressed formats shrink by a percent or two at most,
+                 so they are stored.
+   =====================================================================================
+*/
+static int worth_compressing(const char *name) {
+  static const char *compressed[] = {
+    "mp4", "m4v", "mov", "mkv", "webm", "avi", "mts", "m2ts", "ts", "mpg", "mpeg", "mxf",
+    "mp3", "m4a", "aac", "ogg", "oga", "opus", "flac",
+    "jpg", "jpeg", "png", "webp", "gif", "heic", "avif",
+    "zip", "gz", "xz", "zst", "7z"
+  };
+  const char *dot = strrchr(name, '.');
+
+  if(!dot || strchr(dot, '/')) {
+    return 1;
+  }
+
+  for(size_t i = 0; i < sizeof(compressed) / sizeof(compressed[0]); i++) {
+    if(strcasecmp(dot + 1, compressed[i]) == 0) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  stored_frame_bound
+    Description:  Size of a stored frame of 'size' bytes at most
+   =====================================================================================
+*/
+static size_t stored_frame_bound(size_t size) {
+  return 9 + (size / RAW_BLOCK_SIZE + 1) * 3 + size;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  store_frame
+    Description:  Writes 'data' to 'out' as a zstd frame of raw blocks, which any
+                 zstd decoder reads. Returns the frame size.
+   =====================================================================================
+*/
+static size_t store_frame(const unsigned char *data, size_t size, unsigned char *out) {
+  unsigned char *p = out + 9;
+  size_t done = 0;
+  put_le32(out, ZSTD_FRAME_MAGIC);
+  out[4] = STORED_DESCRIPTOR;
+  put_le32(out + 5, (uint32_t)size);
+
+  do {
+    size_t block = size - done < RAW_BLOCK_SIZE ? size - done : RAW_BLOCK_SIZE;
+    // Block type 0 (raw) in bits 1-2, the last block flag in bit 0
+    uint32_t header = (uint32_t)block << 3 | (done + block == size);
+    p[0] = (unsigned char)header;
+    p[1] = (unsigned char)(header >> 8);
+    p[2] = (unsigned char)(header >> 16);
+    memcpy(p + 3, data + done, block);
+    p += 3 + block;
+    done += block;
+  }
+  while(done < size);
+
+  return (size_t)(p - out);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  read_stored_frame
+    Description:  Decodes a frame written by store_frame() into 'out'. Returns the
+                 decoded size, or -1 if it is not such a frame.
+   =====================================================================================
+*/
+static ssize_t read_stored_frame(const unsigned char *frame, size_t frame_size, unsigned char *out, size_t capacity) {
+  if(frame_size < 9 || get_le32(frame) != ZSTD_FRAME_MAGIC || frame[4] != STORED_DESCRIPTOR ||
+     get_le32(frame + 5) > capacity) {
+    return -1;
+  }
+
+  size_t content = get_le32(frame + 5);
+  size_t done = 0;
+  const unsigned char *p = frame + 9;
+  const unsigned char *end = frame + frame_size;
+
+  for(;;) {
+    if(end - p < 3) {
+      return -1;
+    }
+
+    uint32_t header = (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16;
+    size_t block = header >> 3;
+
+    if((header >> 1 & 3) != 0 || block > (size_t)(end - p - 3) || done + block > content) {
+      return -1;
+    }
+
+    memcpy(out + done, p + 3, block);
+    done += block;
+    p += 3 + block;
+
+    if(header & 1) {
+      break;
+    }
+  }
+
+  return done == content ? (ssize_t)done : -1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  frame_checksum
+    Description:  The seek table checksum: the low 32 bits of the XXH64 of the data
+   =====================================================================================
+*/
+static uint32_t frame_checksum(const unsigned char *data, size_t size) {
+  Xxh64State state;
+  xxh64_init(&state, 0);
+  xxh64_update(&state, data, size);
+  return (uint32_t)xxh64_digest(&state);
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  encode_frame
+    Description:  Compresses a frame, or stores it when it is not worth compressing
+                 or does not shrink. 'context' is the worker's zstd context.
+   =====================================================================================
+*/
+static void encode_frame(BundleFrame *frame, void *context) {
+  frame->checksum = frame_checksum(frame->data, frame->size);
+  frame->frame_size = 0;
+#ifdef HAVE_ZSTD
+
+  if(frame->compress && context) {
+    size_t n = ZSTD_compressCCtx(context, frame->frame, bundle.frame_capacity, frame->data, frame->size, BUNDLE_ZSTD_LEVEL);
+
+    if(!ZSTD_isError(n) && n < frame->size) {
+      frame->frame_size = n;
+    }
+  }
+
+#else
+  (void)context;
+#endif
+  frame->stored = frame->frame_size == 0;
+
+  if(frame->stored) {
+    frame->frame_size = store_frame(frame->data, frame->size, frame->frame);
+  }
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  bundle_worker
+    Description:  Thread body: encodes frames in order until bundle_end() stops the
+                 workers and no frame is left
+   =====================================================================================
+*/
+static void *bundle_worker(void *arg) {
+  void *context = NULL;
+  (void)arg;
+#ifdef HAVE_ZSTD
+  context = ZSTD_createCCtx();
+#endif
+  pthread_mutex_lock(&bundle.lock);
+
+  for(;;) {
+    while(!bundle.stop && bundle.next_compress == bundle.next_fill) {
+      pthread_cond_wait(&bundle.work, &bundle.lock);
+    }
+
+    if(bundle.next_compress == bundle.next_fill) {
+      break;
+    }
+
+    BundleFrame *frame = &bundle.frames[bundle.next_compress++ % bundle.depth];
+    pthread_mutex_unlock(&bundle.lock);
+    encode_frame(frame, context);
+    pthread_mutex_lock(&bundle.lock);
+    frame->done = 1;
+    pthread_cond_broadcast(&bundle.done);
+  }
+
+  pthread_mutex_unlock(&bundle.lock);
+#ifdef HAVE_ZSTD
+  ZSTD_freeCCtx(context);
+#endif
+  return NULL;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  write_bytes
+    Description:  Writes 'size' bytes to the bundle, retrying short writes. The first
+                 error is reported and fails the bundle. Returns 1 on success.
+   =====================================================================================
+*/
+static int write_bytes(const void *data, size_t size) {
+  const char *bytes = data;
+
+  while(!bundle.failed && size > 0) {
+    ssize_t n = write(bundle.fd, bytes, size);
+
+    if(n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if(n <= 0) {
+      console_perror("Failed to write the zstd bundle");
+      bundle.failed = 1;
+      break;
+    }
+
+    bytes += n;
+    size -= (size_t)n;
+    bundle.written += (unsigned long long)n;
+  }
+
+  return !bundle.failed;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  write_frames
+    Description:  Writes finished frames in order. Waits for frames until at most
+                 'pending' filled frames are left unwritten, then writes those that
+                 are already done without waiting.
+   =====================================================================================
+*/
+static void write_frames(size_t pending) {
+  while(bundle.next_write < bundle.next_fill) {
+    BundleFrame *frame = &bundle.frames[bundle.next_write % bundle.depth];
+    pthread_mutex_lock(&bundle.lock);
+
+    if(!frame->done && bundle.next_fill - bundle.next_write <= pending) {
+      pthread_mutex_unlock(&bundle.lock);
+      break;
+    }
+
+    while(!frame->done) {
+      pthread_cond_wait(&bundle.done, &bundle.lock);
+    }
+
+    frame->done = 0;
+    pthread_mutex_unlock(&bundle.lock);
+
+    if(bundle.seek_count == bundle.seek_capacity) {
+      size_t capacity = bundle.seek_capacity ? bundle.seek_capacity * 2 : 256;
+      SeekEntry *seek = realloc(bundle.seek, capacity * sizeof(SeekEntry));
+
+      if(!seek) {
+        console_error("Error: Failed to allocate memory for the seek table\n");
+        bundle.failed = 1;
+      }
+
+      else {
+        bundle.seek = seek;
+        bundle.seek_capacity = capacity;
+      }
+    }
+
+    if(write_bytes(frame->frame, frame->frame_size)) {
+      SeekEntry *entry = &bundle.seek[bundle.seek_count++];
+      entry->compressed = (uint32_t)frame->frame_size;
+      entry->decompressed = (uint32_t)frame->size;
+      entry->checksum = frame->checksum;
+      bundle.stored_frames += frame->stored;
+    }
+
+    bundle.next_write++;
+  }
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  submit_frame
+    Description:  Hands the frame being filled to the workers, if it holds any data,
+                 and makes sure the slot of the next one is free
+   =====================================================================================
+*/
+static void submit_frame(void) {
+  BundleFrame *frame = &bundle.frames[bundle.next_fill % bundle.depth];
+
+  if(frame->size == 0) {
+    return;
+  }
+
+  frame->compress = bundle.compress;
+  pthread_mutex_lock(&bundle.lock);
+  bundle.next_fill++;
+  pthread_cond_signal(&bundle.work);
+  pthread_mutex_unlock(&bundle.lock);
+  // The slot of the next frame is free once the frame 'depth' before it is written
+  write_frames(bundle.depth - 1);
+  bundle.frames[bundle.next_fill % bundle.depth].size = 0;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  bundle_begin
+    Description:  Starts a zstd bundle on 'fd' with 'threads' compression threads
+                 (at most BUNDLE_MAX_THREADS). Returns 1 on success, 0 on failure.
+   =====================================================================================
+*/
+int bundle_begin(int fd, int threads) {
+  memset(&bundle, 0, sizeof(bundle));
+  bundle.fd = fd;
+  bundle.compress = 1;
+  threads = threads < 1 ? 1 : (threads > BUNDLE_MAX_THREADS ? BUNDLE_MAX_THREADS : threads);
+  bundle.depth = (size_t)threads * BUNDLE_FRAMES_PER_THREAD + 1;
+  bundle.frame_capacity = stored_frame_bound(BUNDLE_FRAME_SIZE);
+#ifdef HAVE_ZSTD
+
+  if(ZSTD_compressBound(BUNDLE_FRAME_SIZE) > bundle.frame_capacity) {
+    bundle.frame_capacity = ZSTD_compressBound(BUNDLE_FRAME_SIZE);
+  }
+
+#else
+  printf("Note: Built without zstd; the bundle stores its files uncompressed.\n");
+#endif
+  bundle.frames = calloc(bundle.depth, sizeof(BundleFrame));
+
+  for(size_t i = 0; bundle.frames && i < bundle.depth; i++) {
+    bundle.frames[i].data = malloc(BUNDLE_FRAME_SIZE);
+    bundle.frames[i].frame = malloc(bundle.frame_capacity);
+
+    if(!bundle.frames[i].data || !bundle.frames[i].frame) {
+      bundle.failed = 1;
+    }
+  }
+
+  if(!bundle.frames || bundle.failed) {
+    perror("Failed to allocate memory for the zstd bundle");
+    bundle.failed = 1;
+    return 0;
+  }
+
+  pthread_mutex_init(&bundle.lock, NULL);
+  pthread_cond_init(&bundle.work, NULL);
+  pthread_cond_init(&bundle.done, NULL);
+
+  for(int i = 0; i < threads; i++) {
+    if(pthread_create(&bundle.threads[i], NULL, bundle_worker, NULL) != 0) {
+      break;
+    }
+
+    bundle.thread_count++;
+  }
+
+  if(bundle.thread_count == 0) {
+    perror("Failed to start the compression threads");
+    bundle.failed = 1;
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  bundle_member
+    Description:  Called after the tar header of a member: its 'size' bytes of data
+                 start a new frame, are listed in the index under 'name', and are
+                 compressed unless worth_compressing() says otherwise.
+                 Returns 1 on success, 0 on failure.
+   =====================================================================================
+*/
+int bundle_member(const char *name, unsigned long long size) {
+  if(bundle.failed) {
+    return 0;
+  }
+
+  submit_frame();
+
+  if(bundle.index_count == bundle.index_capacity) {
+    size_t capacity = bundle.index_capacity ? bundle.index_capacity * 2 : 64;
+    IndexEntry *index = realloc(bundle.index, capacity * sizeof(IndexEntry));
+
+    if(!index) {
+      console_error("Error: Failed to allocate memory for the bundle index\n");
+      bundle.failed = 1;
+      return 0;
+    }
+
+    bundle.index = index;
+    bundle.index_capacity = capacity;
+  }
+
+  IndexEntry *entry = &bundle.index[bundle.index_count];
+  entry->offset = bundle.offset;
+  entry->size = size;
+
+  if(!(entry->name = strdup(name))) {
+    console_error("Error: Failed to allocate memory for the bundle index\n");
+    bundle.failed = 1;
+    return 0;
+  }
+
+  bundle.index_count++;
+  bundle.compress = worth_compressing(name);
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  bundle_write
+    Description:  Appends 'size' bytes of the tar stream. Returns 1 on success.
+   =====================================================================================
+*/
+int bundle_write(const void *data, size_t size) {
+  const unsigned char *bytes = data;
+
+  while(!bundle.failed && size > 0) {
+    BundleFrame *frame = &bundle.frames[bundle.next_fill % bundle.depth];
+    size_t room = BUNDLE_FRAME_SIZE - frame->size;
+    size_t n = size < room ? size : room;
+    memcpy(frame->data + frame->size, bytes, n);
+    frame->size += n;
+    bundle.offset += n;
+    bytes += n;
+    size -= n;
+
+    if(frame->size == BUNDLE_FRAME_SIZE) {
+      submit_frame();
+    }
+  }
+
+  return !bundle.failed;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  bundle_copy
+    Description:  Reads 'size' bytes of 'in' straight into the frames, hashing them
+                 into 'sum' unless NULL. Same contract as copy_to_stream(): returns
+                 1 on success, 0 if 'in' ended early and -1 on error.
+   =====================================================================================
+*/
+int bundle_copy(int in, off_t size, ChecksumState *sum, off_t *copied) {
+  double started = monotonic_seconds();
+  *copied = 0;
+  posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  while(*copied < size) {
+    if(bundle.failed) {
+      return -1;
+    }
+
+    BundleFrame *frame = &bundle.frames[bundle.next_fill % bundle.depth];
+    size_t room = BUNDLE_FRAME_SIZE - frame->size;
+    size_t want = throttle_io(size - *copied < (off_t)room ? (size_t)(size - *copied) : room);
+    ssize_t n = read(in, frame->data + frame->size, want);
+
+    if(n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if(n <= 0) {
+      return n == 0 ? 0 : -1;
+    }
+
+    if(sum) {
+      checksum_update(sum, frame->data + frame->size, (size_t)n);
+    }
+
+    frame->size += (size_t)n;
+    bundle.offset += (unsigned long long)n;
+    *copied += n;
+    progress_advance((unsigned long long)n);
+
+    if(copy_options.drop_cache && (*copied - n) / CACHE_WINDOW != *copied / CACHE_WINDOW) {
+      posix_fadvise(in, 0, *copied, POSIX_FADV_DONTNEED);
+    }
+
+    if(frame->size == BUNDLE_FRAME_SIZE) {
+      submit_frame();
+    }
+  }
+
+  record_copy(COPY_METHOD_READ_WRITE, (unsigned long long)*copied, started);
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  write_trailer
+    Description:  Writes the index and the seek table after the last frame.
+                 Returns 1 on success, 0 on failure.
+   =====================================================================================
+*/
+static int write_trailer(void) {
+  size_t index_size = 16;
+
+  for(size_t i = 0; i < bundle.index_count; i++) {
+    index_size += 18 + strlen(bundle.index[i].name);
+  }
+
+  size_t table_size = 8 + bundle.seek_count * 12 + 9;
+  unsigned char *trailer = malloc(index_size + table_size);
+
+  if(!trailer) {
+    console_error("Error: Failed to allocate memory for the bundle index\n");
+    return 0;
+  }
+
+  unsigned char *p = trailer;
+  put_le32(p, BUNDLE_INDEX_MAGIC);
+  put_le32(p + 4, (uint32_t)(index_size - 8));
+  memcpy(p + 8, INDEX_TAG, 4);
+  put_le32(p + 12, (uint32_t)bundle.index_count);
+  p += 16;
+
+  for(size_t i = 0; i < bundle.index_count; i++) {
+    size_t length = strlen(bundle.index[i].name);
+    put_le64(p, bundle.index[i].offset);
+    put_le64(p + 8, bundle.index[i].size);
+    p[16] = (unsigned char)length;
+    p[17] = (unsigned char)(length >> 8);
+    memcpy(p + 18, bundle.index[i].name, length);
+    p += 18 + length;
+  }
+
+  put_le32(p, BUNDLE_SEEK_TABLE_MAGIC);
+  put_le32(p + 4, (uint32_t)(table_size - 8));
+  p += 8;
+
+  for(size_t i = 0; i < bundle.seek_count; i++) {
+    put_le32(p, bundle.seek[i].compressed);
+    put_le32(p + 4, bundle.seek[i].decompressed);
+    put_le32(p + 8, bundle.seek[i].checksum);
+    p += 12;
+  }
+
+  // The footer: frame count, descriptor with the checksum flag, seekable magic
+  put_le32(p, (uint32_t)bundle.seek_count);
+  p[4] = 0x80;
+  put_le32(p + 5, BUNDLE_SEEKABLE_MAGIC);
+  int ok = write_bytes(trailer, index_size + table_size);
+  free(trailer);
+  return ok;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  bundle_end
+    Description:  Compresses and writes the frames still in flight, stops the
+                 workers and, if the bundle 'completed', writes the index and seek
+                 table. Returns 1 on success, 0 on failure.
+   =====================================================================================
+*/
+int bundle_end(int completed) {
+  if(!bundle.frames) {
+    return 0;
+  }
+
+  if(bundle.thread_count > 0) {
+    if(!bundle.failed) {
+      submit_frame();
+    }
+
+    pthread_mutex_lock(&bundle.lock);
+    bundle.stop = 1;
+    pthread_cond_broadcast(&bundle.work);
+    pthread_mutex_unlock(&bundle.lock);
+
+    for(int i = 0; i < bundle.thread_count; i++) {
+      pthread_join(bundle.threads[i], NULL);
+    }
+
+    write_frames(0);
+  }
+
+  int ok = completed && !bundle.failed && write_trailer();
+
+  if(ok) {
+    printf("Compressed %.1f MiB into %.1f MiB: %zu frame(s), %zu stored\n", (double)bundle.offset / (1024.0 * 1024.0),
+           (double)bundle.written / (1024.0 * 1024.0), bundle.seek_count, bundle.stored_frames);
+  }
+
+  for(size_t i = 0; i < bundle.depth; i++) {
+    free(bundle.frames[i].data);
+    free(bundle.frames[i].frame);
+  }
+
+  for(size_t i = 0; i < bundle.index_count; i++) {
+    free(bundle.index[i].name);
+  }
+
+  free(bundle.frames);
+  free(bundle.seek);
+  free(bundle.index);
+
+  if(bundle.thread_count > 0) {
+    pthread_cond_destroy(&bundle.work);
+    pthread_cond_destroy(&bundle.done);
+    pthread_mutex_destroy(&bundle.lock);
+  }
+
+  memset(&bundle, 0, sizeof(bundle));
+  return ok;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  read_at
+    Description:  pread() of exactly 'size' bytes. Returns 1 on success, 0 on a short
+                 read or error.
+   =====================================================================================
+*/
+static int read_at(int fd, void *buffer, size_t size, off_t offset) {
+  size_t done = 0;
+
+  while(done < size) {
+    ssize_t n = pread(fd, (char *)buffer + done, size - done, offset + (off_t)done);
+
+    if(n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if(n <= 0) {
+      return 0;
+    }
+
+    done += (size_t)n;
+  }
+
+  return 1;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  decode_frame
+    Description:  Decompresses one frame of 'decompressed' bytes into 'out'.
+                 Returns 1 on success, 0 if the frame is damaged or compressed
+                 while zstd support is not built in.
+   =====================================================================================
+*/
+static int decode_frame(const unsigned char *frame, size_t frame_size, unsigned char *out, size_t decompressed) {
+  ssize_t stored = read_stored_frame(frame, frame_size, out, decompressed);
+
+  if(stored >= 0) {
+    return (size_t)stored == decompressed;
+  }
+
+#ifdef HAVE_ZSTD
+  size_t n = ZSTD_decompress(out, decompressed, frame, frame_size);
+  return !ZSTD_isError(n) && n == decompressed;
+#else
+  fprintf(stderr, "Error: The bundle has compressed frames, and this build has no zstd support.\n");
+  return 0;
+#endif
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  extract_member
+    Description:  Writes the member at 'offset' of 'size' bytes in the tar stream to
+                 'out', decompressing only the frames that hold it.
+                 Returns 1 on success, 0 on failure.
+   =====================================================================================
+*/
+static int extract_member(int fd, const unsigned char *table, size_t frames, const unsigned long long *frame_offsets,
+                          const unsigned long long *data_offsets, unsigned long long offset, unsigned long long size, int out) {
+  unsigned long long end = offset + size;
+  size_t first = 0;
+  size_t last = frames;
+  int ok = 1;
+
+  // Binary search for the frame holding 'offset'
+  while(first + 1 < last) {
+    size_t middle = (first + last) / 2;
+
+    if(data_offsets[middle] <= offset) {
+      first = middle;
+    }
+
+    else {
+      last = middle;
+    }
+  }
+
+  unsigned char *frame = NULL;
+  unsigned char *data = NULL;
+
+  for(size_t i = first; ok && i < frames && data_offsets[i] < end; i++) {
+    const unsigned char *entry = table + 8 + i * 12;
+    size_t compressed = get_le32(entry);
+    size_t decompressed = get_le32(entry + 4);
+    unsigned char *grown_frame = realloc(frame, compressed ? compressed : 1);
+    unsigned char *grown_data = realloc(data, decompressed ? decompressed : 1);
+    frame = grown_frame ? grown_frame : frame;
+    data = grown_data ? grown_data : data;
+    ok = grown_frame && grown_data && read_at(fd, frame, compressed, (off_t)frame_offsets[i]) &&
+         decode_frame(frame, compressed, data, decompressed) && frame_checksum(data, decompressed) == get_le32(entry + 8);
+
+    if(!ok) {
+      fprintf(stderr, "Error: Frame %zu of the bundle is damaged.\n", i);
+      break;
+    }
+
+    unsigned long long from = offset > data_offsets[i] ? offset - data_offsets[i] : 0;
+    unsigned long long to = end < data_offsets[i + 1] ? end - data_offsets[i] : decompressed;
+
+    for(unsigned long long written = from; ok && written < to;) {
+      ssize_t n = write(out, data + written, (size_t)(to - written));
+
+      if(n < 0 && errno == EINTR) {
+        continue;
+      }
+
+      if(n <= 0) {
+        perror("Failed to write the extracted file");
+        ok = 0;
+      }
+
+      written += n > 0 ? (unsigned long long)n : 0;
+    }
+  }
+
+  free(frame);
+  free(data);
+  return ok;
+}
+
+/*
+   ===  FUNCTION  ======================================================================
+           Name:  extract_from_bundle
+    Description:  The `extract` subcommand. Lists the members of 'bundle_path' when
+                 'member' is NULL; otherwise writes that member to 'output', or to
+                 stdout when 'output' is NULL or "-". Only the seek table, the
+                 index and the member's own frames are read.
+                 Returns 1 on success, 0 on failure.
+   =====================================================================================
+*/
+int extract_from_bundle(const char *bundle_path, const char *member, const char *output) {
+  int fd = open(bundle_path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  unsigned char footer[9];
+
+  if(fd < 0 || fstat(fd, &st) != 0) {
+    perror("Failed to open the bundle");
+
+    if(fd >= 0) {
+      close(fd);
+    }
+
+    return 0;
+  }
+
+  unsigned long long file_size = (unsigned long long)st.st_size;
+  unsigned long long frames = 0;
+  unsigned long long table_size = 0;
+
+  if(file_size >= sizeof(footer) && read_at(fd, footer, sizeof(footer), (off_t)(file_size - sizeof(footer))) &&
+     get_le32(footer + 5) == BUNDLE_SEEKABLE_MAGIC && footer[4] == 0x80) {
+    frames = get_le32(footer);
+    table_size = 8 + frames * 12 + 9;
+  }
+
+  unsigned char *table = table_size && table_size <= file_size ? malloc(table_size) : NULL;
+  unsigned long long *frame_offsets = table ? malloc((frames + 1) * sizeof(unsigned long long)) : NULL;
+  unsigned long long *data_offsets = table ? malloc((frames + 1) * sizeof(unsigned long long)) : NULL;
+  unsigned char *index = NULL;
+  unsigned long long index_size = 0;
+  int ok = table && frame_offsets && data_offsets &&
+           read_at(fd, table, table_size, (off_t)(file_size - table_size)) &&
+           get_le32(table) == BUNDLE_SEEK_TABLE_MAGIC && get_le32(table + 4) == table_size - 8;
+
+  if(ok) {
+    frame_offsets[0] = data_offsets[0] = 0;
+
+    for(size_t i = 0; i < frames; i++) {
+      frame_offsets[i + 1] = frame_offsets[i] + get_le32(table + 8 + i * 12);
+      data_offsets[i + 1] = data_offsets[i] + get_le32(table + 8 + i * 12 + 4);
+    }
+
+    // The index sits between the last frame and the seek table
+    unsigned char header[16];
+    ok = frame_offsets[frames] + sizeof(header) <= file_size - table_size &&
+         read_at(fd, header, sizeof(header), (off_t)frame_offsets[frames]) &&
+         get_le32(header) == BUNDLE_INDEX_MAGIC && memcmp(header + 8, INDEX_TAG, 4) == 0;
+    index_size = ok ? get_le32(header + 4) : 0;
+    ok = ok && frame_offsets[frames] + 8 + index_size == file_size - table_size && (index = malloc(index_size + 1)) &&
+         read_at(fd, index, index_size, (off_t)frame_offsets[frames] + 8);
+  }
+
+  if(!ok) {
+    fprintf(stderr, "Error: %s is not a seekable zstd bundle.\n", bundle_path);
+  }
+
+  int found = 0;
+  size_t count = ok ? get_le32(index + 4) : 0;
+  const unsigned char *p = index ? index + 8 : NULL;
+
+  for(size_t i = 0; ok && i < count; i++) {
+    size_t length = (p + 18 <= index + index_size) ? (size_t)p[16] | (size_t)p[17] << 8 : (size_t)-1;
+
+    if(length > (size_t)(index + index_size - p - 18)) {
+      fprintf(stderr, "Error: The index of %s is damaged.\n", bundle_path);
+      ok = 0;
+      break;
+    }
+
+    unsigned long long offset = get_le64(p);
+    unsigned long long size = get_le64(p + 8);
+    const char *name = (const char *)p + 18;
+    p += 18 + length;
+
+    if(!member) {
+      printf("%12llu  %.*s\n", size, (int)length, name);
+      continue;
+    }
+
+    if(length != strlen(member) || memcmp(name, member, length) != 0) {
+      continue;
+    }
+
+    if(offset + size > data_offsets[frames]) {
+      fprintf(stderr, "Error: The index of %s is damaged.\n", bundle_path);
+      ok = 0;
+      break;
+    }
+
+    int out = output && strcmp(output, "-") != 0 ? open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : STDOUT_FILENO;
+
+    if(out < 0) {
+      perror("Failed to create the extracted file");
+      ok = 0;
+      break;
+    }
+
+    ok = extract_member(fd, table, frames, frame_offsets, data_offsets, offset, size, out);
+
+    if(out != STDOUT_FILENO && close(out) != 0 && ok) {
+      perror("Failed to write the extracted file");
+      ok = 0;
+    }
+
+    found = 1;
+    break;
+  }
+
+  if(ok && member && !found) {
+    fprintf(stderr, "Error: %s is not in %s.\n", member, bundle_path);
+    ok = 0;
+  }
+
+  close(fd);
+  free(table);
+  free(frame_offsets);
+  free(data_offsets);
+  free(index);
+  return ok;
+}
@@ -0,0 +1,28 @@
+#ifndef ZSTD_BUNDLE_H
+#define ZSTD_BUNDLE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "hash.h"
+
+// Uncompressed bytes per zstd frame: the most extract decompresses for one byte
+#define  BUNDLE_FRAME_SIZE  (1024 * 1024)
+// Most compression threads, and frames in flight per thread
+#define  BUNDLE_MAX_THREADS  16
+#define  BUNDLE_FRAMES_PER_THREAD  2
+// zstd level of the frames that are compressed
+#define  BUNDLE_ZSTD_LEVEL  3
+
+// Skippable frames after the data: the member index and the seek table
+#define  BUNDLE_INDEX_MAGIC      0x184D2A5BU
+#define  BUNDLE_SEEK_TABLE_MAGIC 0x184D2A5EU
+#define  BUNDLE_SEEKABLE_MAGIC   0x8F92EAB1U
+
+int bundle_begin(int fd, int threads);
+int bundle_member(const char *name, unsigned long long size);
+int bundle_write(const void *data, size_t size);
+int bundle_copy(int in, off_t size, ChecksumState *sum, off_t *copied);
+int bundle_end(int completed);
+int extract_from_bundle(const char *bundle, const char *member, const char *output);
+
+#endif // ZSTD_BUNDLE_H